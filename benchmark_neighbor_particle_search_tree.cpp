@@ -0,0 +1,331 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "neighbor_particle_search_tree.hpp"
+
+//Benchmark of build and query throughput. Every row is checked against a cell list oracle.
+//usage: ./a.out [-n 1000,10000,...] [-d uniform,plummer,sheet] [-b tree,grid,auto] [-t 1,4,...] [-q num_query] [-k num_neighbor]
+
+constexpr int DIM = 3;
+using Tree3 = Tree::StaticNeighborParticleSearchTree<DIM>;
+
+struct Option {
+    std::vector<int> size                 = {1000, 10000, 100000, 1000000};
+    std::vector<std::string> distribution = {"uniform", "plummer", "sheet"};
+    std::vector<std::string> backend      = {"tree"};
+    std::vector<int> thread;
+    int num_query    = 100000;
+    int num_neighbor = 32;
+    int num_check    = 200;
+};
+
+template <typename T>
+std::vector<T> SplitList(const char* arg) {
+    std::vector<T> list;
+    std::string s(arg);
+    std::size_t begin = 0;
+    while(begin <= s.size()) {
+        std::size_t end = s.find(',', begin);
+        if(end == std::string::npos)
+            end = s.size();
+        const std::string item = s.substr(begin, end - begin);
+        if(!item.empty()) {
+            if constexpr (std::is_same<T, std::string>::value)
+                list.emplace_back(item);
+            else
+                list.emplace_back(static_cast<T>(std::atof(item.c_str())));
+        }
+        begin = end + 1;
+    }
+    return list;
+}
+
+void SetNumThread(int num_thread) {
+#ifdef _OPENMP
+    omp_set_num_threads(num_thread);
+#else
+    (void)num_thread;
+#endif
+}
+
+double Now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//Particles in the unit box with about num_neighbor particles inside their search radius.
+//uniform: the whole box. plummer: Plummer sphere of scale radius 0.05 at the center, cut at 0.45. sheet: slab of thickness 1e-3.
+void MakeParticle(const std::string& distribution, int num, int num_neighbor, std::mt19937& mt, std::vector<double>& pos, std::vector<double>& radius) {
+    std::uniform_real_distribution<double> uni(0, 1);
+    pos.resize(DIM*std::size_t(num));
+    radius.resize(num);
+    const double fraction = static_cast<double>(num_neighbor)/num;
+    for(int i = 0;i<num;++i) {
+        double* x = &pos[DIM*std::size_t(i)];
+        double h;
+        if(distribution == "plummer") {
+            constexpr double a = 0.05;
+            double r;
+            do {
+                r = a/std::sqrt(std::pow(uni(mt), -2.0/3.0) - 1);
+            } while(!(r < 0.45));
+            const double cos_theta = 2*uni(mt) - 1, phi = 2*M_PI*uni(mt), sin_theta = std::sqrt(1 - cos_theta*cos_theta);
+            x[0] = 0.5 + r*sin_theta*std::cos(phi);
+            x[1] = 0.5 + r*sin_theta*std::sin(phi);
+            x[2] = 0.5 + r*cos_theta;
+            h    = a*std::cbrt(fraction)*std::pow(1 + r*r/(a*a), 5.0/6.0);
+        }else if(distribution == "sheet") {
+            x[0] = uni(mt);
+            x[1] = uni(mt);
+            x[2] = 0.5 + 1e-3*(uni(mt) - 0.5);
+            h    = std::sqrt(fraction/M_PI);
+        }else if(distribution == "uniform") {
+            for(int dim = 0;dim<DIM;++dim)
+                x[dim] = uni(mt);
+            h = std::cbrt(3*fraction/(4*M_PI));
+        }else {
+            std::printf("unknown distribution %s\n", distribution.c_str());
+            std::exit(EXIT_FAILURE);
+        }
+        radius[i] = std::min(0.25, h*(0.8 + 0.4*uni(mt)));
+    }
+}
+
+//Reference neighbor search on a uniform grid of cells, independent of the tree.
+//Particles with a search radius larger than a cell are kept aside and checked one by one in SYMMETRY mode.
+class CellListOracle {
+public:
+    CellListOracle(const std::vector<double>& pos, const std::vector<double>& radius, bool periodic):m_pos(pos), m_radius(radius), m_periodic(periodic) {
+        const int num = static_cast<int>(radius.size());
+        std::vector<double> sorted(radius);
+        std::nth_element(sorted.begin(), sorted.begin() + 9*num/10, sorted.end());
+        const double cell_size = std::max(sorted[9*num/10], 1e-6);
+        m_num_cell  = std::max(1, std::min(static_cast<int>(1/cell_size), static_cast<int>(std::cbrt(num)) + 1));
+        m_cell_size = 1.0/m_num_cell;
+        m_begin.assign(std::size_t(m_num_cell)*m_num_cell*m_num_cell + 1, 0);
+        std::vector<int> cell(num);
+        for(int i = 0;i<num;++i) {
+            cell[i] = CellIndex(&pos[DIM*std::size_t(i)]);
+            ++m_begin[cell[i] + 1];
+            if(radius[i] > m_cell_size)
+                m_large.emplace_back(i);
+        }
+        for(std::size_t c = 1;c<m_begin.size();++c)
+            m_begin[c] += m_begin[c - 1];
+        m_body.resize(num);
+        std::vector<int> fill(m_begin.begin(), m_begin.end() - 1);
+        for(int i = 0;i<num;++i)
+            m_body[fill[cell[i]]++] = i;
+    }
+
+    template <Tree::SearchMode SEARCH_MODE>
+    std::vector<unsigned int> Find(const double* x, double r) const {
+        std::vector<unsigned int> list;
+        const int reach = static_cast<int>(std::ceil(std::max(r, m_cell_size)/m_cell_size));
+        int lower[DIM], upper[DIM];
+        for(int dim = 0;dim<DIM;++dim) {
+            const int c = Clamp(static_cast<int>(x[dim]*m_num_cell));
+            lower[dim] = c - reach;
+            upper[dim] = c + reach;
+            if(upper[dim] - lower[dim] + 1 >= m_num_cell) {
+                lower[dim] = 0;
+                upper[dim] = m_num_cell - 1;
+            }else if(!m_periodic) {
+                lower[dim] = std::max(lower[dim], 0);
+                upper[dim] = std::min(upper[dim], m_num_cell - 1);
+            }
+        }
+        for(int cx = lower[0];cx<=upper[0];++cx)
+            for(int cy = lower[1];cy<=upper[1];++cy)
+                for(int cz = lower[2];cz<=upper[2];++cz) {
+                    const int c = (Wrap(cx)*m_num_cell + Wrap(cy))*m_num_cell + Wrap(cz);
+                    for(int k = m_begin[c];k<m_begin[c + 1];++k) {
+                        const int j = m_body[k];
+                        const double d2 = Distance2(x, j);
+                        if(d2 <= r*r || (SEARCH_MODE == Tree::SearchMode::SYMMETRY && m_radius[j] <= m_cell_size && d2 <= m_radius[j]*m_radius[j]))
+                            list.emplace_back(j);
+                    }
+                }
+        if(SEARCH_MODE == Tree::SearchMode::SYMMETRY)
+            for(int j : m_large) {
+                const double d2 = Distance2(x, j);
+                if(d2 > r*r && d2 <= m_radius[j]*m_radius[j])
+                    list.emplace_back(j);
+            }
+        std::sort(list.begin(), list.end());
+        return list;
+    }
+
+    //true if list equals the reference up to particles whose distance equals the search radius within rounding
+    template <Tree::SearchMode SEARCH_MODE>
+    bool Check(const double* x, double r, std::vector<unsigned int> list) const {
+        std::sort(list.begin(), list.end());
+        const std::vector<unsigned int> ans = Find<SEARCH_MODE>(x, r);
+        std::vector<unsigned int> diff;
+        std::set_symmetric_difference(list.begin(), list.end(), ans.begin(), ans.end(), std::back_inserter(diff));
+        for(unsigned int j : diff) {
+            const double d     = std::sqrt(Distance2(x, j));
+            const bool on_edge = std::abs(d - r) <= 1e-9*r || (SEARCH_MODE == Tree::SearchMode::SYMMETRY && std::abs(d - m_radius[j]) <= 1e-9*m_radius[j]);
+            if(!on_edge)
+                return false;
+        }
+        return true;
+    }
+
+private:
+    const std::vector<double>& m_pos;
+    const std::vector<double>& m_radius;
+    bool m_periodic;
+    int m_num_cell;
+    double m_cell_size;
+    std::vector<int> m_begin, m_body, m_large;
+
+    int Clamp(int c) const {
+        return std::min(std::max(c, 0), m_num_cell - 1);
+    }
+
+    int Wrap(int c) const {
+        return ((c % m_num_cell) + m_num_cell) % m_num_cell;
+    }
+
+    int CellIndex(const double* x) const {
+        return (Clamp(static_cast<int>(x[0]*m_num_cell))*m_num_cell + Clamp(static_cast<int>(x[1]*m_num_cell)))*m_num_cell + Clamp(static_cast<int>(x[2]*m_num_cell));
+    }
+
+    double Distance2(const double* x, int j) const {
+        double d2 = 0;
+        for(int dim = 0;dim<DIM;++dim) {
+            double dx = x[dim] - m_pos[DIM*std::size_t(j) + dim];
+            if(m_periodic)
+                dx -= std::round(dx);
+            d2 += dx*dx;
+        }
+        return d2;
+    }
+};
+
+template <Tree::SearchMode SEARCH_MODE>
+bool RunQuery(const Tree3& tree, const CellListOracle& oracle, const std::vector<double>& pos, const std::vector<double>& radius, const Option& option, double& query_rate, double& batch_rate, double& mean_neighbor) {
+    const int num       = static_cast<int>(radius.size());
+    const int num_query = std::min(num, option.num_query);
+
+    //single queries from the particles, spread over the id range
+    std::size_t total = 0;
+    double start = Now();
+#pragma omp parallel reduction(+:total)
+    {
+        std::vector<unsigned int> list;
+#pragma omp for schedule(dynamic, 64)
+        for(int q = 0;q<num_query;++q) {
+            const std::size_t i = std::size_t(q)*num/num_query;
+            tree.FindNeighborParticle<SEARCH_MODE>(&pos[DIM*i], radius[i], list);
+            total += list.size();
+        }
+    }
+    query_rate    = num_query/(Now() - start);
+    mean_neighbor = static_cast<double>(total)/num_query;
+
+    //all particles at once
+    Tree::CompressedNeighborList all;
+    start = Now();
+    tree.FindAllNeighborParticle<SEARCH_MODE>(all);
+    batch_rate = num/(Now() - start);
+
+    bool ok = all.Size() == static_cast<unsigned int>(num);
+    std::vector<unsigned int> list;
+    for(int c = 0;ok && c<option.num_check;++c) {
+        const std::size_t i = std::size_t(c)*num/option.num_check;
+        tree.FindNeighborParticle<SEARCH_MODE>(&pos[DIM*i], radius[i], list);
+        ok = oracle.Check<SEARCH_MODE>(&pos[DIM*i], radius[i], list) && oracle.Check<SEARCH_MODE>(&pos[DIM*i], radius[i], std::vector<unsigned int>(all.begin(i), all.end(i)));
+    }
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    Option option;
+    option.thread = {1};
+    if(Tree::Detail::MaxThreads() > 1)
+        option.thread.emplace_back(Tree::Detail::MaxThreads());
+    for(int a = 1;a + 1<argc;a += 2) {
+        if(std::strcmp(argv[a], "-n") == 0)
+            option.size = SplitList<int>(argv[a + 1]);
+        else if(std::strcmp(argv[a], "-d") == 0)
+            option.distribution = SplitList<std::string>(argv[a + 1]);
+        else if(std::strcmp(argv[a], "-b") == 0)
+            option.backend = SplitList<std::string>(argv[a + 1]);
+        else if(std::strcmp(argv[a], "-t") == 0)
+            option.thread = SplitList<int>(argv[a + 1]);
+        else if(std::strcmp(argv[a], "-q") == 0)
+            option.num_query = std::atoi(argv[a + 1]);
+        else if(std::strcmp(argv[a], "-k") == 0)
+            option.num_neighbor = std::atoi(argv[a + 1]);
+        else {
+            std::printf("unknown option %s\n", argv[a]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::printf("%-8s %9s %-8s %-9s %-9s %7s %12s %12s %12s %12s %9s %9s %s\n", "dist", "N", "boundary", "backend", "mode", "threads", "insert[ms]", "morton[ms]", "query[1/s]", "all[1/s]", "neighbor", "mem[MB]", "check");
+    bool all_ok = true;
+    std::mt19937 mt(1);
+    const double lower[DIM] = {0, 0, 0}, upper[DIM] = {1, 1, 1};
+    for(const std::string& distribution : option.distribution) {
+        for(int num : option.size) {
+            std::vector<double> pos, radius;
+            MakeParticle(distribution, num, option.num_neighbor, mt, pos, radius);
+            for(bool periodic : {false, true}) {
+                const CellListOracle oracle(pos, radius, periodic);
+                for(const std::string& backend : option.backend) {
+                    Tree3 tree(num);
+                    if(backend == "grid")
+                        tree.SetBackend(Tree::Backend::GRID);
+                    else if(backend == "auto")
+                        tree.SetBackend(Tree::Backend::AUTO);
+                    else if(backend != "tree") {
+                        std::printf("unknown backend %s\n", backend.c_str());
+                        return EXIT_FAILURE;
+                    }
+                    tree.Resize(num);
+                    tree.CopyAllPos(pos.data());
+                    tree.CopyAllSearchRadius(radius.data());
+                    tree.SetDomain(lower, upper);
+                    for(int dim = 0;dim<DIM;++dim)
+                        tree.SetBoundary(dim, periodic ? Tree::Boundary::PERIODIC : Tree::Boundary::OPEN);
+                    for(int num_thread : option.thread) {
+                        SetNumThread(num_thread);
+                        //best of 3 builds
+                        double insertion = 1e30, morton = 1e30;
+                        for(int rep = 0;rep<3;++rep) {
+                            double start = Now();
+                            tree.UpdateTree<Tree::BuildMode::INSERTION>();
+                            insertion = std::min(insertion, Now() - start);
+                            start = Now();
+                            tree.UpdateTree<Tree::BuildMode::MORTON>();
+                            morton = std::min(morton, Now() - start);
+                        }
+                        for(Tree::SearchMode mode : {Tree::SearchMode::GATHER, Tree::SearchMode::SYMMETRY}) {
+                            double query_rate, batch_rate, mean_neighbor;
+                            const bool ok = mode == Tree::SearchMode::GATHER ? RunQuery<Tree::SearchMode::GATHER>(tree, oracle, pos, radius, option, query_rate, batch_rate, mean_neighbor)
+                                                                             : RunQuery<Tree::SearchMode::SYMMETRY>(tree, oracle, pos, radius, option, query_rate, batch_rate, mean_neighbor);
+                            all_ok = all_ok && ok;
+                            const std::string active = tree.ActiveBackend() == Tree::Backend::GRID ? "grid" : "tree";
+                            std::printf("%-8s %9d %-8s %-9s %-9s %7d %12.3f %12.3f %12.4g %12.4g %9.1f %9.2f %s\n", distribution.c_str(), num, periodic ? "periodic" : "open",
+                                        (backend == "auto" ? "auto>" + active : active).c_str(), mode == Tree::SearchMode::GATHER ? "GATHER" : "SYMMETRY", num_thread, 1e3*insertion, 1e3*morton, query_rate, batch_rate, mean_neighbor,
+                                        tree.MemoryFootprint()/1048576.0, ok ? "OK" : "FAILED");
+                            std::fflush(stdout);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return all_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,13 +1,48 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <functional>
 #include <iostream>
 #include <cmath>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+//#define TREE_MPI
+
+#ifdef TREE_MPI
+#include <mpi.h>
+#endif
+
+//#define TREE_NO_SIMD
+
+#if !defined(TREE_NO_SIMD) && defined(__AVX512F__)
+#include <immintrin.h>
+#define TREE_SIMD_AVX512
+#elif !defined(TREE_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define TREE_SIMD_AVX2
+#endif
 
 //#define TREE_DEBUG
+//#define TREE_STATISTICS
 
 #define TREE_PRINTF(dst, ...)                                       \
     {                                                               \
@@ -26,6 +61,15 @@
 #define TREE_PRINT_INFO(...)
 #endif
 
+//Counters of TraversalStatistics, see GetTraversalStatistics. Both expand to nothing unless TREE_STATISTICS is defined.
+#ifdef TREE_STATISTICS
+#define TREE_STATISTICS_COUNT(counter, n) (Tree::Detail::LocalTraversalStatistics().counter += (n))
+#define TREE_STATISTICS_SCOPE Tree::Detail::TraversalScope tree_statistics_scope(m_traversal)
+#else
+#define TREE_STATISTICS_COUNT(counter, n)
+#define TREE_STATISTICS_SCOPE
+#endif
+
 #define TREE_PRINT_ERROR(dst, ...)     \
     {                                  \
         fprintf(stdout, "[ERROR] ");   \
@@ -39,431 +83,4084 @@ namespace Tree {
         SYMMETRY
     };
 
-    class NeighborParticleSearchTree {
-    public:
-        NeighborParticleSearchTree(unsigned int _DIM, unsigned int reserve_number):m_reserve_num(reserve_number), DIM(_DIM), m_NSUB(1<<_DIM){
-            TREE_PRINT_INFO("start\n");
-            m_bodies = new Body[reserve_number];
-            m_boundary_length = new double[_DIM];
+    enum class BuildMode : unsigned char {
+        INSERTION, //insert bodies one by one from the root
+        MORTON,    //sort bodies by Morton key in parallel and emit the tree from the sorted keys
+        REFIT      //reinsert only the bodies that left their leaf since the last build, see SetMaxMoverFraction
+    };
 
-            for(int i = 0;i<reserve_number;++i) {
-                m_bodies[i].type   = Type::Body;
-                m_bodies[i].id     = i;
-            }
-            TREE_PRINT_INFO("finish\n");
-        }
+    enum class Precision : unsigned char {
+        FULL,  //filter leaf bodies in Scalar
+        MIXED  //also keep leaf bodies in float and filter in float first. Only bodies near the search radius are tested again in Scalar, so the result is the same as FULL
+    };
 
-        NeighborParticleSearchTree(const NeighborParticleSearchTree&) = delete;
-        NeighborParticleSearchTree& operator=(const NeighborParticleSearchTree&) = delete;
-        
-        NeighborParticleSearchTree(NeighborParticleSearchTree&& o):
-        m_reserve_num(o.m_reserve_num), m_size(o.m_size), DIM(o.DIM), m_NSUB(o.m_NSUB),
-        m_rsize(o.m_rsize), m_first_call((o.m_first_call)), m_root(o.m_root), 
-        m_bodies(o.m_bodies), m_free_cell(o.m_free_cell), m_boundary_length(o.m_boundary_length) {
-            o.m_root            = nullptr;
-            o.m_bodies          = nullptr;
-            o.m_free_cell       = nullptr;
-            o.m_boundary_length = nullptr;
-        }
-
-        NeighborParticleSearchTree& operator=(NeighborParticleSearchTree&& o) {
-            if (&o == this)
-                return *this;
-            delete [] m_root, delete [] m_bodies, delete [] m_free_cell, delete [] m_boundary_length;
-
-            m_root            = o.m_root;
-            m_bodies          = o.m_bodies;
-            m_free_cell       = o.m_free_cell;
-            m_boundary_length = o.m_boundary_length;
-            
-            m_reserve_num = o.m_reserve_num, m_size = o.m_size, DIM = o.DIM, m_NSUB= o.m_NSUB,
-            m_rsize= o.m_rsize, m_first_call = o.m_first_call, m_root= o.m_root, 
-            m_bodies= o.m_bodies, m_free_cell= o.m_free_cell;
-
-            o.m_root             = nullptr;
-            o.m_bodies           = nullptr;
-            o.m_free_cell        = nullptr;
-            o.m_boundary_length  = nullptr;
+    enum class Backend : unsigned char {
+        TREE, //octree (default)
+        GRID, //uniform grid of cells as wide as the largest search radius, for nearly uniform density and nearly equal search radii
+        AUTO  //GRID if the bodies of UpdateTree look like that, TREE otherwise
+    };
 
-            return *this;
-        }
+    enum class Boundary : unsigned char {
+        OPEN,     //no image (default)
+        PERIODIC, //images every length of the domain along the axis
+        SHEAR     //periodic, and an image across the axis is also shifted along another axis, see SetShear
+    };
 
-        ~NeighborParticleSearchTree() {
-            TREE_PRINT_INFO("start\n");
-            NewTree();
-            Cell* c;
-            while(m_free_cell != nullptr) {
-                c = static_cast<Cell*>(m_free_cell);
-                m_free_cell = c->next;
-                delete c;
-            }
+    //Shape and cost of the last UpdateTree. Filled only when compiled with TREE_STATISTICS, otherwise all zero.
+    struct BuildStatistics {
+        std::uint64_t num_cell       = 0; //cells of the tree
+        std::uint64_t num_leaf       = 0; //leaf cells
+        std::uint64_t num_new_cell   = 0; //cells made by this build. Smaller than num_cell after REFIT, which keeps the cells of the last build
+        std::uint64_t num_insert     = 0; //bodies inserted from the top (all bodies for INSERTION, movers for REFIT, bodies of deepest keys for MORTON)
+        std::uint64_t num_load_step  = 0; //levels descended by these insertions
+        unsigned int max_depth       = 0; //depth of the deepest leaf, root = 0
+        double mean_depth            = 0; //depth of the leaf of a body, averaged over bodies
+        std::size_t bytes            = 0; //MemoryFootprint
+        double expand_box_time       = 0; //seconds spent in fitting the root
+        double insert_time           = 0; //seconds spent in inserting bodies (including the Morton sort)
+        double thread_tree_time      = 0; //seconds spent in laying out the cells and bodies in depth-first order
+        double propagate_time        = 0; //seconds spent in summing the weights of cells
+        double total_time            = 0; //seconds spent in UpdateTree
+    };
 
-            delete m_free_cell;
-            delete[] m_bodies;
-            delete[] m_boundary_length;
-            TREE_PRINT_INFO("finish\n");
+    //Work of the queries summed over all threads since the last ResetTraversalStatistics. Counted only when compiled with TREE_STATISTICS.
+    struct TraversalStatistics {
+        std::uint64_t num_cell_visited  = 0; //cells entered by the walks
+        std::uint64_t num_body_tested   = 0; //bodies whose distance was computed
+        std::uint64_t num_body_accepted = 0; //bodies found, including those of cells taken as a whole by CountNeighborParticle and SumNeighborWeight
+    };
+
+    namespace Detail {
+        inline int MaxThreads() {
+#ifdef _OPENMP
+            return omp_get_max_threads();
+#else
+            return 1;
+#endif
         }
 
-        void Resize(int size) {
-            if(size <= m_reserve_num)
-                m_size = size;
-            else
-                TREE_PRINT_ERROR(stdout, "Size exceeds reserved size\n");
+        inline int ThreadNum() {
+#ifdef _OPENMP
+            return omp_get_thread_num();
+#else
+            return 0;
+#endif
         }
 
-        void CopyPos(double pos_x, unsigned int id, unsigned int dim) {
-            if(id < m_size && dim < DIM)
-                m_bodies[id].position[dim] = pos_x;
-            else
-                TREE_PRINT_ERROR(stdout, "Acces to outside of memory\n");
+        inline int NumThreads() {
+#ifdef _OPENMP
+            return omp_get_num_threads();
+#else
+            return 1;
+#endif
         }
 
-        void CopySearchRadius(double search_radius, unsigned int id) {
-            if(id < m_size)
-                m_bodies[id].search_radius = search_radius;
-            else
-                TREE_PRINT_ERROR(stdout, "Acces to outside of memory\n");
+        struct MortonKey {
+            std::uint64_t key;
+            unsigned int id;
+        };
+
+        //Morton key of the cell coordinates ix[dim] < 2^bits. Dimension 0 is the most significant bit of each digit.
+        template <unsigned int DIM>
+        std::uint64_t InterleaveBits(const std::uint64_t* ix, unsigned int bits) {
+            std::uint64_t key = 0;
+            for(int bit = bits-1;bit >= 0;--bit)
+                for(unsigned int dim = 0;dim<DIM;++dim)
+                    key = (key << 1) | ((ix[dim] >> bit) & 1);
+            return key;
         }
 
-        double GetPos(unsigned int id, unsigned int dim) {
-            if(id < m_size && dim < DIM)
-                return m_bodies[id].position[dim];
-            else
-                TREE_PRINT_ERROR(stdout, "Acces to outside of memory\n");
+        //Stable LSD radix sort of the lowest key_bits bits, 8 bits per pass. Each thread histograms and scatters its own chunk.
+        inline void RadixSort(std::vector<MortonKey>& keys, std::vector<MortonKey>& tmp, unsigned int key_bits) {
+            constexpr unsigned int RADIX = 256;
+            const std::size_t n = keys.size();
+            std::vector<std::size_t> offset(RADIX*MaxThreads());
+            bool skip = false;
+            tmp.resize(n);
+
+            for(unsigned int shift = 0;shift < key_bits;shift += 8) {
+#pragma omp parallel
+                {
+                    const int tid         = ThreadNum();
+                    const int nthreads    = NumThreads();
+                    const std::size_t beg = n*tid/nthreads, end = n*(tid+1)/nthreads;
+                    std::size_t* hist     = offset.data() + RADIX*tid;
+
+                    for(unsigned int d = 0;d<RADIX;++d)
+                        hist[d] = 0;
+                    for(std::size_t i = beg;i<end;++i)
+                        ++hist[(keys[i].key >> shift) & (RADIX-1)];
+#pragma omp barrier
+#pragma omp single
+                    {
+                        std::size_t sum = 0;
+                        skip = false;
+                        for(unsigned int d = 0;d<RADIX;++d) {
+                            std::size_t count = 0;
+                            for(int t = 0;t<nthreads;++t) {
+                                std::size_t c = offset[RADIX*t + d];
+                                offset[RADIX*t + d] = sum;
+                                sum   += c;
+                                count += c;
+                            }
+                            if(count == n)
+                                skip = true; //every key has the same digit
+                        }
+                    }
+                    if(!skip)
+                        for(std::size_t i = beg;i<end;++i)
+                            tmp[hist[(keys[i].key >> shift) & (RADIX-1)]++] = keys[i];
+                }
+                if(!skip)
+                    keys.swap(tmp);
+            }
         }
-        
-        void UpdateTree() {
-            TREE_PRINT_INFO("start\n");
-            Body* p;
-            NewTree();
-            m_root = MakeCell();
-            m_root->ClearPosition(DIM);
-            ExpandBox();
-            for(p = m_bodies;p<m_bodies+m_size;++p)
-                LoadBody(p);
-            //PropagateInfo(m_root, m_rsize, 0);
-            ThreadTree(m_root,nullptr);
-            TREE_PRINT_INFO("finish\n");
+
+        inline unsigned int CountTrailingZero(unsigned int bits) {
+#if defined(__GNUC__) || defined(__clang__)
+            return __builtin_ctz(bits);
+#else
+            unsigned int n = 0;
+            while(!(bits & 1u))
+                bits >>= 1, ++n;
+            return n;
+#endif
         }
-        
-        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
-        void FindNeighborParticle(const double* pos, const double radius, std::vector<unsigned int>& interaction_list, bool clear = true) {
-            TREE_PRINT_INFO("start\n");
-            if(clear)
-                interaction_list.clear();
-            WalkTree<SEARCH_MODE>(pos,radius,interaction_list,m_root,m_rsize);
-            TREE_PRINT_INFO("finish\n");
+
+        //counters of the walks running on this thread, added to the tree by TraversalScope
+        inline TraversalStatistics& LocalTraversalStatistics() {
+            thread_local TraversalStatistics statistics;
+            return statistics;
         }
 
-        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
-        void FindNeighborParticleWithPeriodicBoundary(const double* pos, const double radius, const double* boundary_length, std::vector<unsigned int>& interaction_list, bool clear = true) {
-            TREE_PRINT_INFO("start\n");
-            if(clear)
-                interaction_list.clear();
-            for(int dim = 0;dim < DIM; ++dim)
-                m_boundary_length[dim] = boundary_length[dim];
-            WalkTreeWithPeriodicBoundary<SEARCH_MODE>(pos,radius,interaction_list,m_root,m_rsize);
-            TREE_PRINT_INFO("finish\n");
+        //TraversalStatistics of a tree, updated from any thread
+        struct SharedTraversalStatistics {
+            std::atomic<std::uint64_t> num_cell_visited{0}, num_body_tested{0}, num_body_accepted{0};
+
+            SharedTraversalStatistics() = default;
+            SharedTraversalStatistics(SharedTraversalStatistics&& other) noexcept {
+                Add(other.Load());
+            }
+            SharedTraversalStatistics& operator=(SharedTraversalStatistics&& other) noexcept {
+                Reset();
+                Add(other.Load());
+                return *this;
+            }
+
+            void Add(const TraversalStatistics& s) {
+                num_cell_visited.fetch_add(s.num_cell_visited, std::memory_order_relaxed);
+                num_body_tested.fetch_add(s.num_body_tested, std::memory_order_relaxed);
+                num_body_accepted.fetch_add(s.num_body_accepted, std::memory_order_relaxed);
+            }
+
+            TraversalStatistics Load() const {
+                return {num_cell_visited.load(std::memory_order_relaxed), num_body_tested.load(std::memory_order_relaxed), num_body_accepted.load(std::memory_order_relaxed)};
+            }
+
+            void Reset() {
+                num_cell_visited  = 0;
+                num_body_tested   = 0;
+                num_body_accepted = 0;
+            }
+        };
+
+        //Counts of this thread made during the lifetime of the scope go to shared, and the counts of an enclosing scope are kept apart.
+        //So a walk costs no atomic operation, and a query nested in another (of the same tree or not) is counted once.
+        class TraversalScope {
+        public:
+            explicit TraversalScope(SharedTraversalStatistics& shared):m_shared(shared), m_outer(LocalTraversalStatistics()) {
+                LocalTraversalStatistics() = TraversalStatistics();
+            }
+
+            TraversalScope(const TraversalScope&) = delete;
+            TraversalScope& operator=(const TraversalScope&) = delete;
+
+            ~TraversalScope() {
+                m_shared.Add(LocalTraversalStatistics());
+                LocalTraversalStatistics() = m_outer;
+            }
+
+        private:
+            SharedTraversalStatistics& m_shared;
+            TraversalStatistics m_outer;
+        };
+
+        inline double Now() {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
         }
 
-    private:
-        enum class Type : unsigned char {
-            Body = 0,
-            Cell,
+        //Read-only view of element (i, dim) at data[stride*i + dim_stride*dim], either in the tree or in a caller-owned buffer
+        template <typename Scalar>
+        struct StridedArray {
+            const Scalar* data = nullptr;
+            std::size_t stride = 0;
+            std::size_t dim_stride = 0;
+
+            const Scalar& operator()(std::size_t i, std::size_t dim = 0) const {
+                return data[stride*i + dim_stride*dim];
+            }
         };
 
-        struct Node {
-            Type type;
-            double position[3];
-            Node* next;
+        //Thin wrapper of the vector registers used by FilterBody. Only specialized for the instruction set enabled at compile time.
+        template <typename Scalar>
+        struct Simd {
+            static constexpr bool ENABLED = false;
         };
 
-        struct Body:public Node {
-            unsigned int id;
-            double search_radius = 0;
+#if defined(TREE_SIMD_AVX512)
+        template <>
+        struct Simd<double> {
+            static constexpr bool ENABLED = true;
+            static constexpr unsigned int WIDTH = 8;
+            using Reg  = __m512d;
+            using Mask = __mmask8;
+            static Reg Set1(double x) { return _mm512_set1_pd(x); }
+            static Reg Load(const double* p) { return _mm512_loadu_pd(p); }
+            static void Store(double* p, Reg a) { _mm512_storeu_pd(p, a); }
+            static Reg LoadPartial(const double* p, unsigned int n) { return _mm512_maskz_loadu_pd(static_cast<__mmask8>((1u << n) - 1), p); }
+            static Reg Add(Reg a, Reg b) { return _mm512_add_pd(a, b); }
+            static Reg Sub(Reg a, Reg b) { return _mm512_sub_pd(a, b); }
+            static Reg Mul(Reg a, Reg b) { return _mm512_mul_pd(a, b); }
+            static Mask LessEqual(Reg a, Reg b) { return _mm512_cmp_pd_mask(a, b, _CMP_LE_OQ); }
+            static Mask Less(Reg a, Reg b) { return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ); }
+            static Mask Greater(Reg a, Reg b) { return _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ); }
+            static Mask Or(Mask a, Mask b) { return a | b; }
+            static Reg Select(Mask m, Reg a, Reg b) { return _mm512_mask_blend_pd(m, b, a); }
+            static unsigned int Bits(Mask m) { return m; }
         };
 
-        struct Cell:public Node {
-            double max_search_radius = 0;
-            bool flag = false;
-            Node* more = nullptr;
-            Node** subP;
+        template <>
+        struct Simd<float> {
+            static constexpr bool ENABLED = true;
+            static constexpr unsigned int WIDTH = 16;
+            using Reg  = __m512;
+            using Mask = __mmask16;
+            static Reg Set1(float x) { return _mm512_set1_ps(x); }
+            static Reg Load(const float* p) { return _mm512_loadu_ps(p); }
+            static void Store(float* p, Reg a) { _mm512_storeu_ps(p, a); }
+            static Reg LoadPartial(const float* p, unsigned int n) { return _mm512_maskz_loadu_ps(static_cast<__mmask16>((1u << n) - 1), p); }
+            static Reg Add(Reg a, Reg b) { return _mm512_add_ps(a, b); }
+            static Reg Sub(Reg a, Reg b) { return _mm512_sub_ps(a, b); }
+            static Reg Mul(Reg a, Reg b) { return _mm512_mul_ps(a, b); }
+            static Mask LessEqual(Reg a, Reg b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+            static Mask Less(Reg a, Reg b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+            static Mask Greater(Reg a, Reg b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+            static Mask Or(Mask a, Mask b) { return a | b; }
+            static Reg Select(Mask m, Reg a, Reg b) { return _mm512_mask_blend_ps(m, b, a); }
+            static unsigned int Bits(Mask m) { return m; }
+        };
+#elif defined(TREE_SIMD_AVX2)
+        template <>
+        struct Simd<double> {
+            static constexpr bool ENABLED = true;
+            static constexpr unsigned int WIDTH = 4;
+            using Reg  = __m256d;
+            using Mask = __m256d;
+            static Reg Set1(double x) { return _mm256_set1_pd(x); }
+            static Reg Load(const double* p) { return _mm256_loadu_pd(p); }
+            static void Store(double* p, Reg a) { _mm256_storeu_pd(p, a); }
+            static Reg LoadPartial(const double* p, unsigned int n) { return _mm256_maskload_pd(p, _mm256_cmpgt_epi64(_mm256_set1_epi64x(n), _mm256_setr_epi64x(0, 1, 2, 3))); }
+            static Reg Add(Reg a, Reg b) { return _mm256_add_pd(a, b); }
+            static Reg Sub(Reg a, Reg b) { return _mm256_sub_pd(a, b); }
+            static Reg Mul(Reg a, Reg b) { return _mm256_mul_pd(a, b); }
+            static Mask LessEqual(Reg a, Reg b) { return _mm256_cmp_pd(a, b, _CMP_LE_OQ); }
+            static Mask Less(Reg a, Reg b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+            static Mask Greater(Reg a, Reg b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+            static Mask Or(Mask a, Mask b) { return _mm256_or_pd(a, b); }
+            static Reg Select(Mask m, Reg a, Reg b) { return _mm256_blendv_pd(b, a, m); }
+            static unsigned int Bits(Mask m) { return _mm256_movemask_pd(m); }
+        };
 
-            Cell() {}
-            
-            Cell(unsigned char DIM):flag(true) {
-                subP = new Node*[1<<DIM];
-            }
+        template <>
+        struct Simd<float> {
+            static constexpr bool ENABLED = true;
+            static constexpr unsigned int WIDTH = 8;
+            using Reg  = __m256;
+            using Mask = __m256;
+            static Reg Set1(float x) { return _mm256_set1_ps(x); }
+            static Reg Load(const float* p) { return _mm256_loadu_ps(p); }
+            static void Store(float* p, Reg a) { _mm256_storeu_ps(p, a); }
+            static Reg LoadPartial(const float* p, unsigned int n) { return _mm256_maskload_ps(p, _mm256_cmpgt_epi32(_mm256_set1_epi32(n), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7))); }
+            static Reg Add(Reg a, Reg b) { return _mm256_add_ps(a, b); }
+            static Reg Sub(Reg a, Reg b) { return _mm256_sub_ps(a, b); }
+            static Reg Mul(Reg a, Reg b) { return _mm256_mul_ps(a, b); }
+            static Mask LessEqual(Reg a, Reg b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+            static Mask Less(Reg a, Reg b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+            static Mask Greater(Reg a, Reg b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+            static Mask Or(Mask a, Mask b) { return _mm256_or_ps(a, b); }
+            static Reg Select(Mask m, Reg a, Reg b) { return _mm256_blendv_ps(b, a, m); }
+            static unsigned int Bits(Mask m) { return _mm256_movemask_ps(m); }
+        };
+#endif
 
-            void Construct(unsigned int DIM) {
-                subP = new Node*[1<<DIM];
-                flag = true;
-            }
+        //scalar test of body i, see FilterBody
+        template <unsigned int DIM, typename Scalar, SearchMode SEARCH_MODE, bool PERIODIC, typename Function>
+        inline void FilterOneBody(const std::array<const Scalar*, DIM>& x, const Scalar* search_radius, unsigned int i,
+                                  const Scalar* pos, Scalar radius, const Scalar* boundary_length, Function&& emit) {
+            constexpr bool WITH_DISTANCE = std::is_invocable<Function&, unsigned int, Scalar, const Scalar*>::value;
+            Scalar length = 0;
+            Scalar dx[DIM];
 
-            ~Cell() {
-                if(flag) {   
-                    delete[] subP;
+            for(unsigned int dim = 0;dim<DIM;++dim) {
+                dx[dim] = pos[dim] - x[dim][i];
+                if constexpr (PERIODIC) {
+                    if(dx[dim] > Scalar(0.5)*boundary_length[dim])
+                        dx[dim] -= boundary_length[dim];
+                    else if(dx[dim] < -Scalar(0.5)*boundary_length[dim])
+                        dx[dim] += boundary_length[dim];
                 }
+                length += dx[dim] * dx[dim];
             }
 
-            void ClearPosition(unsigned char DIM) {
-                for(int i = 0;i<DIM;++i)
-                    position[i] = 0;
+            bool accept;
+            if constexpr (SEARCH_MODE == SearchMode::GATHER)
+                accept = length <= radius*radius;
+            else if constexpr (SEARCH_MODE == SearchMode::SYMMETRY)
+                accept = (length <= radius*radius) || (length <= search_radius[i] * search_radius[i]);
+
+            if(accept) {
+                if constexpr (WITH_DISTANCE)
+                    emit(i, length, static_cast<const Scalar*>(dx));
+                else
+                    emit(i);
             }
-        };
-        
-        int m_reserve_num;
-        int m_size;
-        Cell* m_root;//root pointer
-        Body* m_bodies;
-        Node* m_free_cell = nullptr;
-        double* m_boundary_length;
-        int DIM;
-        int m_NSUB;
-        double m_rsize = 1;//m_root size
-        bool m_first_call = true;
-
-        void NewTree() {
-            Node* p;
-            if(!m_first_call) {
-                p = m_root;
-                while(p != nullptr) {
-                    if(p->type == Type::Cell) {
-                        p->next = m_free_cell;
-                        m_free_cell = p;
-                        p = static_cast<Cell*>(p)->more;
+        }
+
+        //Calls emit(i) for every body i in [begin, end) of the SoA arrays x[DIM] that lies in the search sphere of pos.
+        //If emit also takes (i, r2, dx), it gets the squared distance and dx[dim] = pos[dim] - x[dim][i] (minimum image if PERIODIC).
+        //SYMMETRY also accepts bodies whose own search_radius covers pos. PERIODIC uses the minimum image of boundary_length.
+        //Arithmetic is the same as the scalar loop, so both paths accept exactly the same bodies.
+        template <unsigned int DIM, typename Scalar, SearchMode SEARCH_MODE, bool PERIODIC, typename Function>
+        inline void FilterBody(const std::array<const Scalar*, DIM>& x, const Scalar* search_radius, unsigned int begin, unsigned int end,
+                               const Scalar* pos, Scalar radius, const Scalar* boundary_length, Function&& emit) {
+            constexpr bool WITH_DISTANCE = std::is_invocable<Function&, unsigned int, Scalar, const Scalar*>::value;
+            if constexpr (Simd<Scalar>::ENABLED) {
+                using S = Simd<Scalar>;
+                using Reg = typename S::Reg;
+                constexpr unsigned int WIDTH = S::WIDTH;
+                const Reg r2 = S::Set1(radius*radius);
+                Reg p[DIM], length_box[DIM], half[DIM], mhalf[DIM];
+                for(unsigned int dim = 0;dim<DIM;++dim) {
+                    p[dim] = S::Set1(pos[dim]);
+                    if constexpr (PERIODIC) {
+                        length_box[dim] = S::Set1(boundary_length[dim]);
+                        half[dim]       = S::Set1(Scalar(0.5)*boundary_length[dim]);
+                        mhalf[dim]      = S::Set1(-Scalar(0.5)*boundary_length[dim]);
+                    }
+                }
+
+                for(unsigned int i = begin;i<end;i += WIDTH) {
+                    const unsigned int n = end - i < WIDTH ? end - i : WIDTH;
+                    auto load = [&](const Scalar* ptr) { return n == WIDTH ? S::Load(ptr + i) : S::LoadPartial(ptr + i, n); };
+
+                    Reg length = S::Set1(0);
+                    Reg dx[DIM];
+                    for(unsigned int dim = 0;dim<DIM;++dim) {
+                        dx[dim] = S::Sub(p[dim], load(x[dim]));
+                        if constexpr (PERIODIC) {
+                            dx[dim] = S::Select(S::Greater(dx[dim], half[dim]), S::Sub(dx[dim], length_box[dim]), dx[dim]);
+                            dx[dim] = S::Select(S::Less(dx[dim], mhalf[dim]), S::Add(dx[dim], length_box[dim]), dx[dim]);
+                        }
+                        length = S::Add(length, S::Mul(dx[dim], dx[dim]));
+                    }
+
+                    auto mask = S::LessEqual(length, r2);
+                    if constexpr (SEARCH_MODE == SearchMode::SYMMETRY) {
+                        const Reg h = load(search_radius);
+                        mask = S::Or(mask, S::LessEqual(length, S::Mul(h, h)));
+                    }
+
+                    unsigned int bits = S::Bits(mask);
+                    if(n < WIDTH)
+                        bits &= (1u << n) - 1;
+                    if(bits == 0)
+                        continue;
+
+                    if constexpr (WITH_DISTANCE) {
+                        Scalar length_lane[WIDTH], dx_lane[DIM][WIDTH];
+                        S::Store(length_lane, length);
+                        for(unsigned int dim = 0;dim<DIM;++dim)
+                            S::Store(dx_lane[dim], dx[dim]);
+                        while(bits) {
+                            const unsigned int k = CountTrailingZero(bits);
+                            Scalar d[DIM];
+                            for(unsigned int dim = 0;dim<DIM;++dim)
+                                d[dim] = dx_lane[dim][k];
+                            emit(i + k, length_lane[k], static_cast<const Scalar*>(d));
+                            bits &= bits - 1;
+                        }
                     }else {
-                        p = p->next;
+                        while(bits) {
+                            emit(i + CountTrailingZero(bits));
+                            bits &= bits - 1;
+                        }
                     }
                 }
             }else {
-                m_first_call = false;
+                for(unsigned int i = begin;i<end;++i)
+                    FilterOneBody<DIM, Scalar, SEARCH_MODE, PERIODIC>(x, search_radius, i, pos, radius, boundary_length, emit);
             }
-            m_root = nullptr;
         }
 
-        Cell* MakeCell() {
-            Cell* c;
-            int i;
-            if(m_free_cell == nullptr) {
-                c = new Cell(DIM);
-            }
-            else {
-                c = static_cast<Cell*>(m_free_cell);
-                m_free_cell = c->next;
+        //FilterBody with a float pre-filter. x_low[DIM] are the positions relative to origin and search_radius_high the search radii, both in float.
+        //margin bounds the float round-off of a distance (search_radius_high already includes it), so a body dropped in float is surely outside.
+        //The remaining bodies go through the Scalar test of FilterBody, which therefore decides exactly as without the pre-filter.
+        template <unsigned int DIM, typename Scalar, SearchMode SEARCH_MODE, bool PERIODIC, typename Function>
+        inline void FilterBodyMixed(const std::array<const float*, DIM>& x_low, const float* search_radius_high,
+                                    const std::array<const Scalar*, DIM>& x, const Scalar* search_radius, unsigned int begin, unsigned int end,
+                                    const Scalar* pos, Scalar radius, const Scalar* boundary_length, const Scalar* origin, Scalar margin, Function&& emit) {
+            constexpr bool WITH_DISTANCE = std::is_invocable<Function&, unsigned int, Scalar, const Scalar*>::value;
+            float pos_low[DIM], boundary_length_low[DIM];
+            for(unsigned int dim = 0;dim<DIM;++dim) {
+                pos_low[dim] = static_cast<float>(pos[dim] - origin[dim]);
+                if constexpr (PERIODIC)
+                    boundary_length_low[dim] = static_cast<float>(boundary_length[dim]);
             }
-            c->type = Type::Cell;
-            for(int i = 0;i<m_NSUB;++i)
-                c->subP[i] = nullptr;
-            c->max_search_radius = 0;
-            return c;
+            //margin leaves room for the rounding of these bounds to float
+            const float radius_high = static_cast<float>(radius + margin);
+            const Scalar radius_low = radius - margin;
+            const float sure2 = radius_low > 0 ? static_cast<float>(radius_low*radius_low) : -1.0f; //surely inside below this
+
+            FilterBody<DIM, float, SEARCH_MODE, PERIODIC>(x_low, search_radius_high, begin, end, pos_low, radius_high, boundary_length_low, [&](unsigned int i, float r2_low, const float*) {
+                if constexpr (!WITH_DISTANCE) {
+                    if(r2_low <= sure2) {
+                        emit(i);
+                        return;
+                    }
+                }
+                FilterOneBody<DIM, Scalar, SEARCH_MODE, PERIODIC>(x, search_radius, i, pos, radius, boundary_length, emit);
+            });
         }
+    }
 
-        void ExpandBox() {
-            m_rsize = 1;
-            double dmax = 0,d;
-            Body* p;
-            for(p = m_bodies;p<m_bodies + m_size;++p) {
-                for(int dim = 0;dim<DIM;++dim) {
-                    d = std::abs(p->position[dim]-m_root->position[dim]);
-                    if(d > dmax)
-                        dmax = d;
-                }
-            }
-
-            while(m_rsize < 2*dmax)
-                m_rsize = 2*m_rsize;
-        }
-
-        void LoadBody(Body* p) {
-            Cell* q; Cell* c;
-            int qind,k;
-            double qsize, dist2;
-
-            q = m_root;
-            qind = SubIndex(p,q);
-            qsize = m_rsize;
-            q->max_search_radius = std::max(q->max_search_radius, p->search_radius);
-            while(q->subP[qind] != nullptr) {
-                if(q->subP[qind]->type == Type::Body) {
-                    double dist2 = 0;
-                    for(int d = 0;d<DIM;++d)
-                        dist2 += (p->position[d]-q->subP[qind]->position[d])*(p->position[d]-q->subP[qind]->position[d]);
-
-                    if (dist2 == 0.0)
-                        TREE_PRINT_ERROR(stdout, "Particles in the same position exist.\n");
-
-                    c = MakeCell();
-                    for(int k = 0;k<DIM;++k)
-                        c->position[k] = q->position[k] + (p->position[k] < q->position[k] ? -qsize:qsize)/4;
-                    c->subP[SubIndex(static_cast<Body*>(q->subP[qind]),c)] = q->subP[qind];
-                    c->max_search_radius = p->search_radius; //initialization of max_search_radius
-                    q->subP[qind] = c;
-                }
-                q = static_cast<Cell*>(q->subP[qind]);
-                q->max_search_radius = std::max(q->max_search_radius, p->search_radius);
-                qind = SubIndex(p,q);
-                qsize = qsize/2;
-                if(qsize == 0)
-                    TREE_PRINT_ERROR(stdout, "Tree is so deep that a cell size reaches zero\n");
-            }
-            q->subP[qind] = p;
+    //Neighbor particle with its squared distance r2 and displacement dx = (point of search) - (position of id), minimum image if periodic.
+    template <unsigned int DIM, typename Scalar = double>
+    struct NeighborParticle {
+        unsigned int id;
+        Scalar r2;
+        std::array<Scalar, DIM> dx;
+    };
+
+    //Reorder the values of particles: particle k afterwards has the values of particle order[k] before, data[stride*k] ... data[stride*k + stride-1].
+    //Use it with the order of StaticNeighborParticleSearchTree::TreeOrder for every array indexed by particle, then call RenumberParticle of the tree.
+    template <typename T>
+    void Reorder(const std::vector<unsigned int>& order, T* data, std::size_t stride = 1) {
+        const std::vector<T> old(data, data + stride*order.size());
+#pragma omp parallel for schedule(static)
+        for(int k = 0;k<static_cast<int>(order.size());++k)
+            for(std::size_t c = 0;c<stride;++c)
+                data[stride*k + c] = old[stride*order[k] + c];
+    }
+
+    //Neighbor lists of all particles in compressed sparse row form. Neighbors of particle i are neighbor[offset[i]] ... neighbor[offset[i+1]-1].
+    //Keep one object across steps: the arrays are refilled in place and keep their capacity.
+    class CompressedNeighborList {
+    public:
+        std::vector<std::size_t> offset;
+        std::vector<unsigned int> neighbor;
+
+        unsigned int Size() const {
+            return offset.empty() ? 0 : static_cast<unsigned int>(offset.size() - 1);
+        }
+
+        std::size_t NumNeighbor(unsigned int i) const {
+            return offset[i + 1] - offset[i];
+        }
+
+        const unsigned int* begin(unsigned int i) const {
+            return neighbor.data() + offset[i];
+        }
+
+        const unsigned int* end(unsigned int i) const {
+            return neighbor.data() + offset[i + 1];
+        }
+
+    private:
+        template <unsigned int, typename>
+        friend class StaticNeighborParticleSearchTree;
+
+        std::vector<std::vector<unsigned int>> m_buffer;       //per-thread rows before compaction
+        std::vector<std::pair<int, std::size_t>> m_row;        //thread and start in its buffer of every row
+    };
+
+    //Tree whose spatial dimension and scalar type are fixed at compile time.
+    //Every per-dimension loop has a constant trip count. Cells are built in an index-based arena and then laid out depth-first in one array.
+    //A leaf cell holds up to leaf_capacity bodies (more if they share one position), copied contiguously in tree order.
+    template <unsigned int DIM, typename Scalar = double>
+    class StaticNeighborParticleSearchTree {
+        static_assert(DIM >= 1 && DIM <= 3, "DIM must be 1, 2 or 3");
+        static_assert(std::is_floating_point<Scalar>::value, "Scalar must be a floating point type");
+
+    public:
+        static constexpr unsigned int NSUB = 1u << DIM;
+
+        explicit StaticNeighborParticleSearchTree(unsigned int reserve_number, unsigned int leaf_capacity = 8, Precision precision = Precision::FULL):m_reserve_num(reserve_number), m_leaf_capacity(leaf_capacity), m_precision(precision), m_body_next(reserve_number),
+                                                                                                           m_position(DIM*std::size_t(reserve_number), 0), m_search_radius(reserve_number, 0) {
+            TREE_PRINT_INFO("start\n");
+            if(leaf_capacity == 0)
+                TREE_PRINT_ERROR(stdout, "leaf_capacity must be at least 1\n");
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        StaticNeighborParticleSearchTree(const StaticNeighborParticleSearchTree&) = delete;
+        StaticNeighborParticleSearchTree& operator=(const StaticNeighborParticleSearchTree&) = delete;
+
+        StaticNeighborParticleSearchTree(StaticNeighborParticleSearchTree&&) = default;
+
+        //a tree moved into itself is left as it is
+        StaticNeighborParticleSearchTree& operator=(StaticNeighborParticleSearchTree&& o) noexcept {
+            if(&o == this)
+                return *this;
+            this->~StaticNeighborParticleSearchTree();
+            new (this) StaticNeighborParticleSearchTree(std::move(o));
+            return *this;
+        }
+
+        void Resize(int size) {
+            if(0 <= size && size <= m_reserve_num)
+                m_size = size;
+            else
+                TREE_PRINT_ERROR(stdout, "Size exceeds reserved size\n");
         }
 
-        int SubIndex(Body* p, Cell* q) {
-            int ind, k;
-            ind = 0;
-            for(k = 0;k<DIM;++k) {
-                if(q->position[k] <= p->position[k])
-                    ind += m_NSUB >> (k+1);
+        void CopyPos(Scalar pos_x, unsigned int id, unsigned int dim) {
+            if(id < static_cast<unsigned int>(m_size) && dim < DIM) {
+                OwnPos();
+                m_position[DIM*std::size_t(id) + dim] = pos_x;
             }
-            return ind;
+            else
+                TREE_PRINT_ERROR(stdout, "Acces to outside of memory\n");
         }
 
-        void PropagateInfo(Cell* p, double psize, int lev) {
-            Node* q;
-            for(int i = 0;i<m_NSUB;++i) {
-                if((q=p->subP[i]) != nullptr) {
-                    if(q->type == Type::Cell)
-                        PropagateInfo(static_cast<Cell*>(q), psize/2, lev+1);
-                }
+        void CopySearchRadius(Scalar search_radius, unsigned int id) {
+            if(id < static_cast<unsigned int>(m_size)) {
+                OwnSearchRadius();
+                m_search_radius[id] = search_radius;
             }
+            else
+                TREE_PRINT_ERROR(stdout, "Acces to outside of memory\n");
         }
 
-        void ThreadTree(Node* p, Node* n) {
-            int ndesc, i;
-            Node* desc[m_NSUB+1];
+        //Copy the positions of all Resize() particles at once. Position dim of particle i is pos[stride*i + dim_stride*dim],
+        //e.g. stride = DIM, dim_stride = 1 for pos[i][dim] and stride = 1, dim_stride = size for pos[dim][i].
+        void CopyAllPos(const Scalar* pos, std::size_t stride = DIM, std::size_t dim_stride = 1) {
+            if(pos == nullptr && m_size > 0)
+                TREE_PRINT_ERROR(stdout, "pos is null\n");
+            const Detail::StridedArray<Scalar> x{pos, stride, dim_stride};
+#pragma omp parallel for schedule(static)
+            for(int i = 0;i<m_size;++i)
+                for(unsigned int dim = 0;dim<DIM;++dim)
+                    m_position[DIM*std::size_t(i) + dim] = x(i, dim);
+            m_pos = {m_position.data(), DIM, 1};
+        }
 
-            p->next = n;
-            if(p->type == Type::Cell)
-            {
-                ndesc = 0;
-                for(i = 0;i<m_NSUB;++i)
-                    if(static_cast<Cell*>(p)->subP[i] != nullptr)
-                        desc[ndesc++] = static_cast<Cell*>(p)->subP[i];
-                
-                static_cast<Cell*>(p)->more = desc[0];
-                desc[ndesc] = n;
-                for(i = 0;i<ndesc;++i)
-                    ThreadTree(desc[i], desc[i+1]);
-            }
+        void CopyAllSearchRadius(const Scalar* search_radius, std::size_t stride = 1) {
+            if(search_radius == nullptr && m_size > 0)
+                TREE_PRINT_ERROR(stdout, "search_radius is null\n");
+            const Detail::StridedArray<Scalar> h{search_radius, stride, 0};
+#pragma omp parallel for schedule(static)
+            for(int i = 0;i<m_size;++i)
+                m_search_radius[i] = h(i);
+            m_radius = {m_search_radius.data(), 1, 0};
         }
 
-        template <SearchMode SEARCH_MODE>
-        void WalkTree(const double* pos,const double radius,std::vector<unsigned int>& interaction_list,Cell* p,double psize) {
-            Node* q;
-            //search all of p's direct descendants
-            if constexpr (SEARCH_MODE == SearchMode::GATHER) {
-                for(q = p->more;q != p->next;q = q->next) {
-                    if(q->type == Type::Cell && isNearTarget(pos,radius,q->position,psize/2))
-                        WalkTree<SEARCH_MODE>(pos,radius,interaction_list,static_cast<Cell*>(q),psize/2);
-                    else if(q->type == Type::Body)
-                    {
-                        double length = 0;
+        //Read the positions from the caller's buffer (same layout as CopyAllPos) instead of a copy.
+        //The buffer must hold Resize() particles and stay alive until the next CopyPos or CopyAllPos. It is read by UpdateTree and GetPos only,
+        //queries use the copy made in tree order by UpdateTree.
+        void UsePosBuffer(const Scalar* pos, std::size_t stride = DIM, std::size_t dim_stride = 1) {
+            if(pos == nullptr)
+                TREE_PRINT_ERROR(stdout, "pos is null\n");
+            m_pos = {pos, stride, dim_stride};
+        }
 
-                        for(int dim = 0;dim<DIM;++dim)
-                            length += (pos[dim] - q->position[dim])*(pos[dim] - q->position[dim]);
-                        
-                        if(length <= radius*radius)
-                            interaction_list.emplace_back(static_cast<Body*>(q)->id);
-                    }
-                }
-            }else if constexpr (SEARCH_MODE == SearchMode::SYMMETRY) {
-                for(q = p->more;q != p->next;q = q->next) {
-                    if(q->type == Type::Cell && (isNearTargetWithPeriodicBoundary(pos,radius,q->position,psize/2) || isNearTargetWithPeriodicBoundary(pos, static_cast<Cell*>(q)->max_search_radius, q->position, psize/2)))
-                        WalkTree<SEARCH_MODE>(pos,radius,interaction_list,static_cast<Cell*>(q),psize/2);
-                    else if(q->type == Type::Body)
-                    {
-                        double length = 0;
-
-                        for(int dim = 0;dim<DIM;++dim)
-                            length += (pos[dim] - q->position[dim])*(pos[dim] - q->position[dim]);
-                        
-                        double search_radius = static_cast<Body*>(q)->search_radius;
-                        if((length <= radius*radius) || (length <= search_radius * search_radius))
-                            interaction_list.emplace_back(static_cast<Body*>(q)->id);
-                    }
-                }
-            }
+        void UseSearchRadiusBuffer(const Scalar* search_radius, std::size_t stride = 1) {
+            if(search_radius == nullptr)
+                TREE_PRINT_ERROR(stdout, "search_radius is null\n");
+            m_radius = {search_radius, stride, 0};
         }
 
+        //Number of additive weights per particle (e.g. mass), summed over every cell by UpdateTree for SumNeighborWeight. 0 by default.
+        void SetNumWeight(unsigned int num_weight) {
+            m_num_weight = num_weight;
+            m_weight.assign(num_weight*std::size_t(m_reserve_num), 0);
+        }
 
-        bool isNearTarget(const double* pos, double radius,double* posCell, double cellSize) {
-            double dx, farLen;
+        unsigned int NumWeight() const {
+            return m_num_weight;
+        }
 
-            farLen = cellSize + radius;
+        void CopyWeight(Scalar weight, unsigned int id, unsigned int k = 0) {
+            if(id < static_cast<unsigned int>(m_size) && k < m_num_weight)
+                m_weight[m_num_weight*std::size_t(id) + k] = weight;
+            else
+                TREE_PRINT_ERROR(stdout, "Acces to outside of memory\n");
+        }
 
-            for(int dim = 0;dim < DIM;++dim) {
-                dx = pos[dim] - posCell[dim];
-                if(std::abs(dx) > farLen)
-                    return false;
-            }
+        //weight k of particle i is weight[stride*i]
+        void CopyAllWeight(const Scalar* weight, unsigned int k = 0, std::size_t stride = 1) {
+            if(k >= m_num_weight)
+                TREE_PRINT_ERROR(stdout, "Acces to outside of memory\n");
+            if(weight == nullptr && m_size > 0)
+                TREE_PRINT_ERROR(stdout, "weight is null\n");
+#pragma omp parallel for schedule(static)
+            for(int i = 0;i<m_size;++i)
+                m_weight[m_num_weight*std::size_t(i) + k] = weight[stride*i];
+        }
 
-            return true;
+        Scalar GetPos(unsigned int id, unsigned int dim) const {
+            if(id < static_cast<unsigned int>(m_size) && dim < DIM)
+                return m_pos(id, dim);
+            else
+                TREE_PRINT_ERROR(stdout, "Acces to outside of memory\n");
         }
 
-        template <SearchMode SEARCH_MODE>
-        void WalkTreeWithPeriodicBoundary(const double* pos,const double radius,std::vector<unsigned int>& interaction_list,Cell* p,double psize) {
-            Node* q;
-            //search all of p's direct descendants
-            if constexpr (SEARCH_MODE == SearchMode::GATHER) {
-                for(q = p->more;q != p->next;q = q->next) {
-                    if(q->type == Type::Cell && isNearTargetWithPeriodicBoundary(pos,radius,q->position,psize/2))
-                        WalkTreeWithPeriodicBoundary<SearchMode::GATHER>(pos,radius,interaction_list,static_cast<Cell*>(q),psize/2);
-                    else if(q->type == Type::Body) {
-                        double length = 0;
-
-                        for(int dim = 0;dim<DIM;++dim) {
-                            double dx = PeriodicDistance(pos[dim], q->position[dim], dim);
-                            length += dx * dx;
-                        }
+        unsigned int LeafCapacity() const {
+            return m_leaf_capacity;
+        }
 
-                        if(length <= radius*radius)
-                            interaction_list.emplace_back(static_cast<Body*>(q)->id);
-                    }
-                }
-            }else if constexpr (SEARCH_MODE == SearchMode::SYMMETRY) {
-                for(q = p->more;q != p->next;q = q->next) {
-                    if(q->type == Type::Cell && (isNearTargetWithPeriodicBoundary(pos,radius,q->position,psize/2) || isNearTargetWithPeriodicBoundary(pos, static_cast<Cell*>(q)->max_search_radius, q->position, psize/2)))
-                        WalkTreeWithPeriodicBoundary<SearchMode::SYMMETRY>(pos,radius,interaction_list,static_cast<Cell*>(q),psize/2);
-                    else if(q->type == Type::Body) {
-                        double length = 0;
+        //number of cells of the last UpdateTree
+        unsigned int NumCell() const {
+            return static_cast<unsigned int>(m_cell.size());
+        }
 
-                        for(int dim = 0;dim<DIM;++dim) {
-                            double dx = PeriodicDistance(pos[dim], q->position[dim], dim);
-                            length += dx * dx;
-                        }
+        //bytes allocated by the tree, including the build arena and buffers kept for the next UpdateTree
+        std::size_t MemoryFootprint() const {
+            std::size_t bytes = m_body_next.capacity()*sizeof(std::uint32_t) + (m_position.capacity() + m_search_radius.capacity())*sizeof(Scalar) + m_build_cell.capacity()*sizeof(BuildCell) + m_cell.capacity()*sizeof(Cell)
+                              + (m_keys.capacity() + m_keys_tmp.capacity())*sizeof(Detail::MortonKey)
+                              + (m_weight.capacity() + m_leaf_weight.capacity() + m_cell_weight.capacity())*sizeof(Scalar)
+                              + m_leaf_search_radius.capacity()*sizeof(Scalar) + m_leaf_search_radius_high.capacity()*sizeof(float) + m_leaf_id.capacity()*sizeof(unsigned int)
+                              + (m_leaf_cell.capacity() + m_body_leaf.capacity() + m_mover.capacity() + m_grid_cell.capacity())*sizeof(std::uint32_t) + m_moved.capacity()
+                              + m_subtree_size.capacity()*sizeof(SubtreeSize)
+                              + m_grid_begin.capacity()*sizeof(unsigned int);
+            for(unsigned int dim = 0;dim<DIM;++dim)
+                bytes += m_leaf_position[dim].capacity()*sizeof(Scalar) + m_leaf_position_low[dim].capacity()*sizeof(float);
+            return bytes;
+        }
 
-                        double search_radius = static_cast<Body*>(q)->search_radius;
-                        if((length <= radius*radius) || (length <= search_radius * search_radius))
-                            interaction_list.emplace_back(static_cast<Body*>(q)->id);
-                    }
-                }
+        template <BuildMode BUILD_MODE = BuildMode::INSERTION>
+        void UpdateTree() {
+            TREE_PRINT_INFO("start\n");
+            for(unsigned int dim = 0;dim<DIM;++dim)
+                if(m_boundary[dim] != Boundary::OPEN && !(m_has_domain && m_domain_lower[dim] < m_domain_upper[dim]))
+                    TREE_PRINT_ERROR(stdout, "PERIODIC and SHEAR axes need a domain of positive length, see SetDomain\n");
+            if(m_shear_dim < DIM && m_boundary[m_shear_dim] == Boundary::SHEAR)
+                TREE_PRINT_ERROR(stdout, "SHEAR axis must differ from the axis of SetShear\n");
+#ifdef TREE_STATISTICS
+            m_build_statistics = BuildStatistics();
+            const double start = Detail::Now();
+#endif
+            m_grid = false;
+            if(m_backend != Backend::TREE) {
+                ExpandBox();
+                m_grid = BinGrid(m_backend == Backend::AUTO);
+            }
+            if(m_grid) {
+                m_num_mover = m_size;
+            }else if constexpr (BUILD_MODE == BuildMode::REFIT) {
+                if(!RefitTree())
+                    BuildTree<BuildMode::MORTON>();
+            }else {
+                BuildTree<BUILD_MODE>();
+            }
+            for(unsigned int dim = 0;dim<DIM;++dim)
+                m_leaf_position[dim].resize(m_size);
+            m_leaf_search_radius.resize(m_size);
+            m_leaf_id.resize(m_size);
+            m_leaf_weight.resize(m_num_weight*std::size_t(m_size));
+            if(isMixed()) {
+                for(unsigned int dim = 0;dim<DIM;++dim)
+                    m_leaf_position_low[dim].resize(m_size);
+                m_leaf_search_radius_high.resize(m_size);
             }
+            m_body_leaf.resize(m_size);
+            m_num_leaf_body = 0;
+            m_leaf_cell.clear();
+            m_cell.clear();
+            m_cell.reserve(m_build_cell.size());
+#ifdef TREE_STATISTICS
+            double time = Detail::Now();
+#endif
+            if(m_grid)
+                FillGrid();
+            else
+                LinearizeTree();
+#ifdef TREE_STATISTICS
+            m_build_statistics.thread_tree_time = Detail::Now() - time;
+            time = Detail::Now();
+#endif
+            m_cell_weight.resize(m_num_weight*m_cell.size());
+            if(m_num_weight > 0)
+                PropagateInfo(Root());
+#ifdef TREE_STATISTICS
+            m_build_statistics.propagate_time = Detail::Now() - time;
+            m_build_statistics.num_cell       = m_grid ? m_grid_begin.size() - 1 : m_cell.size();
+            m_build_statistics.num_leaf       = m_grid ? m_grid_begin.size() - 1 : m_leaf_cell.size();
+            std::uint64_t depth_sum = 0;
+            LeafDepth(Root(), 0, depth_sum);
+            m_build_statistics.mean_depth = m_num_leaf_body > 0 ? static_cast<double>(depth_sum)/m_num_leaf_body : 0;
+            m_build_statistics.bytes      = MemoryFootprint();
+            m_build_statistics.total_time = Detail::Now() - start;
+#endif
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        //UpdateTree<BuildMode::REFIT>() rebuilds the whole tree if more than fraction*size bodies left their leaf
+        void SetMaxMoverFraction(double fraction) {
+            if(0 <= fraction && fraction <= 1)
+                m_max_mover_fraction = fraction;
+            else
+                TREE_PRINT_ERROR(stdout, "fraction must be in [0, 1]\n");
         }
 
-        double PeriodicDistance(double x1, double x2, int dim) {
-            double X = x1-x2;
-            if(X>0.5*m_boundary_length[dim]){
-                X -= m_boundary_length[dim];
-            } else if(X<-0.5*m_boundary_length[dim]){
-                X += m_boundary_length[dim];
+        //Fix the root cell to cover the box [lower, upper], e.g. the periodic domain, instead of fitting it to the bodies only.
+        //Bodies outside the box are still covered. Takes effect on the next full build.
+        void SetDomain(const Scalar* lower, const Scalar* upper) {
+            for(unsigned int dim = 0;dim<DIM;++dim)
+                if(!(lower[dim] <= upper[dim]))
+                    TREE_PRINT_ERROR(stdout, "lower must not exceed upper\n");
+            for(unsigned int dim = 0;dim<DIM;++dim) {
+                m_domain_lower[dim] = lower[dim];
+                m_domain_upper[dim] = upper[dim];
             }
-            return X;
+            m_has_domain = true;
         }
 
-        bool isNearTargetWithPeriodicBoundary(const double* pos, double radius,double* posCell, double cellSize) {
-            double dx, farLen;
+        void ClearDomain() {
+            m_has_domain = false;
+        }
 
-            farLen = cellSize + radius;
+        //With tight (default), a cell is pruned against the bounding box of its bodies, computed bottom-up by UpdateTree.
+        //Otherwise against its nominal cubic box. Takes effect on the next UpdateTree.
+        void SetTightCellBox(bool tight) {
+            m_tight_cell_box = tight;
+        }
 
-            for(int dim = 0;dim < DIM;++dim) {
-                dx = PeriodicDistance(pos[dim],posCell[dim],dim);
-                if(std::abs(dx) > farLen)
-                    return false;
+        //Boundary of axis dim used by every query without a boundary_length argument. PERIODIC and SHEAR axes wrap at the box of SetDomain.
+        //Search radii must be less than half the domain length of such axes. Only queries within reach of a wall look at the images.
+        void SetBoundary(unsigned int dim, Boundary boundary) {
+            if(dim >= DIM)
+                TREE_PRINT_ERROR(stdout, "Acces to outside of memory\n");
+            for(unsigned int d = 0;d<DIM;++d)
+                if(d != dim && boundary == Boundary::SHEAR && m_boundary[d] == Boundary::SHEAR)
+                    TREE_PRINT_ERROR(stdout, "Only one axis can be SHEAR\n");
+            m_boundary[dim] = boundary;
+        }
+
+        //An image across the SHEAR axis is shifted by shift along axis shift_dim, e.g. the y images of a shearing box move by the accumulated shear along x.
+        void SetShear(unsigned int shift_dim, Scalar shift) {
+            if(shift_dim >= DIM)
+                TREE_PRINT_ERROR(stdout, "Acces to outside of memory\n");
+            m_shear_dim   = shift_dim;
+            m_shear_shift = shift;
+        }
+
+        //Search structure of the next UpdateTree. With GRID (or AUTO choosing it), only FindNeighborParticle, ForEachNeighborParticle,
+        //FindAllNeighborParticle, ForEachAllNeighborParticle and their periodic versions are available, and REFIT bins the bodies again.
+        void SetBackend(Backend backend) {
+            m_backend = backend;
+        }
+
+        //TREE or GRID, as chosen by the last UpdateTree
+        Backend ActiveBackend() const {
+            return m_grid ? Backend::GRID : Backend::TREE;
+        }
+
+        //bodies reinserted by the last UpdateTree<BuildMode::REFIT>(), or all bodies if it rebuilt the tree
+        unsigned int NumMover() const {
+            return m_num_mover;
+        }
+
+        //statistics of the last UpdateTree, all zero unless compiled with TREE_STATISTICS
+        const BuildStatistics& GetBuildStatistics() const {
+            return m_build_statistics;
+        }
+
+        //cells and bodies visited by the queries since construction or ResetTraversalStatistics, summed over all threads.
+        //All zero unless compiled with TREE_STATISTICS. Without it, the counters are not even compiled into the walks.
+        TraversalStatistics GetTraversalStatistics() const {
+            return m_traversal.Load();
+        }
+
+        void ResetTraversalStatistics() {
+            m_traversal.Reset();
+        }
+
+        //order[k] = particle id of the k-th body in the depth-first order of the last UpdateTree, which is the Morton order of the leaves.
+        //Particles close in this order are close in space, so renumbering particles by it makes the ids of neighbors close in memory.
+        void TreeOrder(std::vector<unsigned int>& order) const {
+            order.assign(m_leaf_id.begin(), m_leaf_id.begin() + m_num_leaf_body);
+        }
+
+        //inverse of TreeOrder, rank[id] = k where order[k] = id
+        void TreeRank(std::vector<unsigned int>& rank) const {
+            rank.resize(m_num_leaf_body);
+#pragma omp parallel for schedule(static)
+            for(int k = 0;k<static_cast<int>(m_num_leaf_body);++k)
+                rank[m_leaf_id[k]] = k;
+        }
+
+        //Particle k becomes particle order[k] before, e.g. with order from TreeOrder. The positions, search radii and weights held by the tree and the tree itself
+        //are renumbered, so queries and UpdateTree<BuildMode::REFIT>() go on without a full rebuild. Buffers of UsePosBuffer and UseSearchRadiusBuffer
+        //belong to the caller, who reorders them the same way, see Tree::Reorder.
+        void RenumberParticle(const std::vector<unsigned int>& order) {
+            TREE_PRINT_INFO("start\n");
+            if(order.size() != static_cast<std::size_t>(m_size))
+                TREE_PRINT_ERROR(stdout, "order must have Resize() entries\n");
+            std::vector<std::uint32_t> rank(m_size, NONE);
+            for(int k = 0;k<m_size;++k) {
+                if(order[k] >= static_cast<unsigned int>(m_size) || rank[order[k]] != NONE)
+                    TREE_PRINT_ERROR(stdout, "order is not a permutation\n");
+                rank[order[k]] = k;
             }
 
-            return true;
+            Reorder(order, m_position.data(), DIM);
+            Reorder(order, m_search_radius.data());
+            if(m_num_weight > 0)
+                Reorder(order, m_weight.data(), m_num_weight);
+            if(m_body_leaf.size() == static_cast<std::size_t>(m_size)) {
+                //the tree of the last UpdateTree: bodies of a leaf are linked by id, leaf bodies in tree order know their id
+                Reorder(order, m_body_next.data());
+                Reorder(order, m_body_leaf.data());
+                for(int k = 0;k<m_size;++k)
+                    if(m_body_next[k] != NONE)
+                        m_body_next[k] = rank[m_body_next[k]];
+                for(BuildCell& cell : m_build_cell)
+                    if(cell.leaf && cell.body != NONE)
+                        cell.body = rank[cell.body];
+            }
+            if(m_num_leaf_body == static_cast<unsigned int>(m_size))
+                for(unsigned int k = 0;k<m_num_leaf_body;++k)
+                    m_leaf_id[k] = rank[m_leaf_id[k]];
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindNeighborParticle(const Scalar* pos, const Scalar radius, std::vector<unsigned int>& interaction_list, bool clear = true) const {
+            TREE_PRINT_INFO("start\n");
+            if(clear)
+                interaction_list.clear();
+            auto emit = [&](unsigned int i) { interaction_list.emplace_back(m_leaf_id[i]); };
+            WalkTreeWithBoundary<SEARCH_MODE>(pos,radius,emit);
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindNeighborParticleWithPeriodicBoundary(const Scalar* pos, const Scalar radius, const Scalar* boundary_length, std::vector<unsigned int>& interaction_list, bool clear = true) const {
+            TREE_PRINT_INFO("start\n");
+            if(clear)
+                interaction_list.clear();
+            auto emit = [&](unsigned int i) { interaction_list.emplace_back(m_leaf_id[i]); };
+            TREE_STATISTICS_SCOPE;
+            WalkWithPeriodicBoundary<SEARCH_MODE>(pos,radius,boundary_length,emit);
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        //Calls f(id, r2, dx) for every neighbor particle id, where r2 is its squared distance from pos and dx[dim] = pos[dim] - (position of id)[dim].
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER, typename Function>
+        void ForEachNeighborParticle(const Scalar* pos, const Scalar radius, Function&& f) const {
+            TREE_PRINT_INFO("start\n");
+            auto emit = [&](unsigned int i, Scalar r2, const Scalar* dx) { f(m_leaf_id[i], r2, dx); };
+            WalkTreeWithBoundary<SEARCH_MODE>(pos,radius,emit);
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        //dx is the minimum image displacement
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER, typename Function>
+        void ForEachNeighborParticleWithPeriodicBoundary(const Scalar* pos, const Scalar radius, const Scalar* boundary_length, Function&& f) const {
+            TREE_PRINT_INFO("start\n");
+            auto emit = [&](unsigned int i, Scalar r2, const Scalar* dx) { f(m_leaf_id[i], r2, dx); };
+            TREE_STATISTICS_SCOPE;
+            WalkWithPeriodicBoundary<SEARCH_MODE>(pos,radius,boundary_length,emit);
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindNeighborParticle(const Scalar* pos, const Scalar radius, std::vector<NeighborParticle<DIM, Scalar>>& interaction_list, bool clear = true) const {
+            if(clear)
+                interaction_list.clear();
+            ForEachNeighborParticle<SEARCH_MODE>(pos, radius, [&](unsigned int id, Scalar r2, const Scalar* dx) { interaction_list.emplace_back(MakeNeighborParticle(id, r2, dx)); });
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindNeighborParticleWithPeriodicBoundary(const Scalar* pos, const Scalar radius, const Scalar* boundary_length, std::vector<NeighborParticle<DIM, Scalar>>& interaction_list, bool clear = true) const {
+            if(clear)
+                interaction_list.clear();
+            ForEachNeighborParticleWithPeriodicBoundary<SEARCH_MODE>(pos, radius, boundary_length, [&](unsigned int id, Scalar r2, const Scalar* dx) { interaction_list.emplace_back(MakeNeighborParticle(id, r2, dx)); });
+        }
+
+        //Number of neighbor particles of pos, i.e. FindNeighborParticle(pos, radius).size().
+        //Cells lying inside the search sphere as a whole are counted by their body count without visiting their bodies.
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        unsigned int CountNeighborParticle(const Scalar* pos, const Scalar radius) const {
+            return WalkTreeSummary<SEARCH_MODE, false>(pos, radius, nullptr, nullptr);
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        unsigned int CountNeighborParticleWithPeriodicBoundary(const Scalar* pos, const Scalar radius, const Scalar* boundary_length) const {
+            return WalkTreeSummary<SEARCH_MODE, true>(pos, radius, boundary_length, nullptr);
+        }
+
+        //sum[k] = weight k summed over the neighbor particles of pos, for k < NumWeight(). Returns the number of neighbor particles.
+        //Cells inside the search sphere add the sums of UpdateTree, so the result may differ from a sum in another order in the last bits.
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        unsigned int SumNeighborWeight(const Scalar* pos, const Scalar radius, Scalar* sum) const {
+            return WalkTreeSummary<SEARCH_MODE, false>(pos, radius, nullptr, sum);
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        unsigned int SumNeighborWeightWithPeriodicBoundary(const Scalar* pos, const Scalar radius, const Scalar* boundary_length, Scalar* sum) const {
+            return WalkTreeSummary<SEARCH_MODE, true>(pos, radius, boundary_length, sum);
+        }
+
+        //num_neighbor nearest particles of pos in ascending order of distance (ties in ascending order of id)
+        void FindNearestNeighborParticle(const Scalar* pos, unsigned int num_neighbor, std::vector<NeighborParticle<DIM, Scalar>>& neighbor) const {
+            TREE_PRINT_INFO("start\n");
+            WalkTreeNearest<false>(pos, num_neighbor, nullptr, neighbor);
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        void FindNearestNeighborParticleWithPeriodicBoundary(const Scalar* pos, unsigned int num_neighbor, const Scalar* boundary_length, std::vector<NeighborParticle<DIM, Scalar>>& neighbor) const {
+            TREE_PRINT_INFO("start\n");
+            WalkTreeNearest<true>(pos, num_neighbor, boundary_length, neighbor);
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        //Search radius search_radius[id] of every particle such that num_neighbor - tolerance <= (number of particles within it) <= num_neighbor + tolerance.
+        //A positive search_radius[id] is used as the initial guess and kept if it already satisfies the condition.
+        //Otherwise the candidates gathered around the guess are reused to pick the radius, and only a bad guess costs a k-nearest neighbor walk.
+        void SolveSearchRadius(unsigned int num_neighbor, unsigned int tolerance, Scalar* search_radius) const {
+            TREE_PRINT_INFO("start\n");
+            SolveSearchRadius<false>(num_neighbor, tolerance, nullptr, search_radius);
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        void SolveSearchRadiusWithPeriodicBoundary(unsigned int num_neighbor, unsigned int tolerance, const Scalar* boundary_length, Scalar* search_radius) const {
+            TREE_PRINT_INFO("start\n");
+            SolveSearchRadius<true>(num_neighbor, tolerance, boundary_length, search_radius);
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        //Batched query. pos[DIM*i + dim] and radius[i] describe query i, whose result goes to interaction_list[i].
+        //Queries run in parallel in Morton order of pos, so that consecutive queries on a thread walk the same cells.
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindNeighborParticle(const Scalar* pos, const Scalar* radius, unsigned int num_query, std::vector<std::vector<unsigned int>>& interaction_list) const {
+            TREE_PRINT_INFO("start\n");
+            ForEachQuery(pos, num_query, interaction_list, [&](unsigned int i, std::vector<unsigned int>& list) {
+                auto emit = [&](unsigned int j) { list.emplace_back(m_leaf_id[j]); };
+                WalkTreeWithBoundary<SEARCH_MODE>(pos + DIM*i,radius[i],emit);
+            });
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindNeighborParticleWithPeriodicBoundary(const Scalar* pos, const Scalar* radius, unsigned int num_query, const Scalar* boundary_length, std::vector<std::vector<unsigned int>>& interaction_list) const {
+            TREE_PRINT_INFO("start\n");
+            ForEachQuery(pos, num_query, interaction_list, [&](unsigned int i, std::vector<unsigned int>& list) {
+                auto emit = [&](unsigned int j) { list.emplace_back(m_leaf_id[j]); };
+                TREE_STATISTICS_SCOPE;
+                WalkWithPeriodicBoundary<SEARCH_MODE>(pos + DIM*i,radius[i],boundary_length,emit);
+            });
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        //Neighbors of every body i within its own search radius (GATHER), or within max(search radius of i, search radius of j) (SYMMETRY).
+        //interaction_list[id] gets the same list as FindNeighborParticle(position of id, search radius of id).
+        //The tree is walked once per leaf cell with a sphere enclosing all of its bodies, and each body filters the shared candidates.
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindAllNeighborParticle(std::vector<std::vector<unsigned int>>& interaction_list) const {
+            TREE_PRINT_INFO("start\n");
+            WalkGroup<SEARCH_MODE, false>(nullptr, interaction_list);
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindAllNeighborParticleWithPeriodicBoundary(const Scalar* boundary_length, std::vector<std::vector<unsigned int>>& interaction_list) const {
+            TREE_PRINT_INFO("start\n");
+            WalkGroup<SEARCH_MODE, true>(boundary_length, interaction_list);
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        //Same as above, written to one CSR list. With half_list, row i only keeps neighbors j > i, so each pair of a symmetric relation is stored once.
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindAllNeighborParticle(CompressedNeighborList& interaction_list, bool half_list = false) const {
+            TREE_PRINT_INFO("start\n");
+            WalkGroup<SEARCH_MODE, false>(nullptr, interaction_list, half_list);
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindAllNeighborParticleWithPeriodicBoundary(const Scalar* boundary_length, CompressedNeighborList& interaction_list, bool half_list = false) const {
+            TREE_PRINT_INFO("start\n");
+            WalkGroup<SEARCH_MODE, true>(boundary_length, interaction_list, half_list);
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        //Calls f(i, j, r2, dx) for every neighbor j of every particle i as found by FindAllNeighborParticle, with dx = (position of i) - (position of j).
+        //Runs in parallel over i. All neighbors of one i are visited by one thread in a row.
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER, typename Function>
+        void ForEachAllNeighborParticle(Function&& f) const {
+            TREE_PRINT_INFO("start\n");
+            WalkGroup<SEARCH_MODE, false>(nullptr, [&](int, unsigned int k, auto&& for_each_neighbor) {
+                for_each_neighbor([&](unsigned int i, Scalar r2, const Scalar* dx) { f(m_leaf_id[k], m_leaf_id[i], r2, dx); });
+            });
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER, typename Function>
+        void ForEachAllNeighborParticleWithPeriodicBoundary(const Scalar* boundary_length, Function&& f) const {
+            TREE_PRINT_INFO("start\n");
+            WalkGroup<SEARCH_MODE, true>(boundary_length, [&](int, unsigned int k, auto&& for_each_neighbor) {
+                for_each_neighbor([&](unsigned int i, Scalar r2, const Scalar* dx) { f(m_leaf_id[k], m_leaf_id[i], r2, dx); });
+            });
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        //Calls f(i, j, r2, dx) once for every pair i != j of SYMMETRY neighbors, i.e. within max(search radius of i, search radius of j),
+        //with dx = (position of i) - (position of j). Pairs are found by a cell-cell walk of the tree against itself.
+        //f is called concurrently from several threads when compiled with -fopenmp, so accumulate per thread or atomically.
+        template <typename Function>
+        void ForEachNeighborPair(Function&& f) const {
+            TREE_PRINT_INFO("start\n");
+            WalkPair<false>(nullptr, MakePairTask<false>(nullptr), [&](int, unsigned int i, unsigned int j, Scalar r2, const Scalar* dx) { f(i, j, r2, dx); });
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        template <typename Function>
+        void ForEachNeighborPairWithPeriodicBoundary(const Scalar* boundary_length, Function&& f) const {
+            TREE_PRINT_INFO("start\n");
+            WalkPair<true>(boundary_length, MakePairTask<true>(boundary_length), [&](int, unsigned int i, unsigned int j, Scalar r2, const Scalar* dx) { f(i, j, r2, dx); });
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        //Every pair of ForEachNeighborPair as (min(i, j), max(i, j)), in an order that does not depend on the number of threads
+        void FindAllNeighborPair(std::vector<std::pair<unsigned int, unsigned int>>& pair_list) const {
+            TREE_PRINT_INFO("start\n");
+            FindAllNeighborPair<false>(nullptr, pair_list);
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        void FindAllNeighborPairWithPeriodicBoundary(const Scalar* boundary_length, std::vector<std::pair<unsigned int, unsigned int>>& pair_list) const {
+            TREE_PRINT_INFO("start\n");
+            FindAllNeighborPair<true>(boundary_length, pair_list);
+            TREE_PRINT_INFO("finish\n");
+        }
+
+    private:
+        static constexpr unsigned int KEY_BITS = 63 / DIM; //bits per dimension in a Morton key, i.e. the deepest level the keys resolve
+
+        static constexpr std::uint32_t NONE = std::numeric_limits<std::uint32_t>::max(); //null index
+
+        //cell of the build arena. Children and bodies are referred to by index, as the arena may grow during the build.
+        struct BuildCell {
+            Scalar position[DIM];
+            Scalar size;
+            Scalar max_search_radius;
+            std::array<std::uint32_t, NSUB> subP;
+            std::uint32_t body;            //bodies of a leaf linked through m_body_next
+            std::uint32_t body_count;
+            bool leaf;
+        };
+
+        //cells, leaves and bodies in the subtree of a build cell
+        struct SubtreeSize {
+            std::uint32_t num_cell, num_leaf, num_body;
+        };
+
+        //cell of the linearized tree. Cells are stored in depth-first order, so the first child of a cell is the cell right after it
+        //and next skips the whole subtree. A cell is a leaf if and only if next is the cell right after it.
+        struct Cell {
+            Scalar position[DIM];          //center of the box of the cell
+            Scalar half[DIM];              //half widths of the box, see SetTightCellBox
+            Scalar max_search_radius;
+            std::uint32_t next;
+            std::uint32_t body_begin;      //bodies of the subtree in m_leaf_*
+            std::uint32_t body_count;
+        };
+
+        int m_reserve_num = 0;
+        int m_size = 0;
+        unsigned int m_leaf_capacity = 8;
+        Precision m_precision = Precision::FULL;
+        std::vector<std::uint32_t> m_body_next;   //next body of the same leaf while building
+        std::vector<Scalar> m_position;           //positions and search radii copied by CopyPos and CopySearchRadius
+        std::vector<Scalar> m_search_radius;
+        Detail::StridedArray<Scalar> m_pos{m_position.data(), DIM, 1};        //m_position or the buffer of UsePosBuffer
+        Detail::StridedArray<Scalar> m_radius{m_search_radius.data(), 1, 0}; //m_search_radius or the buffer of UseSearchRadiusBuffer
+        std::vector<BuildCell> m_build_cell; //build arena, cleared but not freed on every UpdateTree
+        std::vector<Cell> m_cell;            //linearized tree, m_cell[0] is the root
+        std::array<Scalar, DIM> m_root_position{};
+        std::vector<Detail::MortonKey> m_keys, m_keys_tmp;
+        std::array<std::vector<Scalar>, DIM> m_leaf_position; //leaf bodies in tree order
+        std::vector<Scalar> m_leaf_search_radius;
+        std::vector<unsigned int> m_leaf_id;
+        std::array<std::vector<float>, DIM> m_leaf_position_low; //Precision::MIXED only, relative to the root center
+        std::vector<float> m_leaf_search_radius_high;           //Precision::MIXED only, inflated by MixedMargin
+        unsigned int m_num_leaf_body = 0;
+        std::vector<std::uint32_t> m_leaf_cell; //leaf cells in tree order
+        unsigned int m_num_weight = 0;
+        std::vector<Scalar> m_weight;      //weights copied by CopyWeight, m_weight[m_num_weight*id + k]
+        std::vector<Scalar> m_leaf_weight; //leaf bodies in tree order
+        std::vector<Scalar> m_cell_weight; //sum over the bodies of every cell of m_cell
+        std::vector<std::uint32_t> m_body_leaf; //build cell of the leaf holding each body
+        std::vector<SubtreeSize> m_subtree_size; //of every build cell, used by LinearizeTree
+        std::vector<unsigned char> m_moved;     //body left its leaf, used by RefitTree
+        std::vector<std::uint32_t> m_mover;
+        double m_max_mover_fraction = 0.1;
+        unsigned int m_num_mover = 0;
+        Scalar m_rsize = 1;//root size
+        Scalar m_coordinate_scale = 1; //largest coordinate of the root box, bounds the round-off of cell boxes
+        bool m_tight_cell_box = true;
+        bool m_has_domain = false;
+        std::array<Scalar, DIM> m_domain_lower{}, m_domain_upper{};
+        std::array<Boundary, DIM> m_boundary{}; //all OPEN
+        unsigned int m_shear_dim = DIM; //axis of SetShear, DIM if none
+        Scalar m_shear_shift = 0;
+        BuildStatistics m_build_statistics;
+        Backend m_backend = Backend::TREE;
+        bool m_grid = false;                         //the last UpdateTree made a grid, m_cell only holds the root
+        std::array<unsigned int, DIM> m_grid_size{}; //cells along each axis
+        std::array<Scalar, DIM> m_grid_lower{};      //lower corner of the grid
+        Scalar m_grid_edge = 1;                      //width of a cell
+        std::vector<unsigned int> m_grid_begin;      //leaf bodies of cell c are [m_grid_begin[c], m_grid_begin[c+1]), the last axis runs fastest
+        std::vector<std::uint32_t> m_grid_cell;      //cell of every body while binning
+        mutable Detail::SharedTraversalStatistics m_traversal;
+
+        //copy the buffer of UsePosBuffer before changing single positions
+        void OwnPos() {
+            if(m_pos.data == m_position.data())
+                return;
+            for(int i = 0;i<m_size;++i)
+                for(unsigned int dim = 0;dim<DIM;++dim)
+                    m_position[DIM*std::size_t(i) + dim] = m_pos(i, dim);
+            m_pos = {m_position.data(), DIM, 1};
+        }
+
+        void OwnSearchRadius() {
+            if(m_radius.data == m_search_radius.data())
+                return;
+            for(int i = 0;i<m_size;++i)
+                m_search_radius[i] = m_radius(i);
+            m_radius = {m_search_radius.data(), 1, 0};
+        }
+
+        const Cell* Root() const {
+            return m_cell.data();
+        }
+
+        const Cell* Next(const Cell* p) const {
+            return m_cell.data() + p->next;
+        }
+
+        bool isLeaf(const Cell* p) const {
+            return Next(p) == p + 1;
+        }
+
+        std::uint32_t MakeCell() {
+            if(m_build_cell.size() >= NONE)
+                TREE_PRINT_ERROR(stdout, "Too many cells for 32-bit indices\n");
+            m_build_cell.emplace_back();
+#ifdef TREE_STATISTICS
+            ++m_build_statistics.num_new_cell;
+#endif
+            ClearCell(m_build_cell.back());
+            return static_cast<std::uint32_t>(m_build_cell.size() - 1);
+        }
+
+        static void ClearCell(BuildCell& c) {
+            c.subP.fill(NONE);
+            c.max_search_radius = 0;
+            c.body       = NONE;
+            c.body_count = 0;
+            c.leaf       = true;
+        }
+
+        std::uint32_t MakeSubCell(std::uint32_t q, Scalar qsize, int qind) {
+            const std::uint32_t c = MakeCell();
+            PlaceSubCell(c, q, qsize, qind);
+            return c;
+        }
+
+        //box of c as child qind of q
+        void PlaceSubCell(std::uint32_t c, std::uint32_t q, Scalar qsize, int qind) {
+            for(unsigned int k = 0;k<DIM;++k)
+                m_build_cell[c].position[k] = m_build_cell[q].position[k] + (((qind >> (DIM-1-k)) & 1) ? qsize:-qsize)/4;
+            m_build_cell[c].size = qsize/2;
+        }
+
+        template <BuildMode BUILD_MODE>
+        void BuildTree() {
+#ifdef TREE_STATISTICS
+            const double start = Detail::Now();
+            ExpandBox();
+            m_build_statistics.expand_box_time = Detail::Now() - start;
+#else
+            ExpandBox();
+#endif
+            m_build_cell.clear();
+            MakeCell();
+            for(unsigned int dim = 0;dim<DIM;++dim)
+                m_build_cell[0].position[dim] = m_root_position[dim];
+            m_build_cell[0].size = m_rsize;
+            if constexpr (BUILD_MODE == BuildMode::INSERTION) {
+                for(int i = 0;i<m_size;++i)
+                    LoadBody(i);
+            }else if constexpr (BUILD_MODE == BuildMode::MORTON) {
+                MakeMortonKey();
+                Detail::RadixSort(m_keys, m_keys_tmp, KEY_BITS*DIM);
+                LoadSortedBody();
+            }
+            m_num_mover = m_size;
+#ifdef TREE_STATISTICS
+            m_build_statistics.insert_time = Detail::Now() - start - m_build_statistics.expand_box_time;
+#endif
+        }
+
+        //Take the bodies that left their leaf out of the tree of the last build and insert them again from the root.
+        //Returns false if a full build is needed instead: no previous build, a body outside the root or too many movers.
+        bool RefitTree() {
+            if(m_cell.empty() || m_build_cell.empty() || m_body_leaf.size() != static_cast<std::size_t>(m_size))
+                return false;
+#ifdef TREE_STATISTICS
+            const double start = Detail::Now();
+#endif
+
+            m_moved.resize(m_size);
+            bool outside = false;
+            int num_mover = 0;
+#pragma omp parallel for schedule(static) reduction(||:outside) reduction(+:num_mover)
+            for(int i = 0;i<m_size;++i) {
+                const BuildCell& leaf = m_build_cell[m_body_leaf[i]];
+                bool moved = false;
+                for(unsigned int dim = 0;dim<DIM;++dim) {
+                    const Scalar x = m_pos(i, dim);
+                    //[position - size/2, position + size/2) is the part of space SubIndex sends to this leaf
+                    moved = moved || x < leaf.position[dim] - leaf.size/2 || x >= leaf.position[dim] + leaf.size/2;
+                    outside = outside || std::abs(x - m_root_position[dim]) > m_rsize/2;
+                }
+                m_moved[i] = moved;
+                num_mover += moved;
+            }
+            if(outside || num_mover > m_max_mover_fraction*m_size)
+                return false;
+
+            m_mover.clear();
+            for(int i = 0;i<m_size;++i)
+                if(m_moved[i])
+                    m_mover.emplace_back(i);
+
+            //unlink the movers from their leaves
+            for(std::uint32_t i : m_mover) {
+                BuildCell& leaf = m_build_cell[m_body_leaf[i]];
+                std::uint32_t* link = &leaf.body;
+                while(*link != NONE) {
+                    if(m_moved[*link]) {
+                        m_moved[*link] = false;
+                        *link = m_body_next[*link];
+                        --leaf.body_count;
+                    }else {
+                        link = &m_body_next[*link];
+                    }
+                }
+            }
+            for(std::uint32_t i : m_mover)
+                LoadBody(i);
+            m_num_mover = static_cast<unsigned int>(m_mover.size());
+#ifdef TREE_STATISTICS
+            m_build_statistics.insert_time = Detail::Now() - start;
+#endif
+            return true;
+        }
+
+        //child qind of q, made if it does not exist yet
+        std::uint32_t SubCell(std::uint32_t q, Scalar qsize, int qind) {
+            if(m_build_cell[q].subP[qind] == NONE) {
+                const std::uint32_t c = MakeSubCell(q, qsize, qind);
+                m_build_cell[q].subP[qind] = c;
+            }
+            return m_build_cell[q].subP[qind];
+        }
+
+        //Fit the root cell to the bounding box of the bodies, joined with the domain of SetDomain if any.
+        //The root is widened by 1/32 of the box, so that the bodies on its upper faces fall inside and refits survive small expansions.
+        void ExpandBox() {
+            std::array<Scalar, DIM> lower, upper;
+            for(unsigned int dim = 0;dim<DIM;++dim) {
+                lower[dim] = m_has_domain ? m_domain_lower[dim] : std::numeric_limits<Scalar>::infinity();
+                upper[dim] = m_has_domain ? m_domain_upper[dim] : -std::numeric_limits<Scalar>::infinity();
+            }
+            for(int i = 0;i<m_size;++i) {
+                for(unsigned int dim = 0;dim<DIM;++dim) {
+                    lower[dim] = std::min(lower[dim], m_pos(i, dim));
+                    upper[dim] = std::max(upper[dim], m_pos(i, dim));
+                }
+            }
+
+            Scalar width = 0;
+            m_coordinate_scale = 0;
+            for(unsigned int dim = 0;dim<DIM;++dim) {
+                if(lower[dim] > upper[dim])
+                    lower[dim] = upper[dim] = 0; //no body and no domain
+                m_root_position[dim] = (lower[dim] + upper[dim])/2;
+                width = std::max(width, upper[dim] - lower[dim]);
+                m_coordinate_scale = std::max(m_coordinate_scale, std::max(std::abs(lower[dim]), std::abs(upper[dim])));
+            }
+            m_rsize = width > 0 ? width*(1 + Scalar(1)/32) : 1;
+            m_coordinate_scale += m_rsize;
+            if(!std::isfinite(m_rsize))
+                TREE_PRINT_ERROR(stdout, "Position is not finite\n");
+        }
+
+        void LoadBody(std::uint32_t p) {
+            LoadBody(p, 0, m_rsize);
+        }
+
+        //insert body p into the subtree whose top cell is q of size qsize
+        void LoadBody(std::uint32_t p, std::uint32_t q, Scalar qsize) {
+#ifdef TREE_STATISTICS
+            ++m_build_statistics.num_insert;
+#endif
+            while(true) {
+                m_build_cell[q].max_search_radius = std::max(m_build_cell[q].max_search_radius, m_radius(p));
+                if(m_build_cell[q].leaf) {
+                    if(m_build_cell[q].body_count < m_leaf_capacity || isCoincident(p, q)) {
+                        PushBody(p, q);
+                        return;
+                    }
+                    SplitLeaf(q, qsize);
+                }
+                q = SubCell(q, qsize, SubIndex(p, m_build_cell[q]));
+                qsize = qsize/2;
+#ifdef TREE_STATISTICS
+                ++m_build_statistics.num_load_step;
+#endif
+                if(qsize == 0)
+                    TREE_PRINT_ERROR(stdout, "Tree is so deep that a cell size reaches zero\n");
+            }
+        }
+
+        void PushBody(std::uint32_t p, std::uint32_t q) {
+            m_body_next[p] = m_build_cell[q].body;
+            m_build_cell[q].body = p;
+            ++m_build_cell[q].body_count;
+        }
+
+        //true if p and every body already in leaf q share one position, so that splitting q cannot separate them
+        bool isCoincident(std::uint32_t p, std::uint32_t q) const {
+            for(std::uint32_t b = m_build_cell[q].body;b != NONE;b = m_body_next[b])
+                for(unsigned int dim = 0;dim<DIM;++dim)
+                    if(m_pos(b, dim) != m_pos(p, dim))
+                        return false;
+            return true;
+        }
+
+        //turn leaf q into an internal cell and move its bodies one level down
+        void SplitLeaf(std::uint32_t q, Scalar qsize) {
+            std::uint32_t b = m_build_cell[q].body;
+            m_build_cell[q].leaf       = false;
+            m_build_cell[q].body       = NONE;
+            m_build_cell[q].body_count = 0;
+            while(b != NONE) {
+                const std::uint32_t next = m_body_next[b];
+                const std::uint32_t c = SubCell(q, qsize, SubIndex(b, m_build_cell[q]));
+                m_build_cell[c].max_search_radius = std::max(m_build_cell[c].max_search_radius, m_radius(b));
+                PushBody(b, c);
+                b = next;
+            }
+        }
+
+        //Morton key of x relative to the root cell. Dimension 0 is the most significant bit of each digit, as in SubIndex.
+        std::uint64_t MortonKey(const Scalar* x) const {
+            const Scalar lower = -m_rsize/2;
+            const Scalar scale = std::ldexp(Scalar(1), KEY_BITS) / m_rsize;
+            const Scalar limit = std::ldexp(Scalar(1), KEY_BITS) - 1;
+            std::uint64_t ix[DIM];
+            for(unsigned int dim = 0;dim<DIM;++dim) {
+                Scalar k = std::floor((x[dim] - m_root_position[dim] - lower)*scale);
+                k = k < 0 ? 0 : (k > limit ? limit : k);
+                ix[dim] = static_cast<std::uint64_t>(k);
+            }
+            return Detail::InterleaveBits<DIM>(ix, KEY_BITS);
+        }
+
+        void MakeMortonKey() {
+            m_keys.resize(m_size);
+#pragma omp parallel for schedule(static)
+            for(int i = 0;i<m_size;++i) {
+                Scalar x[DIM];
+                for(unsigned int dim = 0;dim<DIM;++dim)
+                    x[dim] = m_pos(i, dim);
+                m_keys[i].key = MortonKey(x);
+                m_keys[i].id  = i;
+            }
+        }
+
+        //Run query(i, interaction_list[i]) for every i < num_query in parallel, visiting the queries in Morton order of pos.
+        template <typename Function>
+        void ForEachQuery(const Scalar* pos, unsigned int num_query, std::vector<std::vector<unsigned int>>& interaction_list, Function&& query) const {
+            std::vector<Detail::MortonKey> order(num_query), tmp;
+            interaction_list.resize(num_query);
+#pragma omp parallel for schedule(static)
+            for(int i = 0;i<static_cast<int>(num_query);++i) {
+                order[i].key = MortonKey(pos + DIM*i);
+                order[i].id  = i;
+            }
+            Detail::RadixSort(order, tmp, KEY_BITS*DIM);
+
+#pragma omp parallel for schedule(dynamic, 64)
+            for(int k = 0;k<static_cast<int>(num_query);++k) {
+                const unsigned int i = order[k].id;
+                interaction_list[i].clear();
+                query(i, interaction_list[i]);
+            }
+        }
+
+        //Emit the tree from the sorted keys. The top cells are cut serially into subtrees of about size/(16*threads) bodies.
+        //Each subtree counts its cells, gets a block of the arena by a prefix sum and fills it on its own thread.
+        void LoadSortedBody() {
+            std::vector<SortedTask> task;
+            const int grain = std::max<int>(m_leaf_capacity, m_size/(16*Detail::MaxThreads()));
+            SplitSortedBody(0, m_rsize, 0, 0, m_size, grain, task);
+            const std::uint32_t num_top = static_cast<std::uint32_t>(m_build_cell.size());
+
+#pragma omp parallel for schedule(dynamic, 1)
+            for(int t = 0;t<static_cast<int>(task.size());++t)
+                task[t].first = CountSortedCell(task[t].level, task[t].beg, task[t].end);
+            std::uint64_t num_cell = num_top;
+            for(SortedTask& t : task) {
+                const std::uint64_t count = t.first;
+                t.first   = static_cast<std::uint32_t>(std::min<std::uint64_t>(num_cell, NONE));
+                num_cell += count;
+            }
+            if(num_cell >= NONE)
+                TREE_PRINT_ERROR(stdout, "Too many cells for 32-bit indices\n");
+            m_build_cell.resize(num_cell);
+#ifdef TREE_STATISTICS
+            m_build_statistics.num_new_cell += num_cell - num_top;
+#endif
+
+#pragma omp parallel for schedule(dynamic, 1)
+            for(int t = 0;t<static_cast<int>(task.size());++t) {
+                std::uint32_t next = task[t].first;
+                FillSortedCell(task[t].cell, task[t].size, task[t].level, task[t].beg, task[t].end, next, task[t].deep);
+            }
+            TopSearchRadius(0, num_top);
+
+            //bodies the keys cannot separate are inserted one by one, which may split their leaf further
+            std::uint64_t num_deep = 0;
+            for(const SortedTask& t : task)
+                for(const SortedTask& leaf : t.deep) {
+                    m_build_cell[leaf.cell].body       = NONE;
+                    m_build_cell[leaf.cell].body_count = 0;
+                    for(int i = leaf.end-1;i >= leaf.beg;--i)
+                        LoadBody(m_keys[i].id, leaf.cell, leaf.size);
+                    num_deep += leaf.end - leaf.beg;
+                }
+#ifdef TREE_STATISTICS
+            m_build_statistics.num_insert += m_size - num_deep;
+#endif
+        }
+
+        //keys [beg, end) below cell of the arena (size size, depth level), emitted by one thread into the cells from first on
+        struct SortedTask {
+            std::uint32_t cell;
+            Scalar size;
+            unsigned int level;
+            int beg, end;
+            std::uint32_t first;           //number of cells below cell until the prefix sum
+            std::vector<SortedTask> deep; //leaves at the depth of KEY_BITS with more than m_leaf_capacity bodies
+        };
+
+        //emit the cells of the sorted keys [beg, end) serially down to subtrees of at most grain bodies, which become tasks
+        void SplitSortedBody(std::uint32_t q, Scalar qsize, unsigned int level, int beg, int end, int grain, std::vector<SortedTask>& task) {
+            if(end - beg <= grain || level == KEY_BITS) {
+                task.push_back({q, qsize, level, beg, end, 0, {}});
+                return;
+            }
+            const unsigned int shift = (KEY_BITS-1-level)*DIM;
+            m_build_cell[q].leaf = false;
+            ForEachDigitRun(shift, beg, end, [&](unsigned int digit, int first, int last) {
+                const std::uint32_t c = MakeSubCell(q, qsize, digit);
+                m_build_cell[q].subP[digit] = c;
+                SplitSortedBody(c, qsize/2, level+1, first, last, grain, task);
+            });
+        }
+
+        //calls f(digit, first, last) for every run [first, last) of the sorted keys [beg, end) sharing the digit at shift
+        template <typename Function>
+        void ForEachDigitRun(unsigned int shift, int beg, int end, Function&& f) const {
+            int first = beg;
+            while(first < end) {
+                const unsigned int digit = (m_keys[first].key >> shift) & (NSUB-1);
+                int last = first + 1;
+                while(last < end && ((m_keys[last].key >> shift) & (NSUB-1)) == digit)
+                    ++last;
+                f(digit, first, last);
+                first = last;
+            }
+        }
+
+        //number of cells FillSortedCell makes below a cell of depth level holding the sorted keys [beg, end)
+        std::uint32_t CountSortedCell(unsigned int level, int beg, int end) const {
+            if(end - beg <= static_cast<int>(m_leaf_capacity) || level == KEY_BITS)
+                return 0;
+            std::uint32_t count = 0;
+            ForEachDigitRun((KEY_BITS-1-level)*DIM, beg, end, [&](unsigned int, int first, int last) { count += 1 + CountSortedCell(level+1, first, last); });
+            return count;
+        }
+
+        //Emit the subtree of cell q (size qsize, depth level) from the sorted keys [beg, end), taking new cells from next on.
+        void FillSortedCell(std::uint32_t q, Scalar qsize, unsigned int level, int beg, int end, std::uint32_t& next, std::vector<SortedTask>& deep) {
+            if(end - beg <= static_cast<int>(m_leaf_capacity) || level == KEY_BITS) {
+                //q is a leaf, or the keys cannot separate these bodies any more
+                for(int i = end-1;i >= beg;--i) {
+                    m_build_cell[q].max_search_radius = std::max(m_build_cell[q].max_search_radius, m_radius(m_keys[i].id));
+                    PushBody(m_keys[i].id, q);
+                }
+                if(end - beg > static_cast<int>(m_leaf_capacity))
+                    deep.push_back({q, qsize, level, beg, end, 0, {}});
+                return;
+            }
+
+            m_build_cell[q].leaf = false;
+            ForEachDigitRun((KEY_BITS-1-level)*DIM, beg, end, [&](unsigned int digit, int first, int last) {
+                const std::uint32_t c = next++;
+                ClearCell(m_build_cell[c]);
+                PlaceSubCell(c, q, qsize, digit);
+                FillSortedCell(c, qsize/2, level+1, first, last, next, deep);
+                m_build_cell[q].subP[digit] = c;
+                m_build_cell[q].max_search_radius = std::max(m_build_cell[q].max_search_radius, m_build_cell[c].max_search_radius);
+            });
+        }
+
+        //max_search_radius of the cells q < num_top emitted by SplitSortedBody, from the subtrees below them
+        Scalar TopSearchRadius(std::uint32_t q, std::uint32_t num_top) {
+            BuildCell& cell = m_build_cell[q];
+            if(q < num_top && !cell.leaf)
+                for(std::uint32_t c : cell.subP)
+                    if(c != NONE)
+                        cell.max_search_radius = std::max(cell.max_search_radius, TopSearchRadius(c, num_top));
+            return cell.max_search_radius;
+        }
+
+        int SubIndex(std::uint32_t p, const BuildCell& q) const {
+            int ind = 0;
+            for(unsigned int k = 0;k<DIM;++k) {
+                if(q.position[k] <= m_pos(p, k))
+                    ind += NSUB >> (k+1);
+            }
+            return ind;
+        }
+
+        //sum the weights of the bodies of every cell in the subtree of p
+        void PropagateInfo(const Cell* p) {
+            Scalar* w = CellWeight(p);
+            for(unsigned int k = 0;k<m_num_weight;++k)
+                w[k] = 0;
+            if(isLeaf(p)) {
+                for(std::uint32_t i = p->body_begin;i<p->body_begin + p->body_count;++i)
+                    for(unsigned int k = 0;k<m_num_weight;++k)
+                        w[k] += m_leaf_weight[m_num_weight*std::size_t(i) + k];
+                return;
+            }
+            for(const Cell* q = p+1;q != Next(p);q = Next(q)) {
+                PropagateInfo(q);
+                for(unsigned int k = 0;k<m_num_weight;++k)
+                    w[k] += CellWeight(q)[k];
+            }
+        }
+
+        //max_depth of m_build_statistics, and the depth of the leaf of every body summed into depth_sum
+        void LeafDepth(const Cell* p, unsigned int depth, std::uint64_t& depth_sum) {
+            if(isLeaf(p)) {
+                m_build_statistics.max_depth = std::max(m_build_statistics.max_depth, depth);
+                depth_sum += std::uint64_t(depth)*p->body_count;
+                return;
+            }
+            for(const Cell* q = p+1;q != Next(p);q = Next(q))
+                LeafDepth(q, depth + 1, depth_sum);
+        }
+
+        Scalar* CellWeight(const Cell* p) {
+            return m_cell_weight.data() + m_num_weight*std::size_t(p - Root());
+        }
+
+        const Scalar* CellWeight(const Cell* p) const {
+            return m_cell_weight.data() + m_num_weight*std::size_t(p - Root());
+        }
+
+        //copy body i to the slot k of the m_leaf_* arrays
+        void CopyLeafBody(std::uint32_t i, unsigned int k) {
+            for(unsigned int dim = 0;dim<DIM;++dim)
+                m_leaf_position[dim][k] = m_pos(i, dim);
+            m_leaf_search_radius[k] = m_radius(i);
+            m_leaf_id[k]            = i;
+            for(unsigned int w = 0;w<m_num_weight;++w)
+                m_leaf_weight[m_num_weight*std::size_t(k) + w] = m_weight[m_num_weight*std::size_t(i) + w];
+            if(isMixed()) {
+                for(unsigned int dim = 0;dim<DIM;++dim)
+                    m_leaf_position_low[dim][k] = static_cast<float>(m_pos(i, dim) - m_root_position[dim]);
+                m_leaf_search_radius_high[k] = static_cast<float>(m_radius(i) + MixedMargin(m_radius(i)));
+            }
+        }
+
+        //Lay the grid over the bounding box of the bodies with cells as wide as the largest search radius, widened to keep at most 2 cells per body,
+        //and count the bodies of every cell. With automatic, return false (no grid) unless a grid pays off:
+        //the largest search radius is at most twice the mean, and no cell holds more than 8 times the mean body count of the nonempty cells.
+        bool BinGrid(bool automatic) {
+            std::array<Scalar, DIM> lower, upper;
+            lower.fill(std::numeric_limits<Scalar>::infinity());
+            upper.fill(-std::numeric_limits<Scalar>::infinity());
+            Scalar max_search_radius = 0, sum_search_radius = 0;
+            for(int i = 0;i<m_size;++i) {
+                for(unsigned int dim = 0;dim<DIM;++dim) {
+                    lower[dim] = std::min(lower[dim], m_pos(i, dim));
+                    upper[dim] = std::max(upper[dim], m_pos(i, dim));
+                }
+                max_search_radius  = std::max(max_search_radius, m_radius(i));
+                sum_search_radius += m_radius(i);
+            }
+            if(m_size == 0 || (automatic && max_search_radius > 2*sum_search_radius/m_size))
+                return false;
+
+            Scalar width = 0;
+            for(unsigned int dim = 0;dim<DIM;++dim)
+                width = std::max(width, upper[dim] - lower[dim]);
+            m_grid_edge = max_search_radius > 0 ? max_search_radius : width/std::pow(Scalar(m_size), Scalar(1)/DIM);
+            while(true) {
+                double num_cell = 1;
+                for(unsigned int dim = 0;dim<DIM;++dim)
+                    num_cell *= m_grid_edge > 0 ? std::floor((upper[dim] - lower[dim])/m_grid_edge) + 1 : 1;
+                if(m_grid_edge == 0 || num_cell <= 2.0*m_size + 1)
+                    break;
+                m_grid_edge *= std::max(Scalar(1.01), Scalar(std::pow(num_cell/(2.0*m_size), 1.0/DIM)));
+            }
+            if(m_grid_edge == 0)
+                m_grid_edge = 1; //every body at one position
+            std::size_t num_cell = 1;
+            for(unsigned int dim = 0;dim<DIM;++dim) {
+                m_grid_lower[dim] = lower[dim];
+                m_grid_size[dim]  = static_cast<unsigned int>(std::floor((upper[dim] - lower[dim])/m_grid_edge)) + 1;
+                num_cell *= m_grid_size[dim];
+            }
+
+            m_grid_begin.assign(num_cell + 1, 0);
+            m_grid_cell.resize(m_size);
+            for(int i = 0;i<m_size;++i) {
+                std::size_t c = 0;
+                for(unsigned int dim = 0;dim<DIM;++dim)
+                    c = c*m_grid_size[dim] + GridIndex(m_pos(i, dim), dim);
+                m_grid_cell[i] = static_cast<std::uint32_t>(c);
+                ++m_grid_begin[c + 1];
+            }
+            if(automatic) {
+                unsigned int max_count = 0, num_nonempty = 0;
+                for(std::size_t c = 1;c<=num_cell;++c) {
+                    max_count     = std::max(max_count, m_grid_begin[c]);
+                    num_nonempty += m_grid_begin[c] > 0;
+                }
+                if(max_count > 8.0*m_size/num_nonempty)
+                    return false;
+            }
+            return true;
+        }
+
+        //cell of coordinate x along dim, the same floor for bodies and for the ends of a search range so that both agree after rounding
+        unsigned int GridIndex(Scalar x, unsigned int dim) const {
+            const Scalar k = std::floor((x - m_grid_lower[dim])/m_grid_edge);
+            return k < 0 ? 0 : (k >= m_grid_size[dim] ? m_grid_size[dim] - 1 : static_cast<unsigned int>(k));
+        }
+
+        //Copy the bodies binned by BinGrid to the m_leaf_* arrays in cell order. m_cell gets the root only, the box of all bodies.
+        void FillGrid() {
+            const std::size_t num_cell = m_grid_begin.size() - 1;
+            for(std::size_t c = 0;c<num_cell;++c)
+                m_grid_begin[c + 1] += m_grid_begin[c];
+            std::vector<unsigned int> fill(m_grid_begin.begin(), m_grid_begin.end() - 1);
+            Scalar max_search_radius = 0;
+            for(int i = 0;i<m_size;++i) {
+                CopyLeafBody(i, fill[m_grid_cell[i]]++);
+                max_search_radius = std::max(max_search_radius, m_radius(i));
+            }
+            m_num_leaf_body = m_size;
+            m_body_leaf.clear(); //no tree for REFIT
+            m_build_cell.clear();
+
+            Cell root;
+            for(unsigned int dim = 0;dim<DIM;++dim) {
+                const Scalar upper = m_grid_lower[dim] + m_grid_size[dim]*m_grid_edge;
+                root.position[dim] = (m_grid_lower[dim] + upper)/2;
+                root.half[dim]     = (upper - m_grid_lower[dim])/2;
+            }
+            root.max_search_radius = max_search_radius;
+            root.next              = 1;
+            root.body_begin        = 0;
+            root.body_count        = m_num_leaf_body;
+            m_cell.assign(1, root);
+            m_leaf_cell.assign(1, 0);
+        }
+
+        //Calls f(begin, end) for the leaf bodies of every run of grid cells along the last axis that meets the box [lower - reach, upper + reach]
+        template <typename Function>
+        void ForEachGridRun(const Scalar* lower, const Scalar* upper, Scalar reach, Function&& f) const {
+            std::array<unsigned int, DIM> begin, end, c;
+            for(unsigned int dim = 0;dim<DIM;++dim) {
+                const Scalar grid_upper = m_grid_lower[dim] + m_grid_size[dim]*m_grid_edge;
+                if(upper[dim] + reach < m_grid_lower[dim] || lower[dim] - reach > grid_upper)
+                    return;
+                begin[dim] = GridIndex(lower[dim] - reach, dim);
+                end[dim]   = GridIndex(upper[dim] + reach, dim) + 1;
+            }
+            c = begin;
+            while(true) {
+                std::size_t first = 0;
+                for(unsigned int dim = 0;dim<DIM;++dim)
+                    first = first*m_grid_size[dim] + (dim == DIM-1 ? begin[dim] : c[dim]);
+                const std::size_t last = first + (end[DIM-1] - begin[DIM-1]);
+                TREE_STATISTICS_COUNT(num_cell_visited, last - first);
+                if(m_grid_begin[first] < m_grid_begin[last])
+                    f(m_grid_begin[first], m_grid_begin[last]);
+                //next run: odometer over all axes but the last
+                int dim = static_cast<int>(DIM) - 2;
+                while(dim >= 0 && ++c[dim] == end[dim]) {
+                    c[dim] = begin[dim];
+                    --dim;
+                }
+                if(dim < 0)
+                    return;
+            }
+        }
+
+        //emit for every accepted body of the grid cells within reach of pos, see WalkTree
+        template <SearchMode SEARCH_MODE, typename Function>
+        void WalkGrid(const Scalar* pos, const Scalar radius, Function& emit) const {
+            ForEachGridRun(pos, pos, Far(Reach<SEARCH_MODE>(radius)), [&](unsigned int begin, unsigned int end) {
+                Filter<SEARCH_MODE, false>(begin, end, pos, radius, nullptr, emit);
+            });
+        }
+
+        //Calls f(image, shift) for every image = pos - shift, shift = n*boundary_length, whose box of half width reach meets the root box
+        template <typename Function>
+        void ForEachPeriodicImage(const Scalar* pos, Scalar reach, const Scalar* boundary_length, Function&& f) const {
+            Scalar image[DIM], shift[DIM];
+            ForEachPeriodicImage(pos, reach, boundary_length, 0, image, shift, f);
+        }
+
+        template <typename Function>
+        void ForEachPeriodicImage(const Scalar* pos, Scalar reach, const Scalar* boundary_length, unsigned int dim, Scalar* image, Scalar* shift, Function& f) const {
+            if(dim == DIM) {
+                f(static_cast<const Scalar*>(image), static_cast<const Scalar*>(shift));
+                return;
+            }
+            const Scalar lower = Root()->position[dim] - Root()->half[dim], upper = Root()->position[dim] + Root()->half[dim];
+            const Scalar n_begin = std::ceil((pos[dim] - reach - upper)/boundary_length[dim]), n_end = std::floor((pos[dim] + reach - lower)/boundary_length[dim]);
+            for(Scalar n = n_begin;n <= n_end;++n) {
+                shift[dim] = n*boundary_length[dim];
+                image[dim] = pos[dim] - shift[dim];
+                ForEachPeriodicImage(pos, reach, boundary_length, dim+1, image, shift, f);
+            }
+        }
+
+        //WalkTreeWithPeriodicBoundary, or WalkGrid from the periodic images of pos
+        template <SearchMode SEARCH_MODE, typename Function>
+        void WalkWithPeriodicBoundary(const Scalar* pos, Scalar radius, const Scalar* boundary_length, Function& emit) const {
+            if(!m_grid) {
+                WalkTreeWithPeriodicBoundary<SEARCH_MODE>(pos, radius, boundary_length, emit, Root());
+                return;
+            }
+            ForEachPeriodicImage(pos, Far(Reach<SEARCH_MODE>(radius)), boundary_length, [&](const Scalar* image, const Scalar*) { WalkGrid<SEARCH_MODE>(image, radius, emit); });
+        }
+
+        void RequireTree() const {
+            if(m_grid)
+                TREE_PRINT_ERROR(stdout, "This query needs Backend::TREE, see SetBackend\n");
+        }
+
+        //Lay out the build cells in depth-first order. Subtree sizes are summed bottom-up, as the arena holds every cell after its parent,
+        //so the subtrees of at most size/(16*threads) bodies know their place in m_cell and m_leaf_* and are laid out in parallel.
+        //The cells above them are laid out serially afterwards.
+        void LinearizeTree() {
+            m_subtree_size.resize(m_build_cell.size());
+            for(std::size_t p = m_build_cell.size();p-- > 0;) {
+                const BuildCell& b = m_build_cell[p];
+                SubtreeSize& size  = m_subtree_size[p];
+                size = {1, b.leaf ? 1u : 0u, b.leaf ? b.body_count : 0u};
+                if(!b.leaf)
+                    for(std::uint32_t c : b.subP)
+                        if(c != NONE) {
+                            size.num_cell += m_subtree_size[c].num_cell;
+                            size.num_leaf += m_subtree_size[c].num_leaf;
+                            size.num_body += m_subtree_size[c].num_body;
+                        }
+            }
+            m_cell.resize(m_subtree_size[0].num_cell);
+            m_leaf_cell.resize(m_subtree_size[0].num_leaf);
+
+            std::vector<ThreadTask> task;
+            ThreadCursor at{0, 0, 0};
+            PlanThreadTree(0, std::max<std::uint32_t>(m_leaf_capacity, m_size/(16*Detail::MaxThreads())), at, task);
+#pragma omp parallel for schedule(dynamic, 1)
+            for(int t = 0;t<static_cast<int>(task.size());++t) {
+                ThreadCursor task_at = task[t].at;
+                ThreadTree(task[t].build_cell, task_at, task[t].lower, task[t].upper);
+            }
+            at = {0, 0, 0};
+            std::size_t next_task = 0;
+            Scalar lower[DIM], upper[DIM];
+            ThreadTree(0, at, lower, upper, &task, &next_task);
+            m_num_leaf_body = at.body;
+        }
+
+        //next free cell, leaf cell and leaf body of the depth-first layout
+        struct ThreadCursor {
+            std::uint32_t cell, leaf, body;
+        };
+
+        //subtree of build cell build_cell laid out from at by one thread, and the bounding box of its bodies
+        struct ThreadTask {
+            std::uint32_t build_cell;
+            ThreadCursor at;
+            Scalar lower[DIM], upper[DIM];
+        };
+
+        //cut the tree into subtrees of at most grain bodies in depth-first order, advancing at over the cells above them and over them
+        void PlanThreadTree(std::uint32_t p, std::uint32_t grain, ThreadCursor& at, std::vector<ThreadTask>& task) const {
+            const SubtreeSize& size = m_subtree_size[p];
+            if(size.num_body <= grain || m_build_cell[p].leaf) {
+                task.push_back({p, at, {}, {}});
+                at.cell += size.num_cell;
+                at.leaf += size.num_leaf;
+                at.body += size.num_body;
+                return;
+            }
+            ++at.cell;
+            for(std::uint32_t c : m_build_cell[p].subP)
+                if(c != NONE)
+                    PlanThreadTree(c, grain, at, task);
+        }
+
+        //Write the subtree of build cell p to m_cell in depth-first order from at, and the bodies of each leaf to m_leaf_* in the same order.
+        //lower and upper get the bounding box of the bodies of the subtree (empty if lower > upper).
+        //Subtrees of done from *next_done on, in depth-first order, are laid out already and only skipped.
+        void ThreadTree(std::uint32_t p, ThreadCursor& at, Scalar* lower, Scalar* upper, const std::vector<ThreadTask>* done = nullptr, std::size_t* next_done = nullptr) {
+            if(done != nullptr && *next_done < done->size() && (*done)[*next_done].build_cell == p) {
+                const ThreadTask& t = (*done)[(*next_done)++];
+                for(unsigned int dim = 0;dim<DIM;++dim) {
+                    lower[dim] = t.lower[dim];
+                    upper[dim] = t.upper[dim];
+                }
+                at.cell += m_subtree_size[p].num_cell;
+                at.leaf += m_subtree_size[p].num_leaf;
+                at.body += m_subtree_size[p].num_body;
+                return;
+            }
+
+            const BuildCell& b = m_build_cell[p];
+            const std::uint32_t c = at.cell++;
+            m_cell[c].body_begin = at.body;
+            for(unsigned int dim = 0;dim<DIM;++dim) {
+                lower[dim] = std::numeric_limits<Scalar>::infinity();
+                upper[dim] = -std::numeric_limits<Scalar>::infinity();
+            }
+
+            //max_search_radius is taken from the bodies again, as RefitTree keeps cells whose bodies may have new radii
+            Scalar max_search_radius = 0;
+            if(b.leaf) {
+                m_leaf_cell[at.leaf++] = c;
+                for(std::uint32_t i = b.body;i != NONE;i = m_body_next[i]) {
+                    for(unsigned int dim = 0;dim<DIM;++dim) {
+                        lower[dim] = std::min(lower[dim], m_pos(i, dim));
+                        upper[dim] = std::max(upper[dim], m_pos(i, dim));
+                    }
+                    CopyLeafBody(i, at.body);
+                    m_body_leaf[i]    = p;
+                    max_search_radius = std::max(max_search_radius, m_radius(i));
+                    ++at.body;
+                }
+            }else {
+                for(unsigned int i = 0;i<NSUB;++i) {
+                    if(b.subP[i] != NONE) {
+                        const std::uint32_t sub = at.cell;
+                        Scalar sub_lower[DIM], sub_upper[DIM];
+                        ThreadTree(b.subP[i], at, sub_lower, sub_upper, done, next_done);
+                        max_search_radius = std::max(max_search_radius, m_cell[sub].max_search_radius);
+                        for(unsigned int dim = 0;dim<DIM;++dim) {
+                            lower[dim] = std::min(lower[dim], sub_lower[dim]);
+                            upper[dim] = std::max(upper[dim], sub_upper[dim]);
+                        }
+                    }
+                }
+            }
+            m_cell[c].max_search_radius = max_search_radius;
+            m_cell[c].body_count = at.body - m_cell[c].body_begin;
+            for(unsigned int dim = 0;dim<DIM;++dim) {
+                if(!m_tight_cell_box) {
+                    m_cell[c].position[dim] = b.position[dim];
+                    m_cell[c].half[dim]     = b.size/2;
+                }else if(m_cell[c].body_count == 0) {
+                    m_cell[c].position[dim] = b.position[dim];
+                    m_cell[c].half[dim]     = 0;
+                }else {
+                    m_cell[c].position[dim] = (lower[dim] + upper[dim])/2;
+                    m_cell[c].half[dim]     = (upper[dim] - lower[dim])/2;
+                }
+            }
+            m_cell[c].next = at.cell;
+        }
+
+        //emit(i) or emit(i, r2, dx) for every accepted body i of the m_leaf_* arrays, see Detail::FilterBody
+        template <SearchMode SEARCH_MODE, typename Function>
+        void WalkTree(const Scalar* pos,const Scalar radius,Function& emit,const Cell* p) const {
+            const Cell* q;
+            TREE_STATISTICS_COUNT(num_cell_visited, 1);
+            if(isLeaf(p)) {
+                WalkLeaf<SEARCH_MODE, false>(pos,radius,nullptr,emit,p);
+                return;
+            }
+            //search all of p's direct descendants
+            for(q = p+1;q != Next(p);q = Next(q)) {
+                if constexpr (SEARCH_MODE == SearchMode::GATHER) {
+                    if(isNearTarget(pos,radius,q))
+                        WalkTree<SEARCH_MODE>(pos,radius,emit,q);
+                }else if constexpr (SEARCH_MODE == SearchMode::SYMMETRY) {
+                    if(isNearTarget(pos,radius,q) || isNearTarget(pos, q->max_search_radius, q))
+                        WalkTree<SEARCH_MODE>(pos,radius,emit,q);
+                }
+            }
+        }
+
+        //Number of bodies accepted by Detail::FilterBody for the search sphere, adding their weights to sum unless it is null.
+        //A cell inside the sphere is taken as a whole, as every body in it passes the distance test in either search mode.
+        template <SearchMode SEARCH_MODE, bool PERIODIC>
+        unsigned int WalkTreeSummary(const Scalar* pos, Scalar radius, const Scalar* boundary_length, Scalar* sum) const {
+            TREE_PRINT_INFO("start\n");
+            RequireTree();
+            TREE_STATISTICS_SCOPE;
+            unsigned int count = 0;
+            if(sum != nullptr) {
+                for(unsigned int k = 0;k<m_num_weight;++k)
+                    sum[k] = 0;
+            }
+            auto cell = [&](const Cell* p) {
+                TREE_STATISTICS_COUNT(num_body_accepted, p->body_count);
+                count += p->body_count;
+                if(sum != nullptr) {
+                    const Scalar* w = CellWeight(p);
+                    for(unsigned int k = 0;k<m_num_weight;++k)
+                        sum[k] += w[k];
+                }
+            };
+            auto emit = [&](unsigned int i) {
+                ++count;
+                if(sum != nullptr) {
+                    for(unsigned int k = 0;k<m_num_weight;++k)
+                        sum[k] += m_leaf_weight[m_num_weight*std::size_t(i) + k];
+                }
+            };
+            if constexpr (PERIODIC)
+                WalkTreeSummary<SEARCH_MODE, true>(pos, radius, boundary_length, cell, emit, Root());
+            else
+                ForEachImage(pos, Reach<SEARCH_MODE>(radius), [&](const Scalar* image, const Scalar*) { WalkTreeSummary<SEARCH_MODE, false>(image, radius, nullptr, cell, emit, Root()); });
+            TREE_PRINT_INFO("finish\n");
+            return count;
+        }
+
+        template <SearchMode SEARCH_MODE, bool PERIODIC, typename CellFunction, typename Function>
+        void WalkTreeSummary(const Scalar* pos, Scalar radius, const Scalar* boundary_length, CellFunction& cell, Function& emit, const Cell* p) const {
+            TREE_STATISTICS_COUNT(num_cell_visited, 1);
+            if(isInside<PERIODIC>(pos, radius, boundary_length, p)) {
+                cell(p);
+                return;
+            }
+            if(isLeaf(p)) {
+                WalkLeaf<SEARCH_MODE, PERIODIC>(pos, radius, boundary_length, emit, p);
+                return;
+            }
+            for(const Cell* q = p+1;q != Next(p);q = Next(q)) {
+                if(isNear<PERIODIC>(pos, radius, boundary_length, q)
+                   || (SEARCH_MODE == SearchMode::SYMMETRY && isNear<PERIODIC>(pos, q->max_search_radius, boundary_length, q)))
+                    WalkTreeSummary<SEARCH_MODE, PERIODIC>(pos, radius, boundary_length, cell, emit, q);
+            }
+        }
+
+        //WalkTree from every image of pos that may reach a body, see ForEachImage
+        template <SearchMode SEARCH_MODE, typename Function>
+        void WalkTreeWithBoundary(const Scalar* pos, Scalar radius, Function& emit) const {
+            TREE_STATISTICS_SCOPE;
+            ForEachImage(pos, Reach<SEARCH_MODE>(radius), [&](const Scalar* image, const Scalar*) {
+                if(m_grid)
+                    WalkGrid<SEARCH_MODE>(image, radius, emit);
+                else
+                    WalkTree<SEARCH_MODE>(image, radius, emit, Root());
+            });
+        }
+
+        //distance from a query of radius within which its neighbors may lie
+        template <SearchMode SEARCH_MODE>
+        Scalar Reach(Scalar radius) const {
+            return SEARCH_MODE == SearchMode::SYMMETRY ? std::max(radius, Root()->max_search_radius) : radius;
+        }
+
+        //Calls f(image, shift) for every image = pos - shift whose sphere of radius reach may hold a body, where shift is a translation of the
+        //lattice of SetBoundary: n*(domain length) along PERIODIC and SHEAR axes, plus n*(shear shift) along the axis of SetShear for n images across the SHEAR axis.
+        //A query away from every wall gets only image = pos, so it runs as fast as with open boundaries.
+        template <typename Function>
+        void ForEachImage(const Scalar* pos, Scalar reach, Function&& f) const {
+            Scalar image[DIM], shift[DIM];
+            for(unsigned int dim = 0;dim<DIM;++dim) {
+                image[dim] = pos[dim];
+                shift[dim] = 0;
+            }
+            if(std::all_of(m_boundary.begin(), m_boundary.end(), [](Boundary b) { return b == Boundary::OPEN; })) {
+                f(static_cast<const Scalar*>(image), static_cast<const Scalar*>(shift));
+                return;
+            }
+            //the SHEAR axis goes first, as it decides the shift along the axis of SetShear
+            std::array<unsigned int, DIM> order;
+            unsigned int k = 0;
+            for(unsigned int dim = 0;dim<DIM;++dim)
+                if(m_boundary[dim] == Boundary::SHEAR)
+                    order[k++] = dim;
+            for(unsigned int dim = 0;dim<DIM;++dim)
+                if(m_boundary[dim] != Boundary::SHEAR)
+                    order[k++] = dim;
+            ForEachImage(pos, Far(reach), order, 0, 0, image, shift, f);
+        }
+
+        template <typename Function>
+        void ForEachImage(const Scalar* pos, Scalar reach, const std::array<unsigned int, DIM>& order, unsigned int k, Scalar shear, Scalar* image, Scalar* shift, Function& f) const {
+            if(k == DIM) {
+                f(static_cast<const Scalar*>(image), static_cast<const Scalar*>(shift));
+                return;
+            }
+            const unsigned int dim = order[k];
+            const Scalar base = m_shear_dim == dim ? shear : 0;
+            if(m_boundary[dim] == Boundary::OPEN) {
+                shift[dim] = base;
+                image[dim] = pos[dim] - base;
+                ForEachImage(pos, reach, order, k+1, shear, image, shift, f);
+                return;
+            }
+            //n such that [pos - base - n*length - reach, pos - base - n*length + reach] meets the box of the bodies
+            const Scalar length = m_domain_upper[dim] - m_domain_lower[dim];
+            const Scalar lower  = Root()->position[dim] - Root()->half[dim], upper = Root()->position[dim] + Root()->half[dim];
+            const Scalar n_begin = std::ceil((pos[dim] - base - reach - upper)/length), n_end = std::floor((pos[dim] - base + reach - lower)/length);
+            for(Scalar n = n_begin;n <= n_end;++n) {
+                shift[dim] = base + n*length;
+                image[dim] = pos[dim] - shift[dim];
+                ForEachImage(pos, reach, order, k+1, m_boundary[dim] == Boundary::SHEAR ? n*m_shear_shift : shear, image, shift, f);
+            }
+        }
+
+        static bool isZero(const Scalar* shift) {
+            for(unsigned int dim = 0;dim<DIM;++dim)
+                if(shift[dim] != 0)
+                    return false;
+            return true;
+        }
+
+        //true if the first nonzero component of shift is positive, which picks one of every two opposite shifts
+        static bool isPositive(const Scalar* shift) {
+            for(unsigned int dim = 0;dim<DIM;++dim)
+                if(shift[dim] != 0)
+                    return shift[dim] > 0;
+            return false;
+        }
+
+        //distance test of every body of leaf p
+        template <SearchMode SEARCH_MODE, bool PERIODIC, typename Function>
+        void WalkLeaf(const Scalar* pos,const Scalar radius,const Scalar* boundary_length,Function& emit,const Cell* p) const {
+            Filter<SEARCH_MODE, PERIODIC>(p->body_begin, p->body_begin + p->body_count, pos, radius, boundary_length, emit);
+        }
+
+        bool isMixed() const {
+            return !std::is_same<Scalar, float>::value && m_precision == Precision::MIXED;
+        }
+
+        //Bound of the float round-off of a distance up to radius between two points within 2*m_rsize of the root center, see FilterBodyMixed.
+        //Each coordinate, difference, periodic shift and the squared sum adds at most a few float epsilons of these magnitudes.
+        Scalar MixedMargin(Scalar radius) const {
+            return 4*DIM*Scalar(std::numeric_limits<float>::epsilon())*(2*m_rsize + radius);
+        }
+
+        //Detail::FilterBody on the leaf bodies [begin, end), counting the bodies tested and accepted with TREE_STATISTICS
+        template <SearchMode SEARCH_MODE, bool PERIODIC, typename Function>
+        void Filter(unsigned int begin, unsigned int end, const Scalar* pos, Scalar radius, const Scalar* boundary_length, Function&& emit) const {
+#ifdef TREE_STATISTICS
+            TREE_STATISTICS_COUNT(num_body_tested, end - begin);
+            if constexpr (std::is_invocable<Function&, unsigned int, Scalar, const Scalar*>::value)
+                FilterBodies<SEARCH_MODE, PERIODIC>(begin, end, pos, radius, boundary_length, [&](unsigned int i, Scalar r2, const Scalar* dx) {
+                    TREE_STATISTICS_COUNT(num_body_accepted, 1);
+                    emit(i, r2, dx);
+                });
+            else
+                FilterBodies<SEARCH_MODE, PERIODIC>(begin, end, pos, radius, boundary_length, [&](unsigned int i) {
+                    TREE_STATISTICS_COUNT(num_body_accepted, 1);
+                    emit(i);
+                });
+#else
+            FilterBodies<SEARCH_MODE, PERIODIC>(begin, end, pos, radius, boundary_length, emit);
+#endif
+        }
+
+        //with the float pre-filter of Precision::MIXED when its margin holds: pos inside the root cell and a periodic box no larger than it
+        template <SearchMode SEARCH_MODE, bool PERIODIC, typename Function>
+        void FilterBodies(unsigned int begin, unsigned int end, const Scalar* pos, Scalar radius, const Scalar* boundary_length, Function&& emit) const {
+            bool mixed = isMixed();
+            for(unsigned int dim = 0;mixed && dim<DIM;++dim) {
+                mixed = std::abs(pos[dim] - m_root_position[dim]) <= m_rsize/2;
+                if constexpr (PERIODIC)
+                    mixed = mixed && boundary_length[dim] <= m_rsize;
+            }
+            if(mixed) {
+                std::array<const float*, DIM> x_low;
+                for(unsigned int dim = 0;dim<DIM;++dim)
+                    x_low[dim] = m_leaf_position_low[dim].data();
+                Detail::FilterBodyMixed<DIM, Scalar, SEARCH_MODE, PERIODIC>(x_low, m_leaf_search_radius_high.data(), LeafPosition(), m_leaf_search_radius.data(), begin, end,
+                                                                           pos, radius, boundary_length, m_root_position.data(), MixedMargin(radius), emit);
+            }else {
+                Detail::FilterBody<DIM, Scalar, SEARCH_MODE, PERIODIC>(LeafPosition(), m_leaf_search_radius.data(), begin, end, pos, radius, boundary_length, emit);
+            }
+        }
+
+        static NeighborParticle<DIM, Scalar> MakeNeighborParticle(unsigned int id, Scalar r2, const Scalar* dx) {
+            NeighborParticle<DIM, Scalar> neighbor;
+            neighbor.id = id;
+            neighbor.r2 = r2;
+            for(unsigned int dim = 0;dim<DIM;++dim)
+                neighbor.dx[dim] = dx[dim];
+            return neighbor;
+        }
+
+        std::array<const Scalar*, DIM> LeafPosition() const {
+            std::array<const Scalar*, DIM> x;
+            for(unsigned int dim = 0;dim<DIM;++dim)
+                x[dim] = m_leaf_position[dim].data();
+            return x;
+        }
+
+        static bool isCloser(const NeighborParticle<DIM, Scalar>& a, const NeighborParticle<DIM, Scalar>& b) {
+            return a.r2 < b.r2 || (a.r2 == b.r2 && a.id < b.id);
+        }
+
+        template <bool PERIODIC>
+        void WalkTreeNearest(const Scalar* pos, unsigned int num_neighbor, const Scalar* boundary_length, std::vector<NeighborParticle<DIM, Scalar>>& neighbor) const {
+            RequireTree();
+            TREE_STATISTICS_SCOPE;
+            neighbor.clear();
+            if(num_neighbor == 0)
+                return;
+            WalkTreeNearest<PERIODIC>(pos, num_neighbor, boundary_length, neighbor, Root());
+            if constexpr (!PERIODIC) {
+                //images within the distance of the current farthest neighbor, up to half the shortest periodic length
+                Scalar reach = std::numeric_limits<Scalar>::infinity();
+                for(unsigned int dim = 0;dim<DIM;++dim)
+                    if(m_boundary[dim] != Boundary::OPEN)
+                        reach = std::min(reach, (m_domain_upper[dim] - m_domain_lower[dim])/2);
+                if(neighbor.size() == num_neighbor)
+                    reach = std::min(reach, std::sqrt(neighbor.front().r2));
+                if(reach < std::numeric_limits<Scalar>::infinity()) {
+                    ForEachImage(pos, reach, [&](const Scalar* image, const Scalar* shift) {
+                        if(!isZero(shift))
+                            WalkTreeNearest<false>(image, num_neighbor, nullptr, neighbor, Root());
+                    });
+                }
+            }
+            std::sort_heap(neighbor.begin(), neighbor.end(), isCloser);
+        }
+
+        //neighbor is a max-heap of the closest bodies found so far. Its top bounds the cells still worth opening.
+        template <bool PERIODIC>
+        void WalkTreeNearest(const Scalar* pos, unsigned int num_neighbor, const Scalar* boundary_length, std::vector<NeighborParticle<DIM, Scalar>>& neighbor, const Cell* p) const {
+            TREE_STATISTICS_COUNT(num_cell_visited, 1);
+            auto bound = [&]() {
+                //inflated so that a body tied with the top of the heap is still tested
+                return neighbor.size() < num_neighbor ? std::numeric_limits<Scalar>::infinity() : std::sqrt(neighbor.front().r2)*(Scalar(1) + 4*std::numeric_limits<Scalar>::epsilon());
+            };
+
+            if(isLeaf(p)) {
+                Filter<SearchMode::GATHER, PERIODIC>(p->body_begin, p->body_begin + p->body_count, pos, bound(), boundary_length, [&](unsigned int i, Scalar r2, const Scalar* dx) {
+                    const NeighborParticle<DIM, Scalar> candidate = MakeNeighborParticle(m_leaf_id[i], r2, dx);
+                    if(neighbor.size() < num_neighbor) {
+                        neighbor.emplace_back(candidate);
+                        std::push_heap(neighbor.begin(), neighbor.end(), isCloser);
+                    }else if(isCloser(candidate, neighbor.front())) {
+                        std::pop_heap(neighbor.begin(), neighbor.end(), isCloser);
+                        neighbor.back() = candidate;
+                        std::push_heap(neighbor.begin(), neighbor.end(), isCloser);
+                    }
+                });
+                return;
+            }
+
+            //open the children nearest first, so that the bound shrinks quickly
+            std::array<std::pair<Scalar, const Cell*>, NSUB> child;
+            unsigned int nchild = 0;
+            for(const Cell* q = p+1;q != Next(p);q = Next(q)) {
+                Scalar length = 0;
+                for(unsigned int dim = 0;dim<DIM;++dim) {
+                    Scalar dx = PERIODIC ? PeriodicDistance(pos[dim], q->position[dim], boundary_length[dim]) : pos[dim] - q->position[dim];
+                    length += dx*dx;
+                }
+                //insertion sort of at most NSUB children
+                unsigned int k = nchild++;
+                for(;k > 0 && child[k-1].first > length;--k)
+                    child[k] = child[k-1];
+                child[k] = {length, q};
+            }
+            for(unsigned int i = 0;i<nchild;++i)
+                if(isNear<PERIODIC>(pos, bound(), boundary_length, child[i].second))
+                    WalkTreeNearest<PERIODIC>(pos, num_neighbor, boundary_length, neighbor, child[i].second);
+        }
+
+        template <bool PERIODIC>
+        void SolveSearchRadius(unsigned int num_neighbor, unsigned int tolerance, const Scalar* boundary_length, Scalar* search_radius) const {
+            RequireTree();
+            const Scalar margin = std::pow(Scalar(2), Scalar(1)/DIM); //about twice the neighbors of the initial guess
+            const unsigned int lower = num_neighbor > tolerance ? num_neighbor - tolerance : 0;
+            const auto x = LeafPosition();
+
+#pragma omp parallel
+            {
+                TREE_STATISTICS_SCOPE;
+                std::vector<Scalar> candidate;
+                std::vector<NeighborParticle<DIM, Scalar>> nearest;
+#pragma omp for schedule(dynamic, 64)
+                for(int k = 0;k<static_cast<int>(m_num_leaf_body);++k) {
+                    const unsigned int id = m_leaf_id[k];
+                    Scalar pos[DIM];
+                    for(unsigned int dim = 0;dim<DIM;++dim)
+                        pos[dim] = x[dim][k];
+
+                    Scalar radius = search_radius[id];
+                    candidate.clear();
+                    if(radius > 0) {
+                        auto emit = [&](unsigned int, Scalar r2, const Scalar*) { candidate.emplace_back(r2); };
+                        if constexpr (PERIODIC)
+                            WalkTreeWithPeriodicBoundary<SearchMode::GATHER>(pos, radius*margin, boundary_length, emit, Root());
+                        else
+                            WalkTreeWithBoundary<SearchMode::GATHER>(pos, radius*margin, emit);
+
+                        unsigned int count = 0;
+                        for(Scalar r2 : candidate)
+                            count += r2 <= radius*radius;
+                        if(lower <= count && count <= num_neighbor + tolerance)
+                            continue;
+                    }
+
+                    Scalar r2;
+                    if(num_neighbor == 0) {
+                        r2 = 0;
+                    }else if(candidate.size() >= num_neighbor) {
+                        std::nth_element(candidate.begin(), candidate.begin() + (num_neighbor - 1), candidate.end());
+                        r2 = candidate[num_neighbor - 1];
+                    }else {
+                        WalkTreeNearest<PERIODIC>(pos, num_neighbor, boundary_length, nearest);
+                        r2 = nearest.empty() ? 0 : nearest.back().r2;
+                    }
+                    //inflated so that the num_neighbor-th particle stays inside after rounding
+                    search_radius[id] = std::sqrt(r2)*(Scalar(1) + 4*std::numeric_limits<Scalar>::epsilon());
+                }
+            }
+        }
+
+        //Bounding sphere (center, radius) of the leaf bodies [begin, end), and the largest search radius among them
+        void GroupSphere(unsigned int begin, unsigned int end, Scalar* center, Scalar& radius, Scalar& max_search_radius) const {
+            for(unsigned int dim = 0;dim<DIM;++dim) {
+                Scalar lower = m_leaf_position[dim][begin], upper = lower;
+                for(unsigned int i = begin+1;i<end;++i) {
+                    lower = std::min(lower, m_leaf_position[dim][i]);
+                    upper = std::max(upper, m_leaf_position[dim][i]);
+                }
+                center[dim] = (lower + upper)/2;
+            }
+            radius = 0, max_search_radius = 0;
+            for(unsigned int i = begin;i<end;++i) {
+                Scalar length = 0;
+                for(unsigned int dim = 0;dim<DIM;++dim)
+                    length += (m_leaf_position[dim][i] - center[dim])*(m_leaf_position[dim][i] - center[dim]);
+                radius = std::max(radius, std::sqrt(length));
+                max_search_radius = std::max(max_search_radius, m_leaf_search_radius[i]);
+            }
+            radius *= Scalar(1) + 4*std::numeric_limits<Scalar>::epsilon(); //round-off of sqrt must not shrink the sphere
+        }
+
+        //Calls member(thread, k, for_each_neighbor) for every leaf body k, where for_each_neighbor(f) calls f(i) for every neighbor i of k.
+        //k and i index the m_leaf_* arrays. Members of one leaf (or grid cell) are visited in a row by one thread.
+        template <SearchMode SEARCH_MODE, bool PERIODIC, typename Function>
+        void WalkGroup(const Scalar* boundary_length, Function&& member) const {
+            const auto x = LeafPosition();
+
+#pragma omp parallel
+            {
+                TREE_STATISTICS_SCOPE;
+                const int tid = Detail::ThreadNum();
+                std::vector<std::pair<unsigned int, unsigned int>> candidate;
+                std::vector<std::pair<std::size_t, std::array<Scalar, DIM>>> image; //end of the candidates of every image of the group and its shift
+                //candidates of the group (center, group_radius) moved by -shift
+                auto collect = [&](const Scalar* image_center, const Scalar* shift, Scalar group_radius, Scalar max_search_radius) {
+                    if(m_grid) {
+                        ForEachGridRun(image_center, image_center, Far(group_radius + Reach<SEARCH_MODE>(max_search_radius)), [&](unsigned int begin, unsigned int end) {
+                            candidate.emplace_back(begin, end);
+                        });
+                    }else {
+                        WalkTreeForGroup<SEARCH_MODE, PERIODIC>(image_center, group_radius, max_search_radius, boundary_length, candidate, Root());
+                    }
+                    image.push_back({candidate.size(), {}});
+                    for(unsigned int dim = 0;dim<DIM;++dim)
+                        image.back().second[dim] = shift[dim];
+                };
+                const int num_group = static_cast<int>(m_grid ? m_grid_begin.size() - 1 : m_leaf_cell.size());
+#pragma omp for schedule(dynamic, 16)
+                for(int g = 0;g<num_group;++g) {
+                    const unsigned int begin = m_grid ? m_grid_begin[g] : m_cell[m_leaf_cell[g]].body_begin;
+                    const unsigned int end   = m_grid ? m_grid_begin[g + 1] : begin + m_cell[m_leaf_cell[g]].body_count;
+                    if(begin == end)
+                        continue;
+                    Scalar center[DIM], group_radius, max_search_radius;
+                    GroupSphere(begin, end, center, group_radius, max_search_radius);
+
+                    candidate.clear();
+                    image.clear();
+                    if constexpr (PERIODIC) {
+                        //the grid is not periodic, so it is searched from the images of the group
+                        const Scalar zero[DIM] = {};
+                        if(m_grid)
+                            ForEachPeriodicImage(center, Far(group_radius + Reach<SEARCH_MODE>(max_search_radius)), boundary_length, [&](const Scalar* image_center, const Scalar* shift) {
+                                collect(image_center, shift, group_radius, max_search_radius);
+                            });
+                        else
+                            collect(center, zero, group_radius, max_search_radius);
+                    }else {
+                        ForEachImage(center, group_radius + Reach<SEARCH_MODE>(max_search_radius), [&](const Scalar* image_center, const Scalar* shift) {
+                            collect(image_center, shift, group_radius, max_search_radius);
+                        });
+                    }
+
+                    for(unsigned int k = begin;k<end;++k) {
+                        member(tid, k, [&](auto&& f) {
+                            std::size_t begin = 0;
+                            for(const auto& m : image) {
+                                Scalar position[DIM];
+                                for(unsigned int dim = 0;dim<DIM;++dim)
+                                    position[dim] = x[dim][k] - m.second[dim];
+                                for(std::size_t c = begin;c<m.first;++c) {
+                                    //grid images are shifted already, so they take the plain distance
+                                    if(m_grid)
+                                        Filter<SEARCH_MODE, false>(candidate[c].first, candidate[c].second, position, m_leaf_search_radius[k], nullptr, f);
+                                    else
+                                        Filter<SEARCH_MODE, PERIODIC>(candidate[c].first, candidate[c].second, position, m_leaf_search_radius[k], boundary_length, f);
+                                }
+                                begin = m.first;
+                            }
+                        });
+                    }
+                }
+            }
+        }
+
+        template <SearchMode SEARCH_MODE, bool PERIODIC>
+        void WalkGroup(const Scalar* boundary_length, std::vector<std::vector<unsigned int>>& interaction_list) const {
+            interaction_list.resize(m_size);
+            WalkGroup<SEARCH_MODE, PERIODIC>(boundary_length, [&](int, unsigned int k, auto&& for_each_neighbor) {
+                std::vector<unsigned int>& list = interaction_list[m_leaf_id[k]];
+                list.clear();
+                for_each_neighbor([&](unsigned int i) { list.emplace_back(m_leaf_id[i]); });
+            });
+        }
+
+        //Each thread appends its rows to its own buffer, then the rows are copied to their place in id order.
+        template <SearchMode SEARCH_MODE, bool PERIODIC>
+        void WalkGroup(const Scalar* boundary_length, CompressedNeighborList& interaction_list, bool half_list) const {
+            auto& buffer = interaction_list.m_buffer;
+            auto& row    = interaction_list.m_row;
+            auto& offset = interaction_list.offset;
+            buffer.resize(Detail::MaxThreads());
+            for(auto& b : buffer)
+                b.clear();
+            row.resize(m_size);
+            offset.assign(m_size + 1, 0);
+
+            WalkGroup<SEARCH_MODE, PERIODIC>(boundary_length, [&](int tid, unsigned int k, auto&& for_each_neighbor) {
+                const unsigned int id = m_leaf_id[k];
+                std::vector<unsigned int>& b = buffer[tid];
+                const std::size_t start = b.size();
+                for_each_neighbor([&](unsigned int i) {
+                    if(!half_list || m_leaf_id[i] > id)
+                        b.emplace_back(m_leaf_id[i]);
+                });
+                row[id] = {tid, start};
+                offset[id + 1] = b.size() - start;
+            });
+
+            for(int i = 0;i<m_size;++i)
+                offset[i + 1] += offset[i];
+            interaction_list.neighbor.resize(offset[m_size]);
+
+#pragma omp parallel for schedule(static)
+            for(int i = 0;i<m_size;++i)
+                std::copy(buffer[row[i].first].begin() + row[i].second, buffer[row[i].first].begin() + row[i].second + (offset[i + 1] - offset[i]),
+                          interaction_list.neighbor.begin() + offset[i]);
+        }
+
+        //collect [begin, end) ranges of leaf bodies that may interact with a body inside the sphere (center, group_radius)
+        template <SearchMode SEARCH_MODE, bool PERIODIC>
+        void WalkTreeForGroup(const Scalar* center, Scalar group_radius, Scalar max_search_radius, const Scalar* boundary_length,
+                              std::vector<std::pair<unsigned int, unsigned int>>& candidate, const Cell* p) const {
+            TREE_STATISTICS_COUNT(num_cell_visited, 1);
+            if(isLeaf(p)) {
+                if(!candidate.empty() && candidate.back().second == p->body_begin)
+                    candidate.back().second += p->body_count;
+                else
+                    candidate.emplace_back(p->body_begin, p->body_begin + p->body_count);
+                return;
+            }
+            for(const Cell* c = p+1;c != Next(p);c = Next(c)) {
+                bool near = isNear<PERIODIC>(center, group_radius + max_search_radius, boundary_length, c);
+                if constexpr (SEARCH_MODE == SearchMode::SYMMETRY)
+                    near = near || isNear<PERIODIC>(center, group_radius + c->max_search_radius, boundary_length, c);
+                if(near)
+                    WalkTreeForGroup<SEARCH_MODE, PERIODIC>(center, group_radius, max_search_radius, boundary_length, candidate, c);
+            }
+        }
+
+        //Calls pair(a, b) for every pair of cells that may hold SYMMETRY neighbors, where a == b stands for the pairs inside a leaf.
+        //Both are leaves unless their boxes are no wider than stop_size, which cuts the walk into independent pieces of work.
+        //With shift, the bodies of a are moved by -shift, i.e. a is paired with the image of b shifted by shift, and a == b is an ordinary pair.
+        template <bool PERIODIC, typename Function>
+        void WalkCellPair(const Cell* a, const Cell* b, const Scalar* boundary_length, const Scalar* shift, Scalar stop_size, Function& pair) const {
+            TREE_STATISTICS_COUNT(num_cell_visited, 1);
+            if(a->body_count == 0 || b->body_count == 0)
+                return;
+            if(a == b && shift == nullptr) {
+                if(isLeaf(a) || Width(a) <= stop_size) {
+                    pair(a, b);
+                    return;
+                }
+                for(const Cell* p = a+1;p != Next(a);p = Next(p))
+                    for(const Cell* q = p;q != Next(a);q = Next(q))
+                        WalkCellPair<PERIODIC>(p, q, boundary_length, shift, stop_size, pair);
+                return;
+            }
+
+            if(!isNearCell<PERIODIC>(a, b, std::max(a->max_search_radius, b->max_search_radius), boundary_length, shift))
+                return;
+            if((isLeaf(a) && isLeaf(b)) || (Width(a) <= stop_size && Width(b) <= stop_size)) {
+                pair(a, b);
+                return;
+            }
+            //open the larger cell
+            if(isLeaf(a) || (!isLeaf(b) && Width(b) > Width(a))) {
+                for(const Cell* q = b+1;q != Next(b);q = Next(q))
+                    WalkCellPair<PERIODIC>(a, q, boundary_length, shift, stop_size, pair);
+            }else {
+                for(const Cell* p = a+1;p != Next(a);p = Next(p))
+                    WalkCellPair<PERIODIC>(p, b, boundary_length, shift, stop_size, pair);
+            }
+        }
+
+        struct CellPair {
+            const Cell* a;
+            const Cell* b;
+            bool shifted;                  //pair of a with an image of b, see WalkCellPair
+            std::array<Scalar, DIM> shift;
+        };
+
+        //Cell pairs of a coarse level, about 16 cells per thread, in walk order. Each is an independent piece of WalkPair.
+        //Without boundary_length, the pairs across the walls of SetBoundary come from one of the two opposite images of the tree, so each is found once.
+        template <bool PERIODIC>
+        std::vector<CellPair> MakePairTask(const Scalar* boundary_length) const {
+            RequireTree();
+            TREE_STATISTICS_SCOPE;
+            std::vector<CellPair> task;
+            if(m_num_leaf_body == 0)
+                return task;
+            Scalar stop_size = Width(Root());
+            for(std::size_t n = 1;n < 16*std::size_t(Detail::MaxThreads()) && stop_size > 0;n *= NSUB)
+                stop_size /= 2;
+            const Scalar* image_shift = nullptr;
+            auto collect = [&](const Cell* a, const Cell* b) {
+                task.push_back({a, b, image_shift != nullptr, {}});
+                if(image_shift != nullptr)
+                    for(unsigned int dim = 0;dim<DIM;++dim)
+                        task.back().shift[dim] = image_shift[dim];
+            };
+            WalkCellPair<PERIODIC>(Root(), Root(), boundary_length, nullptr, stop_size, collect);
+            if constexpr (!PERIODIC) {
+                Scalar diagonal = 0;
+                for(unsigned int dim = 0;dim<DIM;++dim)
+                    diagonal += Root()->half[dim]*Root()->half[dim];
+                ForEachImage(Root()->position, std::sqrt(diagonal) + Root()->max_search_radius, [&](const Scalar*, const Scalar* shift) {
+                    if(isPositive(shift)) {
+                        image_shift = shift;
+                        WalkCellPair<false>(Root(), Root(), nullptr, shift, stop_size, collect);
+                    }
+                });
+            }
+            return task;
+        }
+
+        //largest width of the box of p
+        Scalar Width(const Cell* p) const {
+            Scalar width = 0;
+            for(unsigned int dim = 0;dim<DIM;++dim)
+                width = std::max(width, 2*p->half[dim]);
+            return width;
+        }
+
+        //Calls emit(t, i, j, r2, dx) for every pair of SYMMETRY neighbors under task[t] once, where i and j are particle ids.
+        //Tasks run in parallel. Concatenating the pairs of every task in task order gives the same order for any number of threads.
+        template <bool PERIODIC, typename Function>
+        void WalkPair(const Scalar* boundary_length, const std::vector<CellPair>& task, Function&& emit) const {
+            const auto x = LeafPosition();
+#pragma omp parallel
+            {
+                TREE_STATISTICS_SCOPE;
+                int t = 0;
+                const Scalar* shift = nullptr;
+                auto leaf_pair = [&](const Cell* a, const Cell* b) {
+                    for(unsigned int k = a->body_begin;k<a->body_begin + a->body_count;++k) {
+                        Scalar position[DIM];
+                        for(unsigned int dim = 0;dim<DIM;++dim)
+                            position[dim] = shift == nullptr ? x[dim][k] : x[dim][k] - shift[dim];
+                        const unsigned int begin = a == b && shift == nullptr ? k + 1 : b->body_begin;
+                        Filter<SearchMode::SYMMETRY, PERIODIC>(begin, b->body_begin + b->body_count, position, m_leaf_search_radius[k], boundary_length,
+                                                               [&](unsigned int i, Scalar r2, const Scalar* dx) { emit(t, m_leaf_id[k], m_leaf_id[i], r2, dx); });
+                    }
+                };
+#pragma omp for schedule(dynamic, 1)
+                for(int n = 0;n<static_cast<int>(task.size());++n) {
+                    t     = n;
+                    shift = task[n].shifted ? task[n].shift.data() : nullptr;
+                    WalkCellPair<PERIODIC>(task[n].a, task[n].b, boundary_length, shift, 0, leaf_pair);
+                }
+            }
+        }
+
+        template <bool PERIODIC>
+        void FindAllNeighborPair(const Scalar* boundary_length, std::vector<std::pair<unsigned int, unsigned int>>& pair_list) const {
+            const std::vector<CellPair> task = MakePairTask<PERIODIC>(boundary_length);
+            std::vector<std::vector<std::pair<unsigned int, unsigned int>>> task_pair(task.size());
+            WalkPair<PERIODIC>(boundary_length, task, [&](int t, unsigned int i, unsigned int j, Scalar, const Scalar*) {
+                task_pair[t].emplace_back(std::min(i, j), std::max(i, j));
+            });
+
+            std::vector<std::size_t> offset(task.size() + 1, 0);
+            for(std::size_t t = 0;t<task.size();++t)
+                offset[t + 1] = offset[t] + task_pair[t].size();
+            pair_list.resize(offset[task.size()]);
+#pragma omp parallel for schedule(static)
+            for(int t = 0;t<static_cast<int>(task.size());++t)
+                std::copy(task_pair[t].begin(), task_pair[t].end(), pair_list.begin() + offset[t]);
+        }
+
+        //true if cells a and b (a moved by -shift unless shift is null) may hold two bodies within radius. Bodies lie inside the box of their cell.
+        template <bool PERIODIC>
+        bool isNearCell(const Cell* a, const Cell* b, Scalar radius, const Scalar* boundary_length, const Scalar* shift) const {
+            for(unsigned int dim = 0;dim < DIM;++dim) {
+                const Scalar posA = shift == nullptr ? a->position[dim] : a->position[dim] - shift[dim];
+                const Scalar d = PERIODIC ? PeriodicDistance(posA, b->position[dim], boundary_length[dim]) : posA - b->position[dim];
+                if(std::abs(d) > Far(a->half[dim] + b->half[dim] + radius))
+                    return false;
+            }
+            return true;
+        }
+
+        //true if the whole box of p lies within radius of pos (its nearest image if PERIODIC),
+        //with a margin for the round-off of the body distances, so that every body in it is accepted by Detail::FilterBody
+        template <bool PERIODIC>
+        bool isInside(const Scalar* pos, Scalar radius, const Scalar* boundary_length, const Cell* p) const {
+            Scalar r2 = 0;
+            for(unsigned int dim = 0;dim < DIM;++dim) {
+                const Scalar d   = PERIODIC ? PeriodicDistance(pos[dim], p->position[dim], boundary_length[dim]) : pos[dim] - p->position[dim];
+                const Scalar far = Far(std::abs(d) + p->half[dim]);
+                r2 += far*far;
+            }
+            return r2 <= radius*radius*(1 - 8*std::numeric_limits<Scalar>::epsilon());
+        }
+
+        //length inflated by the round-off of the cell boxes and of the body distances, so that pruning at length never drops a body on the search radius
+        Scalar Far(Scalar length) const {
+            constexpr Scalar eps = std::numeric_limits<Scalar>::epsilon();
+            return length*(1 + 8*eps) + 8*eps*m_coordinate_scale;
+        }
+
+        template <bool PERIODIC>
+        bool isNear(const Scalar* pos, Scalar radius, const Scalar* boundary_length, const Cell* p) const {
+            if constexpr (PERIODIC)
+                return isNearTargetWithPeriodicBoundary(pos, radius, boundary_length, p);
+            else
+                return isNearTarget(pos, radius, p);
+        }
+
+        bool isNearTarget(const Scalar* pos, Scalar radius,const Cell* p) const {
+            Scalar dx;
+
+            for(unsigned int dim = 0;dim < DIM;++dim) {
+                dx = pos[dim] - p->position[dim];
+                if(std::abs(dx) > Far(p->half[dim] + radius))
+                    return false;
+            }
+
+            return true;
+        }
+
+        template <SearchMode SEARCH_MODE, typename Function>
+        void WalkTreeWithPeriodicBoundary(const Scalar* pos,const Scalar radius,const Scalar* boundary_length,Function& emit,const Cell* p) const {
+            const Cell* q;
+            TREE_STATISTICS_COUNT(num_cell_visited, 1);
+            if(isLeaf(p)) {
+                WalkLeaf<SEARCH_MODE, true>(pos,radius,boundary_length,emit,p);
+                return;
+            }
+            //search all of p's direct descendants
+            for(q = p+1;q != Next(p);q = Next(q)) {
+                if constexpr (SEARCH_MODE == SearchMode::GATHER) {
+                    if(isNearTargetWithPeriodicBoundary(pos,radius,boundary_length,q))
+                        WalkTreeWithPeriodicBoundary<SEARCH_MODE>(pos,radius,boundary_length,emit,q);
+                }else if constexpr (SEARCH_MODE == SearchMode::SYMMETRY) {
+                    if(isNearTargetWithPeriodicBoundary(pos,radius,boundary_length,q) || isNearTargetWithPeriodicBoundary(pos, q->max_search_radius, boundary_length, q))
+                        WalkTreeWithPeriodicBoundary<SEARCH_MODE>(pos,radius,boundary_length,emit,q);
+                }
+            }
+        }
+
+        static Scalar PeriodicDistance(Scalar x1, Scalar x2, Scalar boundary_length) {
+            Scalar X = x1-x2;
+            if(X>Scalar(0.5)*boundary_length){
+                X -= boundary_length;
+            } else if(X<-Scalar(0.5)*boundary_length){
+                X += boundary_length;
+            }
+            return X;
+        }
+
+        bool isNearTargetWithPeriodicBoundary(const Scalar* pos, Scalar radius,const Scalar* boundary_length,const Cell* p) const {
+            Scalar dx;
+
+            for(unsigned int dim = 0;dim < DIM;++dim) {
+                dx = PeriodicDistance(pos[dim],p->position[dim],boundary_length[dim]);
+                if(std::abs(dx) > Far(p->half[dim] + radius))
+                    return false;
+            }
+
+            return true;
+        }
+    };
+
+    //Neighbor lists of all particles cached between steps with a Verlet skin.
+    //Candidates are searched once with search_radius + skin, and every FindAllNeighborParticle filters them by the exact distance.
+    //The tree and the candidates are rebuilt only when 2*(largest displacement) + (largest growth of a search radius) exceeds the skin.
+    template <unsigned int DIM, typename Scalar = double>
+    class StaticVerletNeighborList {
+    public:
+        StaticVerletNeighborList(unsigned int reserve_number, Scalar skin, unsigned int leaf_capacity = 8):m_tree(reserve_number, leaf_capacity), m_skin(skin), m_position(DIM*std::size_t(reserve_number), 0), m_search_radius(reserve_number, 0) {
+            if(!(skin >= 0))
+                TREE_PRINT_ERROR(stdout, "skin must not be negative\n");
+        }
+
+        void Resize(int size) {
+            m_tree.Resize(size);
+            m_size  = size;
+            m_valid = false;
+        }
+
+        void CopyPos(Scalar pos_x, unsigned int id, unsigned int dim) {
+            if(id < static_cast<unsigned int>(m_size) && dim < DIM)
+                m_position[DIM*std::size_t(id) + dim] = pos_x;
+            else
+                TREE_PRINT_ERROR(stdout, "Acces to outside of memory\n");
+        }
+
+        void CopySearchRadius(Scalar search_radius, unsigned int id) {
+            if(id < static_cast<unsigned int>(m_size))
+                m_search_radius[id] = search_radius;
+            else
+                TREE_PRINT_ERROR(stdout, "Acces to outside of memory\n");
+        }
+
+        Scalar GetPos(unsigned int id, unsigned int dim) const {
+            if(id < static_cast<unsigned int>(m_size) && dim < DIM)
+                return m_position[DIM*std::size_t(id) + dim];
+            else
+                TREE_PRINT_ERROR(stdout, "Acces to outside of memory\n");
+        }
+
+        //same layout as StaticNeighborParticleSearchTree::CopyAllPos
+        void CopyAllPos(const Scalar* pos, std::size_t stride = DIM, std::size_t dim_stride = 1) {
+            if(pos == nullptr && m_size > 0)
+                TREE_PRINT_ERROR(stdout, "pos is null\n");
+            const Detail::StridedArray<Scalar> x{pos, stride, dim_stride};
+#pragma omp parallel for schedule(static)
+            for(int i = 0;i<m_size;++i)
+                for(unsigned int dim = 0;dim<DIM;++dim)
+                    m_position[DIM*std::size_t(i) + dim] = x(i, dim);
+        }
+
+        void CopyAllSearchRadius(const Scalar* search_radius, std::size_t stride = 1) {
+            if(search_radius == nullptr && m_size > 0)
+                TREE_PRINT_ERROR(stdout, "search_radius is null\n");
+            const Detail::StridedArray<Scalar> h{search_radius, stride, 0};
+#pragma omp parallel for schedule(static)
+            for(int i = 0;i<m_size;++i)
+                m_search_radius[i] = h(i);
+        }
+
+        Scalar Skin() const {
+            return m_skin;
+        }
+
+        //number of times the tree and the candidates were rebuilt
+        unsigned int NumRebuild() const {
+            return m_num_rebuild;
+        }
+
+        //Same lists as StaticNeighborParticleSearchTree::FindAllNeighborParticle for the current positions and search radii
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindAllNeighborParticle(std::vector<std::vector<unsigned int>>& interaction_list) {
+            TREE_PRINT_INFO("start\n");
+            Update<SEARCH_MODE, false>(nullptr);
+            FilterCandidate<SEARCH_MODE, false>(nullptr, interaction_list);
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindAllNeighborParticleWithPeriodicBoundary(const Scalar* boundary_length, std::vector<std::vector<unsigned int>>& interaction_list) {
+            TREE_PRINT_INFO("start\n");
+            Update<SEARCH_MODE, true>(boundary_length);
+            FilterCandidate<SEARCH_MODE, true>(boundary_length, interaction_list);
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindAllNeighborParticle(CompressedNeighborList& interaction_list, bool half_list = false) {
+            TREE_PRINT_INFO("start\n");
+            Update<SEARCH_MODE, false>(nullptr);
+            FilterCandidate<SEARCH_MODE, false>(nullptr, interaction_list, half_list);
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindAllNeighborParticleWithPeriodicBoundary(const Scalar* boundary_length, CompressedNeighborList& interaction_list, bool half_list = false) {
+            TREE_PRINT_INFO("start\n");
+            Update<SEARCH_MODE, true>(boundary_length);
+            FilterCandidate<SEARCH_MODE, true>(boundary_length, interaction_list, half_list);
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        //Calls f(i, j, r2, dx) for every neighbor j of every particle i, with dx = (position of i) - (position of j). Runs in parallel over i.
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER, typename Function>
+        void ForEachAllNeighborParticle(Function&& f) {
+            TREE_PRINT_INFO("start\n");
+            Update<SEARCH_MODE, false>(nullptr);
+            FilterCandidate<SEARCH_MODE, false>(nullptr, [&](unsigned int i, auto&& for_each_neighbor) {
+                for_each_neighbor([&](unsigned int j, Scalar r2, const Scalar* dx) { f(i, j, r2, dx); });
+            });
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER, typename Function>
+        void ForEachAllNeighborParticleWithPeriodicBoundary(const Scalar* boundary_length, Function&& f) {
+            TREE_PRINT_INFO("start\n");
+            Update<SEARCH_MODE, true>(boundary_length);
+            FilterCandidate<SEARCH_MODE, true>(boundary_length, [&](unsigned int i, auto&& for_each_neighbor) {
+                for_each_neighbor([&](unsigned int j, Scalar r2, const Scalar* dx) { f(i, j, r2, dx); });
+            });
+            TREE_PRINT_INFO("finish\n");
+        }
+
+    private:
+        StaticNeighborParticleSearchTree<DIM, Scalar> m_tree;
+        Scalar m_skin = 0;
+        int m_size = 0;
+        std::vector<Scalar> m_position;                            //pos[DIM*i + dim]
+        std::vector<Scalar> m_search_radius;
+        std::vector<Scalar> m_reference_position;                  //positions and search radii of the last rebuild
+        std::vector<Scalar> m_inflated_radius;                     //search radii + skin given to the tree
+        std::vector<Scalar> m_reference_radius;
+        CompressedNeighborList m_candidate;
+        std::vector<unsigned int> m_accepted;                      //accepted candidates at the place of their row in m_candidate
+        bool m_valid = false;
+        SearchMode m_search_mode = SearchMode::GATHER;             //query the candidates were made for
+        bool m_periodic = false;
+        std::array<Scalar, DIM> m_boundary_length{};
+        unsigned int m_num_rebuild = 0;
+
+        static Scalar Displacement(Scalar x1, Scalar x2, Scalar boundary_length, bool periodic) {
+            Scalar dx = x1 - x2;
+            if(periodic) {
+                if(dx > Scalar(0.5)*boundary_length)
+                    dx -= boundary_length;
+                else if(dx < -Scalar(0.5)*boundary_length)
+                    dx += boundary_length;
+            }
+            return dx;
+        }
+
+        //true if the candidates of the last rebuild still contain every neighbor
+        template <SearchMode SEARCH_MODE, bool PERIODIC>
+        bool isValid(const Scalar* boundary_length) const {
+            if(!m_valid || m_search_mode != SEARCH_MODE || m_periodic != PERIODIC)
+                return false;
+            if constexpr (PERIODIC)
+                for(unsigned int dim = 0;dim<DIM;++dim)
+                    if(m_boundary_length[dim] != boundary_length[dim])
+                        return false;
+
+            Scalar max_displacement2 = 0, max_growth = 0;
+#pragma omp parallel for schedule(static) reduction(max:max_displacement2, max_growth)
+            for(int i = 0;i<m_size;++i) {
+                Scalar length = 0;
+                for(unsigned int dim = 0;dim<DIM;++dim) {
+                    const Scalar dx = Displacement(m_position[DIM*std::size_t(i) + dim], m_reference_position[DIM*std::size_t(i) + dim], PERIODIC ? boundary_length[dim] : 0, PERIODIC);
+                    length += dx*dx;
+                }
+                max_displacement2 = std::max(max_displacement2, length);
+                max_growth        = std::max(max_growth, m_search_radius[i] - m_reference_radius[i]);
+            }
+            //a pair within the search radius now was within search_radius + skin at the last rebuild
+            return 2*std::sqrt(max_displacement2) + max_growth <= m_skin;
+        }
+
+        template <SearchMode SEARCH_MODE, bool PERIODIC>
+        void Update(const Scalar* boundary_length) {
+            if(isValid<SEARCH_MODE, PERIODIC>(boundary_length))
+                return;
+
+            m_inflated_radius.resize(m_size);
+            for(int i = 0;i<m_size;++i)
+                m_inflated_radius[i] = m_search_radius[i] + m_skin;
+            m_tree.UsePosBuffer(m_position.data());
+            m_tree.UseSearchRadiusBuffer(m_inflated_radius.data());
+            m_tree.template UpdateTree<BuildMode::REFIT>();
+            if constexpr (PERIODIC)
+                m_tree.template FindAllNeighborParticleWithPeriodicBoundary<SEARCH_MODE>(boundary_length, m_candidate);
+            else
+                m_tree.template FindAllNeighborParticle<SEARCH_MODE>(m_candidate);
+
+            m_reference_position.assign(m_position.begin(), m_position.begin() + DIM*std::size_t(m_size));
+            m_reference_radius.assign(m_search_radius.begin(), m_search_radius.begin() + m_size);
+            m_valid       = true;
+            m_search_mode = SEARCH_MODE;
+            m_periodic    = PERIODIC;
+            if constexpr (PERIODIC)
+                for(unsigned int dim = 0;dim<DIM;++dim)
+                    m_boundary_length[dim] = boundary_length[dim];
+            ++m_num_rebuild;
+        }
+
+        //Calls member(i, for_each_neighbor) for every particle i in parallel, where for_each_neighbor(f) calls f(j, r2, dx) for every neighbor j of i.
+        //Same arithmetic as Detail::FilterBody, so the result is the same as a search in the tree.
+        template <SearchMode SEARCH_MODE, bool PERIODIC, typename Function>
+        void FilterCandidate(const Scalar* boundary_length, Function&& member) const {
+#pragma omp parallel for schedule(dynamic, 64)
+            for(int i = 0;i<m_size;++i) {
+                const Scalar r2 = m_search_radius[i]*m_search_radius[i];
+                member(static_cast<unsigned int>(i), [&](auto&& f) {
+                    for(const unsigned int* j = m_candidate.begin(i);j != m_candidate.end(i);++j) {
+                        Scalar length = 0;
+                        Scalar dx[DIM];
+                        for(unsigned int dim = 0;dim<DIM;++dim) {
+                            dx[dim] = Displacement(m_position[DIM*std::size_t(i) + dim], m_position[DIM*std::size_t(*j) + dim], PERIODIC ? boundary_length[dim] : 0, PERIODIC);
+                            length += dx[dim] * dx[dim];
+                        }
+                        bool accept = length <= r2;
+                        if constexpr (SEARCH_MODE == SearchMode::SYMMETRY)
+                            accept = accept || length <= m_search_radius[*j]*m_search_radius[*j];
+                        if(accept)
+                            f(*j, length, static_cast<const Scalar*>(dx));
+                    }
+                });
+            }
+        }
+
+        template <SearchMode SEARCH_MODE, bool PERIODIC>
+        void FilterCandidate(const Scalar* boundary_length, std::vector<std::vector<unsigned int>>& interaction_list) const {
+            interaction_list.resize(m_size);
+            FilterCandidate<SEARCH_MODE, PERIODIC>(boundary_length, [&](unsigned int i, auto&& for_each_neighbor) {
+                interaction_list[i].clear();
+                for_each_neighbor([&](unsigned int j, Scalar, const Scalar*) { interaction_list[i].emplace_back(j); });
+            });
+        }
+
+        //Rows are first written at the place of the candidate rows, then compacted.
+        template <SearchMode SEARCH_MODE, bool PERIODIC>
+        void FilterCandidate(const Scalar* boundary_length, CompressedNeighborList& interaction_list, bool half_list) {
+            auto& offset = interaction_list.offset;
+            m_accepted.resize(m_candidate.neighbor.size());
+            offset.assign(m_size + 1, 0);
+            FilterCandidate<SEARCH_MODE, PERIODIC>(boundary_length, [&](unsigned int i, auto&& for_each_neighbor) {
+                unsigned int* row = m_accepted.data() + m_candidate.offset[i];
+                unsigned int n = 0;
+                for_each_neighbor([&](unsigned int j, Scalar, const Scalar*) {
+                    if(!half_list || j > i)
+                        row[n++] = j;
+                });
+                offset[i + 1] = n;
+            });
+
+            for(int i = 0;i<m_size;++i)
+                offset[i + 1] += offset[i];
+            interaction_list.neighbor.resize(offset[m_size]);
+
+#pragma omp parallel for schedule(static)
+            for(int i = 0;i<m_size;++i)
+                std::copy(m_accepted.begin() + m_candidate.offset[i], m_accepted.begin() + m_candidate.offset[i] + (offset[i + 1] - offset[i]),
+                          interaction_list.neighbor.begin() + offset[i]);
+        }
+    };
+
+    //Runtime-DIM front end. Dispatches every call to the StaticNeighborParticleSearchTree<DIM> chosen at construction.
+    class NeighborParticleSearchTree {
+    public:
+        NeighborParticleSearchTree(unsigned int _DIM, unsigned int reserve_number, unsigned int leaf_capacity = 8, Precision precision = Precision::FULL):m_tree(MakeTree(_DIM, reserve_number, leaf_capacity, precision)) {}
+
+        NeighborParticleSearchTree(const NeighborParticleSearchTree&) = delete;
+        NeighborParticleSearchTree& operator=(const NeighborParticleSearchTree&) = delete;
+        NeighborParticleSearchTree(NeighborParticleSearchTree&&) = default;
+
+        NeighborParticleSearchTree& operator=(NeighborParticleSearchTree&& o) noexcept {
+            if(&o != this)
+                m_tree = std::move(o.m_tree);
+            return *this;
+        }
+
+        unsigned int Dimension() const {
+            return static_cast<unsigned int>(m_tree.index()) + 1;
+        }
+
+        void Resize(int size) {
+            std::visit([&](auto& tree) { tree.Resize(size); }, m_tree);
+        }
+
+        void CopyPos(double pos_x, unsigned int id, unsigned int dim) {
+            std::visit([&](auto& tree) { tree.CopyPos(pos_x, id, dim); }, m_tree);
+        }
+
+        void CopySearchRadius(double search_radius, unsigned int id) {
+            std::visit([&](auto& tree) { tree.CopySearchRadius(search_radius, id); }, m_tree);
+        }
+
+        //pos[Dimension()*i + dim]
+        void CopyAllPos(const double* pos) {
+            CopyAllPos(pos, Dimension(), 1);
+        }
+
+        void CopyAllPos(const double* pos, std::size_t stride, std::size_t dim_stride) {
+            std::visit([&](auto& tree) { tree.CopyAllPos(pos, stride, dim_stride); }, m_tree);
+        }
+
+        void CopyAllSearchRadius(const double* search_radius, std::size_t stride = 1) {
+            std::visit([&](auto& tree) { tree.CopyAllSearchRadius(search_radius, stride); }, m_tree);
+        }
+
+        void UsePosBuffer(const double* pos) {
+            UsePosBuffer(pos, Dimension(), 1);
+        }
+
+        void UsePosBuffer(const double* pos, std::size_t stride, std::size_t dim_stride) {
+            std::visit([&](auto& tree) { tree.UsePosBuffer(pos, stride, dim_stride); }, m_tree);
+        }
+
+        void UseSearchRadiusBuffer(const double* search_radius, std::size_t stride = 1) {
+            std::visit([&](auto& tree) { tree.UseSearchRadiusBuffer(search_radius, stride); }, m_tree);
+        }
+
+        void SetNumWeight(unsigned int num_weight) {
+            std::visit([&](auto& tree) { tree.SetNumWeight(num_weight); }, m_tree);
+        }
+
+        unsigned int NumWeight() const {
+            return std::visit([&](const auto& tree) { return tree.NumWeight(); }, m_tree);
+        }
+
+        void CopyWeight(double weight, unsigned int id, unsigned int k = 0) {
+            std::visit([&](auto& tree) { tree.CopyWeight(weight, id, k); }, m_tree);
+        }
+
+        void CopyAllWeight(const double* weight, unsigned int k = 0, std::size_t stride = 1) {
+            std::visit([&](auto& tree) { tree.CopyAllWeight(weight, k, stride); }, m_tree);
+        }
+
+        double GetPos(unsigned int id, unsigned int dim) const {
+            return std::visit([&](const auto& tree) { return tree.GetPos(id, dim); }, m_tree);
+        }
+
+        unsigned int NumCell() const {
+            return std::visit([&](const auto& tree) { return tree.NumCell(); }, m_tree);
+        }
+
+        std::size_t MemoryFootprint() const {
+            return std::visit([&](const auto& tree) { return tree.MemoryFootprint(); }, m_tree);
+        }
+
+        void SetMaxMoverFraction(double fraction) {
+            std::visit([&](auto& tree) { tree.SetMaxMoverFraction(fraction); }, m_tree);
+        }
+
+        void SetBackend(Backend backend) {
+            std::visit([&](auto& tree) { tree.SetBackend(backend); }, m_tree);
+        }
+
+        Backend ActiveBackend() const {
+            return std::visit([&](const auto& tree) { return tree.ActiveBackend(); }, m_tree);
+        }
+
+        unsigned int NumMover() const {
+            return std::visit([&](const auto& tree) { return tree.NumMover(); }, m_tree);
+        }
+
+        const BuildStatistics& GetBuildStatistics() const {
+            return std::visit([&](const auto& tree) -> const BuildStatistics& { return tree.GetBuildStatistics(); }, m_tree);
+        }
+
+        TraversalStatistics GetTraversalStatistics() const {
+            return std::visit([&](const auto& tree) { return tree.GetTraversalStatistics(); }, m_tree);
+        }
+
+        void ResetTraversalStatistics() {
+            std::visit([&](auto& tree) { tree.ResetTraversalStatistics(); }, m_tree);
+        }
+
+        void TreeOrder(std::vector<unsigned int>& order) const {
+            std::visit([&](const auto& tree) { tree.TreeOrder(order); }, m_tree);
+        }
+
+        void TreeRank(std::vector<unsigned int>& rank) const {
+            std::visit([&](const auto& tree) { tree.TreeRank(rank); }, m_tree);
+        }
+
+        void RenumberParticle(const std::vector<unsigned int>& order) {
+            std::visit([&](auto& tree) { tree.RenumberParticle(order); }, m_tree);
+        }
+
+        void SetDomain(const double* lower, const double* upper) {
+            std::visit([&](auto& tree) { tree.SetDomain(lower, upper); }, m_tree);
+        }
+
+        void ClearDomain() {
+            std::visit([&](auto& tree) { tree.ClearDomain(); }, m_tree);
+        }
+
+        void SetTightCellBox(bool tight) {
+            std::visit([&](auto& tree) { tree.SetTightCellBox(tight); }, m_tree);
+        }
+
+        void SetBoundary(unsigned int dim, Boundary boundary) {
+            std::visit([&](auto& tree) { tree.SetBoundary(dim, boundary); }, m_tree);
+        }
+
+        void SetShear(unsigned int shift_dim, double shift) {
+            std::visit([&](auto& tree) { tree.SetShear(shift_dim, shift); }, m_tree);
+        }
+
+        template <BuildMode BUILD_MODE = BuildMode::INSERTION>
+        void UpdateTree() {
+            std::visit([&](auto& tree) { tree.template UpdateTree<BUILD_MODE>(); }, m_tree);
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindNeighborParticle(const double* pos, const double radius, std::vector<unsigned int>& interaction_list, bool clear = true) const {
+            std::visit([&](const auto& tree) { tree.template FindNeighborParticle<SEARCH_MODE>(pos, radius, interaction_list, clear); }, m_tree);
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindNeighborParticleWithPeriodicBoundary(const double* pos, const double radius, const double* boundary_length, std::vector<unsigned int>& interaction_list, bool clear = true) const {
+            std::visit([&](const auto& tree) { tree.template FindNeighborParticleWithPeriodicBoundary<SEARCH_MODE>(pos, radius, boundary_length, interaction_list, clear); }, m_tree);
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindNeighborParticle(const double* pos, const double* radius, unsigned int num_query, std::vector<std::vector<unsigned int>>& interaction_list) const {
+            std::visit([&](const auto& tree) { tree.template FindNeighborParticle<SEARCH_MODE>(pos, radius, num_query, interaction_list); }, m_tree);
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindNeighborParticleWithPeriodicBoundary(const double* pos, const double* radius, unsigned int num_query, const double* boundary_length, std::vector<std::vector<unsigned int>>& interaction_list) const {
+            std::visit([&](const auto& tree) { tree.template FindNeighborParticleWithPeriodicBoundary<SEARCH_MODE>(pos, radius, num_query, boundary_length, interaction_list); }, m_tree);
+        }
+
+        //dx has Dimension() entries
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER, typename Function>
+        void ForEachNeighborParticle(const double* pos, const double radius, Function&& f) const {
+            std::visit([&](const auto& tree) { tree.template ForEachNeighborParticle<SEARCH_MODE>(pos, radius, f); }, m_tree);
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER, typename Function>
+        void ForEachNeighborParticleWithPeriodicBoundary(const double* pos, const double radius, const double* boundary_length, Function&& f) const {
+            std::visit([&](const auto& tree) { tree.template ForEachNeighborParticleWithPeriodicBoundary<SEARCH_MODE>(pos, radius, boundary_length, f); }, m_tree);
+        }
+
+        //dx[dim] for dim >= Dimension() is 0
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindNeighborParticle(const double* pos, const double radius, std::vector<NeighborParticle<3>>& interaction_list, bool clear = true) const {
+            if(clear)
+                interaction_list.clear();
+            ForEachNeighborParticle<SEARCH_MODE>(pos, radius, [&](unsigned int id, double r2, const double* dx) { interaction_list.emplace_back(MakeNeighborParticle(id, r2, dx)); });
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindNeighborParticleWithPeriodicBoundary(const double* pos, const double radius, const double* boundary_length, std::vector<NeighborParticle<3>>& interaction_list, bool clear = true) const {
+            if(clear)
+                interaction_list.clear();
+            ForEachNeighborParticleWithPeriodicBoundary<SEARCH_MODE>(pos, radius, boundary_length, [&](unsigned int id, double r2, const double* dx) { interaction_list.emplace_back(MakeNeighborParticle(id, r2, dx)); });
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        unsigned int CountNeighborParticle(const double* pos, const double radius) const {
+            return std::visit([&](const auto& tree) { return tree.template CountNeighborParticle<SEARCH_MODE>(pos, radius); }, m_tree);
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        unsigned int CountNeighborParticleWithPeriodicBoundary(const double* pos, const double radius, const double* boundary_length) const {
+            return std::visit([&](const auto& tree) { return tree.template CountNeighborParticleWithPeriodicBoundary<SEARCH_MODE>(pos, radius, boundary_length); }, m_tree);
+        }
+
+        //sum has NumWeight() entries
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        unsigned int SumNeighborWeight(const double* pos, const double radius, double* sum) const {
+            return std::visit([&](const auto& tree) { return tree.template SumNeighborWeight<SEARCH_MODE>(pos, radius, sum); }, m_tree);
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        unsigned int SumNeighborWeightWithPeriodicBoundary(const double* pos, const double radius, const double* boundary_length, double* sum) const {
+            return std::visit([&](const auto& tree) { return tree.template SumNeighborWeightWithPeriodicBoundary<SEARCH_MODE>(pos, radius, boundary_length, sum); }, m_tree);
+        }
+
+        void FindNearestNeighborParticle(const double* pos, unsigned int num_neighbor, std::vector<NeighborParticle<3>>& neighbor) const {
+            neighbor.clear();
+            std::visit([&](const auto& tree) {
+                auto nearest = MakeNearestBuffer(tree);
+                tree.FindNearestNeighborParticle(pos, num_neighbor, nearest);
+                for(const auto& n : nearest)
+                    neighbor.emplace_back(MakeNeighborParticle(n.id, n.r2, n.dx.data()));
+            }, m_tree);
+        }
+
+        void FindNearestNeighborParticleWithPeriodicBoundary(const double* pos, unsigned int num_neighbor, const double* boundary_length, std::vector<NeighborParticle<3>>& neighbor) const {
+            neighbor.clear();
+            std::visit([&](const auto& tree) {
+                auto nearest = MakeNearestBuffer(tree);
+                tree.FindNearestNeighborParticleWithPeriodicBoundary(pos, num_neighbor, boundary_length, nearest);
+                for(const auto& n : nearest)
+                    neighbor.emplace_back(MakeNeighborParticle(n.id, n.r2, n.dx.data()));
+            }, m_tree);
+        }
+
+        void SolveSearchRadius(unsigned int num_neighbor, unsigned int tolerance, double* search_radius) const {
+            std::visit([&](const auto& tree) { tree.SolveSearchRadius(num_neighbor, tolerance, search_radius); }, m_tree);
+        }
+
+        void SolveSearchRadiusWithPeriodicBoundary(unsigned int num_neighbor, unsigned int tolerance, const double* boundary_length, double* search_radius) const {
+            std::visit([&](const auto& tree) { tree.SolveSearchRadiusWithPeriodicBoundary(num_neighbor, tolerance, boundary_length, search_radius); }, m_tree);
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindAllNeighborParticle(std::vector<std::vector<unsigned int>>& interaction_list) const {
+            std::visit([&](const auto& tree) { tree.template FindAllNeighborParticle<SEARCH_MODE>(interaction_list); }, m_tree);
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindAllNeighborParticleWithPeriodicBoundary(const double* boundary_length, std::vector<std::vector<unsigned int>>& interaction_list) const {
+            std::visit([&](const auto& tree) { tree.template FindAllNeighborParticleWithPeriodicBoundary<SEARCH_MODE>(boundary_length, interaction_list); }, m_tree);
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindAllNeighborParticle(CompressedNeighborList& interaction_list, bool half_list = false) const {
+            std::visit([&](const auto& tree) { tree.template FindAllNeighborParticle<SEARCH_MODE>(interaction_list, half_list); }, m_tree);
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindAllNeighborParticleWithPeriodicBoundary(const double* boundary_length, CompressedNeighborList& interaction_list, bool half_list = false) const {
+            std::visit([&](const auto& tree) { tree.template FindAllNeighborParticleWithPeriodicBoundary<SEARCH_MODE>(boundary_length, interaction_list, half_list); }, m_tree);
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER, typename Function>
+        void ForEachAllNeighborParticle(Function&& f) const {
+            std::visit([&](const auto& tree) { tree.template ForEachAllNeighborParticle<SEARCH_MODE>(f); }, m_tree);
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER, typename Function>
+        void ForEachAllNeighborParticleWithPeriodicBoundary(const double* boundary_length, Function&& f) const {
+            std::visit([&](const auto& tree) { tree.template ForEachAllNeighborParticleWithPeriodicBoundary<SEARCH_MODE>(boundary_length, f); }, m_tree);
+        }
+
+        template <typename Function>
+        void ForEachNeighborPair(Function&& f) const {
+            std::visit([&](const auto& tree) { tree.ForEachNeighborPair(f); }, m_tree);
+        }
+
+        template <typename Function>
+        void ForEachNeighborPairWithPeriodicBoundary(const double* boundary_length, Function&& f) const {
+            std::visit([&](const auto& tree) { tree.ForEachNeighborPairWithPeriodicBoundary(boundary_length, f); }, m_tree);
+        }
+
+        void FindAllNeighborPair(std::vector<std::pair<unsigned int, unsigned int>>& pair_list) const {
+            std::visit([&](const auto& tree) { tree.FindAllNeighborPair(pair_list); }, m_tree);
+        }
+
+        void FindAllNeighborPairWithPeriodicBoundary(const double* boundary_length, std::vector<std::pair<unsigned int, unsigned int>>& pair_list) const {
+            std::visit([&](const auto& tree) { tree.FindAllNeighborPairWithPeriodicBoundary(boundary_length, pair_list); }, m_tree);
+        }
+
+    private:
+        using TreeVariant = std::variant<StaticNeighborParticleSearchTree<1>, StaticNeighborParticleSearchTree<2>, StaticNeighborParticleSearchTree<3>>;
+
+        TreeVariant m_tree;
+
+        template <unsigned int DIM>
+        static std::vector<NeighborParticle<DIM>> MakeNearestBuffer(const StaticNeighborParticleSearchTree<DIM>&) {
+            return {};
+        }
+
+        NeighborParticle<3> MakeNeighborParticle(unsigned int id, double r2, const double* dx) const {
+            NeighborParticle<3> neighbor{id, r2, {0, 0, 0}};
+            for(unsigned int dim = 0;dim<Dimension();++dim)
+                neighbor.dx[dim] = dx[dim];
+            return neighbor;
+        }
+
+        static TreeVariant MakeTree(unsigned int DIM, unsigned int reserve_number, unsigned int leaf_capacity, Precision precision) {
+            switch(DIM) {
+                case 1: return TreeVariant(std::in_place_index<0>, reserve_number, leaf_capacity, precision);
+                case 2: return TreeVariant(std::in_place_index<1>, reserve_number, leaf_capacity, precision);
+                case 3: return TreeVariant(std::in_place_index<2>, reserve_number, leaf_capacity, precision);
+                default: TREE_PRINT_ERROR(stdout, "DIM must be 1, 2 or 3\n");
+            }
+        }
+    };
+
+    //Runtime-DIM front end of StaticVerletNeighborList
+    class VerletNeighborList {
+    public:
+        VerletNeighborList(unsigned int _DIM, unsigned int reserve_number, double skin, unsigned int leaf_capacity = 8):m_list(MakeList(_DIM, reserve_number, skin, leaf_capacity)) {}
+
+        unsigned int Dimension() const {
+            return static_cast<unsigned int>(m_list.index()) + 1;
+        }
+
+        void Resize(int size) {
+            std::visit([&](auto& list) { list.Resize(size); }, m_list);
+        }
+
+        void CopyPos(double pos_x, unsigned int id, unsigned int dim) {
+            std::visit([&](auto& list) { list.CopyPos(pos_x, id, dim); }, m_list);
+        }
+
+        void CopySearchRadius(double search_radius, unsigned int id) {
+            std::visit([&](auto& list) { list.CopySearchRadius(search_radius, id); }, m_list);
+        }
+
+        //pos[Dimension()*i + dim]
+        void CopyAllPos(const double* pos) {
+            CopyAllPos(pos, Dimension(), 1);
+        }
+
+        void CopyAllPos(const double* pos, std::size_t stride, std::size_t dim_stride) {
+            std::visit([&](auto& list) { list.CopyAllPos(pos, stride, dim_stride); }, m_list);
+        }
+
+        void CopyAllSearchRadius(const double* search_radius, std::size_t stride = 1) {
+            std::visit([&](auto& list) { list.CopyAllSearchRadius(search_radius, stride); }, m_list);
+        }
+
+        double GetPos(unsigned int id, unsigned int dim) const {
+            return std::visit([&](const auto& list) { return list.GetPos(id, dim); }, m_list);
+        }
+
+        double Skin() const {
+            return std::visit([&](const auto& list) { return list.Skin(); }, m_list);
+        }
+
+        unsigned int NumRebuild() const {
+            return std::visit([&](const auto& list) { return list.NumRebuild(); }, m_list);
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindAllNeighborParticle(std::vector<std::vector<unsigned int>>& interaction_list) {
+            std::visit([&](auto& list) { list.template FindAllNeighborParticle<SEARCH_MODE>(interaction_list); }, m_list);
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindAllNeighborParticleWithPeriodicBoundary(const double* boundary_length, std::vector<std::vector<unsigned int>>& interaction_list) {
+            std::visit([&](auto& list) { list.template FindAllNeighborParticleWithPeriodicBoundary<SEARCH_MODE>(boundary_length, interaction_list); }, m_list);
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindAllNeighborParticle(CompressedNeighborList& interaction_list, bool half_list = false) {
+            std::visit([&](auto& list) { list.template FindAllNeighborParticle<SEARCH_MODE>(interaction_list, half_list); }, m_list);
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindAllNeighborParticleWithPeriodicBoundary(const double* boundary_length, CompressedNeighborList& interaction_list, bool half_list = false) {
+            std::visit([&](auto& list) { list.template FindAllNeighborParticleWithPeriodicBoundary<SEARCH_MODE>(boundary_length, interaction_list, half_list); }, m_list);
+        }
+
+        //dx has Dimension() entries
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER, typename Function>
+        void ForEachAllNeighborParticle(Function&& f) {
+            std::visit([&](auto& list) { list.template ForEachAllNeighborParticle<SEARCH_MODE>(f); }, m_list);
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER, typename Function>
+        void ForEachAllNeighborParticleWithPeriodicBoundary(const double* boundary_length, Function&& f) {
+            std::visit([&](auto& list) { list.template ForEachAllNeighborParticleWithPeriodicBoundary<SEARCH_MODE>(boundary_length, f); }, m_list);
+        }
+
+    private:
+        using ListVariant = std::variant<StaticVerletNeighborList<1>, StaticVerletNeighborList<2>, StaticVerletNeighborList<3>>;
+
+        ListVariant m_list;
+
+        static ListVariant MakeList(unsigned int DIM, unsigned int reserve_number, double skin, unsigned int leaf_capacity) {
+            switch(DIM) {
+                case 1: return ListVariant(std::in_place_index<0>, reserve_number, skin, leaf_capacity);
+                case 2: return ListVariant(std::in_place_index<1>, reserve_number, skin, leaf_capacity);
+                case 3: return ListVariant(std::in_place_index<2>, reserve_number, skin, leaf_capacity);
+                default: TREE_PRINT_ERROR(stdout, "DIM must be 1, 2 or 3\n");
+            }
+        }
+    };
+
+    //Two trees of type TreeType (StaticNeighborParticleSearchTree or NeighborParticleSearchTree). Queries run on the front tree while the back tree is
+    //rebuilt from a snapshot of positions on a background thread, and SwapTree makes the new tree the front one.
+    //Positions, search radii and weights are copied into the back tree for every build. Resize, SetNumWeight and Configure stick to both trees.
+    //Only one thread drives the buffer (the setters, StartUpdateTree and SwapTree). Any number of threads may query Front() at the same time.
+    template <typename TreeType>
+    class DoubleBufferedTree {
+    public:
+        //arguments of the constructor of TreeType, for both trees
+        template <typename... Args>
+        explicit DoubleBufferedTree(const Args&... args):m_tree{std::make_shared<TreeType>(args...), std::make_shared<TreeType>(args...)} {
+            //an empty tree is a valid front before the first SwapTree
+            m_tree[0]->UpdateTree();
+            m_tree[1]->UpdateTree();
+        }
+
+        DoubleBufferedTree(const DoubleBufferedTree&) = delete;
+        DoubleBufferedTree& operator=(const DoubleBufferedTree&) = delete;
+
+        ~DoubleBufferedTree() {
+            if(m_builder.joinable())
+                m_builder.join();
+        }
+
+        //The current tree. Keep the pointer while querying. The first setter call after SwapTree writes to this tree,
+        //so it waits until every pointer to it taken before SwapTree (and their copies) is dropped.
+        std::shared_ptr<const TreeType> Front() const {
+            while(true) {
+                const int front = m_front.load();
+                m_hold->count[front].fetch_add(1);
+                //a SwapTree in between may have missed the count, so take the new front instead
+                if(m_front.load() == front)
+                    return std::shared_ptr<const TreeType>(m_tree[front].get(), Release{m_tree[front], m_hold, front});
+                Release{m_tree[front], m_hold, front}(nullptr);
+            }
+        }
+
+        //Calls f(tree) on the back tree now and on the other tree before it is written next time, e.g. f = [=](auto& tree) { tree.SetDomain(...); }.
+        //f is kept, so capture by value.
+        template <typename Function>
+        void Configure(Function f) {
+            f(Back());
+            m_pending[1 - m_back].emplace_back(std::move(f));
+        }
+
+        void Resize(int size) {
+            Configure([size](TreeType& tree) { tree.Resize(size); });
+        }
+
+        void SetNumWeight(unsigned int num_weight) {
+            Configure([num_weight](TreeType& tree) { tree.SetNumWeight(num_weight); });
+        }
+
+        template <typename... Args>
+        void CopyPos(const Args&... args) {
+            Back().CopyPos(args...);
+        }
+
+        template <typename... Args>
+        void CopySearchRadius(const Args&... args) {
+            Back().CopySearchRadius(args...);
+        }
+
+        template <typename... Args>
+        void CopyAllPos(const Args&... args) {
+            Back().CopyAllPos(args...);
+        }
+
+        template <typename... Args>
+        void CopyAllSearchRadius(const Args&... args) {
+            Back().CopyAllSearchRadius(args...);
+        }
+
+        template <typename... Args>
+        void CopyWeight(const Args&... args) {
+            Back().CopyWeight(args...);
+        }
+
+        template <typename... Args>
+        void CopyAllWeight(const Args&... args) {
+            Back().CopyAllWeight(args...);
+        }
+
+        //Build the back tree from the values copied so far on a background thread. The setters must not be called until SwapTree.
+        template <BuildMode BUILD_MODE = BuildMode::INSERTION>
+        void StartUpdateTree() {
+            TreeType& tree = Back();
+            m_finished = false;
+            m_building = true;
+            m_builder  = std::thread([this, &tree]() {
+                tree.template UpdateTree<BUILD_MODE>();
+                m_finished = true;
+            });
+        }
+
+        //true if no build is running, i.e. SwapTree will not wait
+        bool isUpdateFinished() const {
+            return !m_building || m_finished;
+        }
+
+        //Wait for the build of StartUpdateTree and publish the new tree. Queries holding the old front keep it until they drop it.
+        void SwapTree() {
+            if(!m_building)
+                TREE_PRINT_ERROR(stdout, "StartUpdateTree was not called\n");
+            m_builder.join();
+            m_building = false;
+            m_front.store(m_back);
+            m_back       = 1 - m_back;
+            m_back_ready = false;
+        }
+
+        //true if the back tree can be written without waiting, i.e. no pointer from Front() before SwapTree is held any more
+        bool isBackFree() const {
+            return !m_building && (m_back_ready || m_hold->count[m_back].load() == 0);
+        }
+
+    private:
+        //number of Front() pointers held on each tree. Shared with the pointers, which may outlive the buffer.
+        struct HoldCount {
+            std::atomic<int> count[2] = {0, 0};
+            std::mutex mutex;
+            std::condition_variable released;
+        };
+
+        //deleter of the pointers of Front(), which also keep the tree alive
+        struct Release {
+            std::shared_ptr<TreeType> tree;
+            std::shared_ptr<HoldCount> hold;
+            int index;
+
+            void operator()(const TreeType*) const {
+                if(hold->count[index].fetch_sub(1) == 1) {
+                    std::lock_guard<std::mutex> lock(hold->mutex);
+                    hold->released.notify_all();
+                }
+            }
+        };
+
+        std::shared_ptr<TreeType> m_tree[2];
+        std::shared_ptr<HoldCount> m_hold = std::make_shared<HoldCount>();
+        std::atomic<int> m_front{0};                                   //index of the tree of Front()
+        int m_back = 1;
+        bool m_back_ready = false;                                     //no query holds the back tree and m_pending of it is applied
+        std::vector<std::function<void(TreeType&)>> m_pending[2];      //Configure calls not applied to each tree yet
+        std::thread m_builder;
+        bool m_building = false;
+        std::atomic<bool> m_finished{true};
+
+        //the back tree. Its first use after SwapTree waits for the queries still holding it and applies the pending Configure calls.
+        TreeType& Back() {
+            if(m_building)
+                TREE_PRINT_ERROR(stdout, "The back tree is being built, call SwapTree first\n");
+            if(!m_back_ready) {
+                {
+                    std::unique_lock<std::mutex> lock(m_hold->mutex);
+                    m_hold->released.wait(lock, [&]() { return m_hold->count[m_back].load() == 0; });
+                }
+                for(auto& f : m_pending[m_back])
+                    f(*m_tree[m_back]);
+                m_pending[m_back].clear();
+                m_back_ready = true;
+            }
+            return *m_tree[m_back];
+        }
+    };
+
+    //Transport of DistributedNeighborParticleSearchTree whose ranks are threads of one process, e.g. to run a decomposition on one machine.
+    //A transport provides Rank(), NumRank() and AllToAll(send, recv), where every rank passes one buffer per rank and recv[r] gets the send[Rank()] of rank r.
+    //Every rank calls AllToAll the same number of times, as a collective operation of MPI.
+    class ThreadTransport {
+    public:
+        //mailboxes of num_rank ranks, which must outlive their transports
+        class Group {
+        public:
+            explicit Group(int num_rank):m_num_rank(num_rank), m_mailbox(static_cast<std::size_t>(num_rank)*num_rank) {
+                if(num_rank <= 0)
+                    TREE_PRINT_ERROR(stdout, "A group needs at least one rank\n");
+            }
+
+            Group(const Group&) = delete;
+            Group& operator=(const Group&) = delete;
+
+        private:
+            friend class ThreadTransport;
+            int m_num_rank;
+            std::vector<std::vector<unsigned char>> m_mailbox; //m_mailbox[m_num_rank*src + dst]
+            std::mutex m_mutex;
+            std::condition_variable m_arrival;
+            int m_num_arrived = 0;
+            std::uint64_t m_generation = 0;
+        };
+
+        ThreadTransport(Group& group, int rank):m_group(&group), m_rank(rank) {
+            if(rank < 0 || rank >= group.m_num_rank)
+                TREE_PRINT_ERROR(stdout, "Rank %d is outside the group of %d ranks\n", rank, group.m_num_rank);
+        }
+
+        int Rank() const {
+            return m_rank;
+        }
+
+        int NumRank() const {
+            return m_group->m_num_rank;
+        }
+
+        template <typename T>
+        void AllToAll(const std::vector<std::vector<T>>& send, std::vector<std::vector<T>>& recv) {
+            static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+            const std::size_t num_rank = NumRank();
+            if(send.size() != num_rank)
+                TREE_PRINT_ERROR(stdout, "%zu send buffers for %zu ranks\n", send.size(), num_rank);
+            for(std::size_t r = 0;r<num_rank;++r) {
+                const unsigned char* data = reinterpret_cast<const unsigned char*>(send[r].data());
+                m_group->m_mailbox[num_rank*m_rank + r].assign(data, data + send[r].size()*sizeof(T));
+            }
+            Barrier();
+            recv.resize(num_rank);
+            for(std::size_t r = 0;r<num_rank;++r) {
+                const std::vector<unsigned char>& mailbox = m_group->m_mailbox[num_rank*r + m_rank];
+                recv[r].resize(mailbox.size()/sizeof(T));
+                if(!mailbox.empty())
+                    std::memcpy(static_cast<void*>(recv[r].data()), mailbox.data(), mailbox.size());
+            }
+            Barrier(); //nobody writes the mailboxes of the next call before everyone has read this one
+        }
+
+    private:
+        Group* m_group;
+        int m_rank;
+
+        void Barrier() {
+            std::unique_lock<std::mutex> lock(m_group->m_mutex);
+            const std::uint64_t generation = m_group->m_generation;
+            if(++m_group->m_num_arrived == m_group->m_num_rank) {
+                m_group->m_num_arrived = 0;
+                ++m_group->m_generation;
+                m_group->m_arrival.notify_all();
+            }
+            else
+                m_group->m_arrival.wait(lock, [&]() { return m_group->m_generation != generation; });
+        }
+    };
+
+#ifdef TREE_MPI
+    //Transport of DistributedNeighborParticleSearchTree over the ranks of an MPI communicator.
+    //Byte counts are int as in MPI_Alltoallv, so a rank sends and receives less than 2 GiB per call.
+    class MPITransport {
+    public:
+        explicit MPITransport(MPI_Comm comm = MPI_COMM_WORLD):m_comm(comm) {
+            MPI_Comm_rank(comm, &m_rank);
+            MPI_Comm_size(comm, &m_num_rank);
+        }
+
+        int Rank() const {
+            return m_rank;
+        }
+
+        int NumRank() const {
+            return m_num_rank;
+        }
+
+        template <typename T>
+        void AllToAll(const std::vector<std::vector<T>>& send, std::vector<std::vector<T>>& recv) {
+            static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+            if(send.size() != static_cast<std::size_t>(m_num_rank))
+                TREE_PRINT_ERROR(stdout, "%zu send buffers for %d ranks\n", send.size(), m_num_rank);
+            std::vector<int> send_count(m_num_rank), recv_count(m_num_rank), send_offset(m_num_rank+1, 0), recv_offset(m_num_rank+1, 0);
+            for(int r = 0;r<m_num_rank;++r) {
+                send_count[r]    = static_cast<int>(send[r].size()*sizeof(T));
+                send_offset[r+1] = send_offset[r] + send_count[r];
+            }
+            MPI_Alltoall(send_count.data(), 1, MPI_INT, recv_count.data(), 1, MPI_INT, m_comm);
+            for(int r = 0;r<m_num_rank;++r)
+                recv_offset[r+1] = recv_offset[r] + recv_count[r];
+
+            std::vector<unsigned char> send_buffer(send_offset[m_num_rank]), recv_buffer(recv_offset[m_num_rank]);
+            for(int r = 0;r<m_num_rank;++r)
+                if(send_count[r] > 0)
+                    std::memcpy(send_buffer.data() + send_offset[r], send[r].data(), send_count[r]);
+            MPI_Alltoallv(send_buffer.data(), send_count.data(), send_offset.data(), MPI_BYTE, recv_buffer.data(), recv_count.data(), recv_offset.data(), MPI_BYTE, m_comm);
+            recv.resize(m_num_rank);
+            for(int r = 0;r<m_num_rank;++r) {
+                recv[r].resize(recv_count[r]/sizeof(T));
+                if(recv_count[r] > 0)
+                    std::memcpy(static_cast<void*>(recv[r].data()), recv_buffer.data() + recv_offset[r], recv_count[r]);
+            }
+        }
+
+    private:
+        MPI_Comm m_comm;
+        int m_rank, m_num_rank;
+    };
+#endif
+
+    //One rank of a particle set distributed over the ranks of Transport (ThreadTransport, MPITransport or any class with the same three functions).
+    //UpdateTree gives every rank a segment of the Morton curve over the global domain holding about the same number of particles,
+    //and copies to it as ghosts the particles of other ranks that its GATHER and SYMMETRY queries may find. Each rank then queries its own tree of
+    //local particles (ids 0 to NumLocal()-1) and ghosts (ids NumLocal() to NumLocal()+NumGhost()-1).
+    template <unsigned int DIM, typename Scalar = double, typename Transport = ThreadTransport>
+    class DistributedNeighborParticleSearchTree {
+        static_assert(DIM >= 1 && DIM <= 3, "DIM must be 1, 2 or 3");
+
+    public:
+        //reserve_number, leaf_capacity and precision of the local tree, which grows when local and ghost particles exceed reserve_number
+        explicit DistributedNeighborParticleSearchTree(Transport transport, unsigned int reserve_number = 0, unsigned int leaf_capacity = 8, Precision precision = Precision::FULL)
+            :m_transport(std::move(transport)), m_reserve_num(reserve_number), m_leaf_capacity(leaf_capacity), m_precision(precision), m_tree(reserve_number, leaf_capacity, precision) {
+            for(unsigned int dim = 0;dim<DIM;++dim)
+                m_boundary[dim] = Boundary::OPEN;
+        }
+
+        DistributedNeighborParticleSearchTree(const DistributedNeighborParticleSearchTree&) = delete;
+        DistributedNeighborParticleSearchTree& operator=(const DistributedNeighborParticleSearchTree&) = delete;
+
+        //Number of input particles of this rank for the next UpdateTree, e.g. its share of the initial conditions, or the NumLocal() particles of the last one.
+        void Resize(int size) {
+            if(size < 0)
+                TREE_PRINT_ERROR(stdout, "Size is negative\n");
+            m_input_size = size;
+            m_input_pos.resize(DIM*std::size_t(size));
+            m_input_search_radius.resize(size);
+        }
+
+        void CopyPos(Scalar pos_x, unsigned int id, unsigned int dim) {
+            if(id < static_cast<unsigned int>(m_input_size) && dim < DIM)
+                m_input_pos[DIM*std::size_t(id) + dim] = pos_x;
+            else
+                TREE_PRINT_ERROR(stdout, "Acces to outside of memory\n");
+        }
+
+        void CopySearchRadius(Scalar search_radius, unsigned int id) {
+            if(id < static_cast<unsigned int>(m_input_size))
+                m_input_search_radius[id] = search_radius;
+            else
+                TREE_PRINT_ERROR(stdout, "Acces to outside of memory\n");
+        }
+
+        //same layouts as StaticNeighborParticleSearchTree::CopyAllPos and CopyAllSearchRadius
+        void CopyAllPos(const Scalar* pos, std::size_t stride = DIM, std::size_t dim_stride = 1) {
+            if(pos == nullptr && m_input_size > 0)
+                TREE_PRINT_ERROR(stdout, "pos is null\n");
+            const Detail::StridedArray<Scalar> x{pos, stride, dim_stride};
+            for(int i = 0;i<m_input_size;++i)
+                for(unsigned int dim = 0;dim<DIM;++dim)
+                    m_input_pos[DIM*std::size_t(i) + dim] = x(i, dim);
+        }
+
+        void CopyAllSearchRadius(const Scalar* search_radius, std::size_t stride = 1) {
+            if(search_radius == nullptr && m_input_size > 0)
+                TREE_PRINT_ERROR(stdout, "search_radius is null\n");
+            const Detail::StridedArray<Scalar> h{search_radius, stride, 0};
+            for(int i = 0;i<m_input_size;++i)
+                m_input_search_radius[i] = h(i);
+        }
+
+        //Global domain [lower, upper], the same on every rank. Needed by PERIODIC axes, otherwise the box of all particles is used.
+        void SetDomain(const Scalar* lower, const Scalar* upper) {
+            for(unsigned int dim = 0;dim<DIM;++dim) {
+                if(!(lower[dim] < upper[dim]))
+                    TREE_PRINT_ERROR(stdout, "Domain is empty\n");
+                m_domain_lower[dim] = lower[dim];
+                m_domain_upper[dim] = upper[dim];
+            }
+            m_has_domain = true;
+        }
+
+        void ClearDomain() {
+            m_has_domain = false;
+        }
+
+        //OPEN or PERIODIC, the same on every rank. Ghosts are exported across periodic walls, and the local tree looks at the images itself.
+        void SetBoundary(unsigned int dim, Boundary boundary) {
+            if(dim >= DIM)
+                TREE_PRINT_ERROR(stdout, "Acces to outside of memory\n");
+            if(boundary == Boundary::SHEAR)
+                TREE_PRINT_ERROR(stdout, "SHEAR is not supported by the distributed tree\n");
+            m_boundary[dim] = boundary;
+        }
+
+        //Collective. Moves the input particles to their new ranks, exchanges the ghosts and builds the local tree.
+        //The input particle i of a rank becomes a local particle of some rank, see Migrate to move other data of the particles along.
+        template <BuildMode BUILD_MODE = BuildMode::INSERTION>
+        void UpdateTree() {
+            TREE_PRINT_INFO("start\n");
+            for(unsigned int dim = 0;dim<DIM;++dim)
+                if(m_boundary[dim] == Boundary::PERIODIC && !m_has_domain)
+                    TREE_PRINT_ERROR(stdout, "PERIODIC boundary needs SetDomain\n");
+            SetKeyBox();
+
+            std::vector<Detail::MortonKey> keys(m_input_size), tmp;
+#pragma omp parallel for schedule(static)
+            for(int i = 0;i<m_input_size;++i) {
+                keys[i].key = MortonKey(&m_input_pos[DIM*std::size_t(i)]);
+                keys[i].id  = i;
+            }
+            Detail::RadixSort(keys, tmp, KEY_BITS*DIM);
+
+            //keys are sorted, so the destinations come in ascending order
+            const std::vector<std::uint64_t> splitter = Splitter(keys);
+            const int num_rank = m_transport.NumRank();
+            std::vector<std::vector<std::uint64_t>> send_key(num_rank), recv_key;
+            m_migrate_index.assign(num_rank, {});
+            int dst = 0;
+            for(const Detail::MortonKey& key : keys) {
+                while(dst < num_rank-1 && splitter[dst] <= key.key)
+                    ++dst;
+                m_migrate_index[dst].emplace_back(key.id);
+                send_key[dst].emplace_back(key.key);
+            }
+            m_transport.AllToAll(send_key, recv_key);
+
+            //the local particles in Morton order, so that each run of MakeGhostIndex is compact
+            keys.clear();
+            for(const std::vector<std::uint64_t>& run : recv_key)
+                for(std::uint64_t key : run)
+                    keys.push_back({key, static_cast<unsigned int>(keys.size())});
+            Detail::RadixSort(keys, tmp, KEY_BITS*DIM);
+            m_num_local = keys.size();
+            m_local_order.resize(m_num_local);
+            for(unsigned int k = 0;k<m_num_local;++k)
+                m_local_order[k] = keys[k].id;
+            Migrate(m_input_pos.data(), m_pos, DIM);
+            Migrate(m_input_search_radius.data(), m_search_radius, 1);
+
+            MakeGhostIndex();
+            std::vector<Scalar> ghost_pos, ghost_search_radius;
+            ExchangeGhost(m_pos.data(), ghost_pos, DIM);
+            ExchangeGhost(m_search_radius.data(), ghost_search_radius, 1);
+            m_num_ghost = ghost_search_radius.size();
+            m_pos.insert(m_pos.end(), ghost_pos.begin(), ghost_pos.end());
+            m_search_radius.insert(m_search_radius.end(), ghost_search_radius.begin(), ghost_search_radius.end());
+
+            const unsigned int size = m_num_local + m_num_ghost;
+            if(size > m_reserve_num) {
+                m_reserve_num = std::max(size, 2*m_reserve_num);
+                m_tree = StaticNeighborParticleSearchTree<DIM, Scalar>(m_reserve_num, m_leaf_capacity, m_precision);
+            }
+            m_tree.Resize(size);
+            if(size > 0) {
+                m_tree.UsePosBuffer(m_pos.data());
+                m_tree.UseSearchRadiusBuffer(m_search_radius.data());
+            }
+            if(m_has_domain)
+                m_tree.SetDomain(m_domain_lower, m_domain_upper);
+            else
+                m_tree.ClearDomain();
+            for(unsigned int dim = 0;dim<DIM;++dim)
+                m_tree.SetBoundary(dim, m_boundary[dim]);
+            m_tree.template UpdateTree<BUILD_MODE>();
+            TREE_PRINT_INFO("finish\n");
+        }
+
+        //Collective. local[count*k + c] = input[count*i + c], where input particle i of some rank became local particle k of this rank in the last UpdateTree,
+        //e.g. to move velocities or global ids along with the particles. input holds count values for each input particle of this rank.
+        template <typename T>
+        void Migrate(const T* input, std::vector<T>& local, unsigned int count = 1) {
+            const int num_rank = m_transport.NumRank();
+            std::vector<std::vector<T>> send(num_rank), recv;
+            for(int r = 0;r<num_rank;++r) {
+                send[r].reserve(count*m_migrate_index[r].size());
+                for(unsigned int i : m_migrate_index[r])
+                    send[r].insert(send[r].end(), input + count*std::size_t(i), input + count*(std::size_t(i)+1));
+            }
+            m_transport.AllToAll(send, recv);
+
+            std::vector<const T*> received;
+            received.reserve(m_num_local);
+            for(const std::vector<T>& run : recv)
+                for(std::size_t k = 0;k<run.size();k += count)
+                    received.push_back(run.data() + k);
+            if(received.size() != m_num_local)
+                TREE_PRINT_ERROR(stdout, "Migrate got %zu particles for %u local particles, count must be the same on every rank\n", received.size(), m_num_local);
+            local.resize(count*std::size_t(m_num_local));
+            for(unsigned int k = 0;k<m_num_local;++k)
+                std::copy(received[m_local_order[k]], received[m_local_order[k]] + count, local.begin() + count*std::size_t(k));
+        }
+
+        //Collective. ghost[count*k + c] = local[count*i + c] on the rank whose local particle i is ghost k (particle NumLocal()+k) of this rank,
+        //e.g. densities needed for the forces on the local particles. local holds count values for each local particle.
+        template <typename T>
+        void ExchangeGhost(const T* local, std::vector<T>& ghost, unsigned int count = 1) {
+            const int num_rank = m_transport.NumRank();
+            std::vector<std::vector<T>> send(num_rank), recv;
+            for(int r = 0;r<num_rank;++r) {
+                send[r].reserve(count*m_ghost_index[r].size());
+                for(unsigned int i : m_ghost_index[r])
+                    send[r].insert(send[r].end(), local + count*std::size_t(i), local + count*(std::size_t(i)+1));
+            }
+            m_transport.AllToAll(send, recv);
+            ghost.clear();
+            for(const std::vector<T>& run : recv)
+                ghost.insert(ghost.end(), run.begin(), run.end());
+        }
+
+        unsigned int NumLocal() const {
+            return m_num_local;
+        }
+
+        unsigned int NumGhost() const {
+            return m_num_ghost;
+        }
+
+        //position of local (id < NumLocal()) or ghost particle id
+        Scalar GetPos(unsigned int id, unsigned int dim) const {
+            if(id < m_num_local + m_num_ghost && dim < DIM)
+                return m_pos[DIM*std::size_t(id) + dim];
+            TREE_PRINT_ERROR(stdout, "Acces to outside of memory\n");
+        }
+
+        Scalar GetSearchRadius(unsigned int id) const {
+            if(id < m_num_local + m_num_ghost)
+                return m_search_radius[id];
+            TREE_PRINT_ERROR(stdout, "Acces to outside of memory\n");
+        }
+
+        //tree of the local and ghost particles, with the boundaries of SetBoundary
+        const StaticNeighborParticleSearchTree<DIM, Scalar>& LocalTree() const {
+            return m_tree;
+        }
+
+        //Neighbors among the local and ghost particles. The list is complete if the query lies within the reach of the local particles,
+        //i.e. pos is in a box around them and radius is at most their search radius, e.g. pos and radius of a local particle.
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindNeighborParticle(const Scalar* pos, const Scalar radius, std::vector<unsigned int>& interaction_list, bool clear = true) const {
+            m_tree.template FindNeighborParticle<SEARCH_MODE>(pos, radius, interaction_list, clear);
+        }
+
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER, typename Function>
+        void ForEachNeighborParticle(const Scalar* pos, const Scalar radius, Function&& f) const {
+            m_tree.template ForEachNeighborParticle<SEARCH_MODE>(pos, radius, std::forward<Function>(f));
+        }
+
+        //interaction_list[i] = neighbors of local particle i within its search radius (GATHER) or within max(search radius of i, search radius of j) (SYMMETRY),
+        //for i < NumLocal(). The same lists as the single tree of all particles would give, with the ghost ids in place of those of other ranks.
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER>
+        void FindAllNeighborParticle(std::vector<std::vector<unsigned int>>& interaction_list) const {
+            m_tree.template FindNeighborParticle<SEARCH_MODE>(m_pos.data(), m_search_radius.data(), m_num_local, interaction_list);
+        }
+
+        //Calls f(i, j, r2, dx) for every neighbor j of every local particle i as found by FindAllNeighborParticle, with dx = (position of i) - (position of j).
+        template <SearchMode SEARCH_MODE = SearchMode::GATHER, typename Function>
+        void ForEachAllNeighborParticle(Function&& f) const {
+#pragma omp parallel for schedule(dynamic, 64)
+            for(int i = 0;i<static_cast<int>(m_num_local);++i)
+                m_tree.template ForEachNeighborParticle<SEARCH_MODE>(&m_pos[DIM*std::size_t(i)], m_search_radius[i], [&](unsigned int j, Scalar r2, const Scalar* dx) { f(i, j, r2, dx); });
+        }
+
+    private:
+        static constexpr unsigned int KEY_BITS        = 63 / DIM;
+        static constexpr unsigned int SAMPLE_PER_RANK = 64; //keys sampled per rank to choose the splitters
+        static constexpr unsigned int RUN_SIZE        = 64; //local particles per run of MakeGhostIndex, at least
+        static constexpr unsigned int MAX_RUN         = 64; //runs per rank, at most
+
+        //box of a run of local particles in Morton order and the largest search radius in it
+        struct Run {
+            Scalar lower[DIM], upper[DIM];
+            Scalar max_search_radius;
+        };
+
+        Transport m_transport;
+        unsigned int m_reserve_num, m_leaf_capacity;
+        Precision m_precision;
+        StaticNeighborParticleSearchTree<DIM, Scalar> m_tree;
+
+        int m_input_size = 0;
+        std::vector<Scalar> m_input_pos, m_input_search_radius;
+
+        bool m_has_domain = false;
+        Scalar m_domain_lower[DIM], m_domain_upper[DIM];
+        Boundary m_boundary[DIM];
+        Scalar m_key_lower[DIM], m_key_size = 1; //cube of the Morton keys
+
+        unsigned int m_num_local = 0, m_num_ghost = 0;
+        std::vector<Scalar> m_pos, m_search_radius;             //local particles, then ghosts
+        std::vector<std::vector<unsigned int>> m_migrate_index; //m_migrate_index[r] = input particles sent to rank r, in Morton order
+        std::vector<unsigned int> m_local_order;                //local particle k is the m_local_order[k]-th particle received by Migrate
+        std::vector<std::vector<unsigned int>> m_ghost_index;   //m_ghost_index[r] = local particles sent to rank r as ghosts
+
+        //cube of the domain, or of the input particles of all ranks
+        void SetKeyBox() {
+            Scalar lower[DIM], upper[DIM];
+            if(m_has_domain)
+                for(unsigned int dim = 0;dim<DIM;++dim) {
+                    lower[dim] = m_domain_lower[dim];
+                    upper[dim] = m_domain_upper[dim];
+                }
+            else {
+                std::vector<Scalar> box(2*DIM);
+                for(unsigned int dim = 0;dim<DIM;++dim) {
+                    box[dim]       = std::numeric_limits<Scalar>::max();
+                    box[DIM + dim] = std::numeric_limits<Scalar>::lowest();
+                }
+                for(int i = 0;i<m_input_size;++i)
+                    for(unsigned int dim = 0;dim<DIM;++dim) {
+                        box[dim]       = std::min(box[dim], m_input_pos[DIM*std::size_t(i) + dim]);
+                        box[DIM + dim] = std::max(box[DIM + dim], m_input_pos[DIM*std::size_t(i) + dim]);
+                    }
+                std::vector<std::vector<Scalar>> send(m_transport.NumRank(), box), recv;
+                m_transport.AllToAll(send, recv);
+                for(unsigned int dim = 0;dim<DIM;++dim) {
+                    lower[dim] = std::numeric_limits<Scalar>::max();
+                    upper[dim] = std::numeric_limits<Scalar>::lowest();
+                    for(const std::vector<Scalar>& b : recv) {
+                        lower[dim] = std::min(lower[dim], b[dim]);
+                        upper[dim] = std::max(upper[dim], b[DIM + dim]);
+                    }
+                }
+            }
+            m_key_size = 0;
+            for(unsigned int dim = 0;dim<DIM;++dim) {
+                if(!(lower[dim] <= upper[dim])) //no particle anywhere
+                    lower[dim] = upper[dim] = 0;
+                m_key_lower[dim] = lower[dim];
+                m_key_size       = std::max(m_key_size, upper[dim] - lower[dim]);
+            }
+            if(!(m_key_size > 0))
+                m_key_size = 1;
+        }
+
+        std::uint64_t MortonKey(const Scalar* x) const {
+            const Scalar scale = std::ldexp(Scalar(1), KEY_BITS) / m_key_size;
+            const Scalar limit = std::ldexp(Scalar(1), KEY_BITS) - 1;
+            std::uint64_t ix[DIM];
+            for(unsigned int dim = 0;dim<DIM;++dim) {
+                Scalar k = std::floor((x[dim] - m_key_lower[dim])*scale);
+                k = k < 0 ? 0 : (k > limit ? limit : k);
+                ix[dim] = static_cast<std::uint64_t>(k);
+            }
+            return Detail::InterleaveBits<DIM>(ix, KEY_BITS);
+        }
+
+        //NumRank()-1 keys cutting the Morton curve into segments of about the same number of particles. Every rank samples its sorted keys
+        //at the same stride, so each sample stands for the same number of particles, and all ranks pick the same quantiles of the samples.
+        std::vector<std::uint64_t> Splitter(const std::vector<Detail::MortonKey>& keys) {
+            const int num_rank = m_transport.NumRank();
+            std::vector<std::vector<std::uint64_t>> send(num_rank, std::vector<std::uint64_t>(1, keys.size())), recv;
+            m_transport.AllToAll(send, recv);
+            std::uint64_t num_total = 0;
+            for(const std::vector<std::uint64_t>& n : recv)
+                num_total += n[0];
+
+            const std::size_t stride = std::max<std::uint64_t>(1, num_total/(std::uint64_t(SAMPLE_PER_RANK)*num_rank));
+            std::vector<std::uint64_t> sample;
+            for(std::size_t k = stride/2;k<keys.size();k += stride)
+                sample.push_back(keys[k].key);
+            send.assign(num_rank, sample);
+            m_transport.AllToAll(send, recv);
+            sample.clear();
+            for(const std::vector<std::uint64_t>& s : recv)
+                sample.insert(sample.end(), s.begin(), s.end());
+            std::sort(sample.begin(), sample.end());
+
+            std::vector<std::uint64_t> splitter(num_rank-1, std::numeric_limits<std::uint64_t>::max());
+            if(!sample.empty())
+                for(int r = 1;r<num_rank;++r)
+                    splitter[r-1] = sample[sample.size()*r/num_rank];
+            return splitter;
+        }
+
+        //Cuts the local particles into runs along the Morton curve and sends the box and largest search radius of every run to all ranks.
+        //A local particle at x with search radius h is a ghost of another rank if max(h, largest search radius of a run) reaches the box of a run of that rank:
+        //a GATHER neighbor of a particle in the run lies within its search radius, and a SYMMETRY neighbor also within h.
+        void MakeGhostIndex() {
+            const int num_rank = m_transport.NumRank();
+            const unsigned int num_run = std::min(MAX_RUN, (m_num_local + RUN_SIZE - 1)/RUN_SIZE);
+            std::vector<Run> run(num_run);
+            for(unsigned int c = 0;c<num_run;++c) {
+                const unsigned int beg = std::size_t(m_num_local)*c/num_run, end = std::size_t(m_num_local)*(c+1)/num_run;
+                run[c] = MakeRun(beg, end);
+            }
+            std::vector<std::vector<Run>> send(num_rank, run), recv;
+            m_transport.AllToAll(send, recv);
+
+            const Run local = MakeRun(0, m_num_local);
+            std::vector<unsigned char> is_ghost(m_num_local);
+            m_ghost_index.assign(num_rank, {});
+            for(int r = 0;r<num_rank;++r) {
+                if(r == m_transport.Rank() || recv[r].empty() || num_run == 0)
+                    continue;
+                const Run remote = Union(recv[r]);
+                if(!isWithinReach(local.lower, local.upper, local.max_search_radius, remote))
+                    continue;
+#pragma omp parallel for schedule(static)
+                for(int i = 0;i<static_cast<int>(m_num_local);++i) {
+                    const Scalar* x = &m_pos[DIM*std::size_t(i)];
+                    const Scalar h  = m_search_radius[i];
+                    is_ghost[i]     = isWithinReach(x, x, h, remote) && std::any_of(recv[r].begin(), recv[r].end(), [&](const Run& c) { return isWithinReach(x, x, h, c); });
+                }
+                for(unsigned int i = 0;i<m_num_local;++i)
+                    if(is_ghost[i])
+                        m_ghost_index[r].emplace_back(i);
+            }
+        }
+
+        Run MakeRun(unsigned int beg, unsigned int end) const {
+            Run run;
+            for(unsigned int dim = 0;dim<DIM;++dim) {
+                run.lower[dim] = std::numeric_limits<Scalar>::max();
+                run.upper[dim] = std::numeric_limits<Scalar>::lowest();
+            }
+            run.max_search_radius = 0;
+            for(unsigned int i = beg;i<end;++i) {
+                for(unsigned int dim = 0;dim<DIM;++dim) {
+                    run.lower[dim] = std::min(run.lower[dim], m_pos[DIM*std::size_t(i) + dim]);
+                    run.upper[dim] = std::max(run.upper[dim], m_pos[DIM*std::size_t(i) + dim]);
+                }
+                run.max_search_radius = std::max(run.max_search_radius, m_search_radius[i]);
+            }
+            return run;
+        }
+
+        static Run Union(const std::vector<Run>& runs) {
+            Run run = runs[0];
+            for(const Run& other : runs) {
+                for(unsigned int dim = 0;dim<DIM;++dim) {
+                    run.lower[dim] = std::min(run.lower[dim], other.lower[dim]);
+                    run.upper[dim] = std::max(run.upper[dim], other.upper[dim]);
+                }
+                run.max_search_radius = std::max(run.max_search_radius, other.max_search_radius);
+            }
+            return run;
+        }
+
+        //true if the box [lower, upper] is within max(radius, run.max_search_radius) of the box of run (their nearest images along PERIODIC axes),
+        //inflated by the round-off of the distances so that no neighbor on the search radius is missed
+        bool isWithinReach(const Scalar* lower, const Scalar* upper, Scalar radius, const Run& run) const {
+            constexpr Scalar eps = std::numeric_limits<Scalar>::epsilon();
+            const Scalar reach   = std::max(radius, run.max_search_radius)*(1 + 16*eps) + 16*eps*m_key_size;
+            Scalar r2 = 0;
+            for(unsigned int dim = 0;dim<DIM;++dim) {
+                Scalar gap = Gap(lower[dim], upper[dim], run.lower[dim], run.upper[dim]);
+                if(m_boundary[dim] == Boundary::PERIODIC) {
+                    const Scalar length = m_domain_upper[dim] - m_domain_lower[dim];
+                    gap = std::min({gap, Gap(lower[dim] + length, upper[dim] + length, run.lower[dim], run.upper[dim]), Gap(lower[dim] - length, upper[dim] - length, run.lower[dim], run.upper[dim])});
+                }
+                r2 += gap*gap;
+            }
+            return r2 <= reach*reach;
+        }
+
+        //distance between the intervals [a_lower, a_upper] and [b_lower, b_upper]
+        static Scalar Gap(Scalar a_lower, Scalar a_upper, Scalar b_lower, Scalar b_upper) {
+            return std::max({b_lower - a_upper, a_lower - b_upper, Scalar(0)});
         }
     };
-}
\ No newline at end of file
+}
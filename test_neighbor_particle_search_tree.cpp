@@ -2,9 +2,33 @@
 #include <utility>
 #include <vector>
 #include <algorithm>
+#include <random>
+#include <thread>
 
 #include "neighbor_particle_search_tree.hpp"
 
+//O(N^2) reference used to check the tree. boundary_length == nullptr means open boundary.
+template <Tree::SearchMode SEARCH_MODE, int DIM>
+std::vector<unsigned int> BruteForceNeighbor(const std::vector<std::array<double, DIM>>& pos, const std::vector<double>& search_radius, const double* point, double radius, const double* boundary_length = nullptr) {
+    std::vector<unsigned int> list;
+    for(unsigned int i = 0;i<pos.size();++i) {
+        double length = 0;
+        for(int dim = 0;dim<DIM;++dim) {
+            double dx = point[dim] - pos[i][dim];
+            if(boundary_length != nullptr) {
+                if(dx > 0.5*boundary_length[dim])
+                    dx -= boundary_length[dim];
+                else if(dx < -0.5*boundary_length[dim])
+                    dx += boundary_length[dim];
+            }
+            length += dx*dx;
+        }
+        if(length <= radius*radius || (SEARCH_MODE == Tree::SearchMode::SYMMETRY && length <= search_radius[i]*search_radius[i]))
+            list.emplace_back(i);
+    }
+    return list;
+}
+
 int main() {
 {
     constexpr int DIM              = 3;    //spatial dimension
@@ -141,9 +165,1588 @@ int main() {
 
     Tree::NeighborParticleSearchTree tree_move_test2(2, 1000);
     tree_move_test = std::move(tree_move_test);
+    //a tree moved into itself still answers the same query
+    std::vector<unsigned int> self_move_list;
+    tree_move_test.FindNeighborParticleWithPeriodicBoundary<Tree::SearchMode::SYMMETRY>(point_of_search, search_radius, periodic_boundary_length, self_move_list);
+    std::sort(self_move_list.begin(), self_move_list.end());
+    if(self_move_list != interaction_list) {
+        std::cout << "TEST4 FAILED. Self move assignment lost the tree\n";
+        std::exit(EXIT_FAILURE);
+    }
+    Tree::StaticNeighborParticleSearchTree<3> static_move_test(10);
+    static_move_test.Resize(2);
+    static_move_test.CopyPos(1, 1, 0);
+    static_move_test.UpdateTree();
+    static_move_test = std::move(static_move_test);
+    static_move_test.FindNeighborParticle(point_of_search, 100, self_move_list);
+    if(self_move_list.size() != 2) {
+        std::cout << "TEST4 FAILED. Self move assignment lost the tree\n";
+        std::exit(EXIT_FAILURE);
+    }
     tree = std::move(tree_move_test2);
 }
 
     std::cout << "TEST4 PASSED\n";
     //////////////////////////////////////////////////////////////////////////////////////////////////////
-}
\ No newline at end of file
+
+    std::cout << "\n";
+
+    //////////////////////////////////////////////TEST5///////////////////////////////////////////////////
+    std::cout << "TEST5 (Check for compile-time dimension tree against brute force): \n";
+    {
+        constexpr int DIM2 = 2;
+        constexpr int num = 2000;
+        std::mt19937 mt(5);
+        std::uniform_real_distribution<double> uni(0, 10);
+        std::vector<std::array<double, DIM2>> pos(num);
+        std::vector<double> radius(num);
+        Tree::StaticNeighborParticleSearchTree<DIM2> tree2d(num);
+        tree2d.Resize(num);
+        for(int i = 0;i<num;++i) {
+            radius[i] = 0.05 + 0.3*uni(mt)/10;
+            tree2d.CopySearchRadius(radius[i], i);
+            for(int dim = 0;dim<DIM2;++dim) {
+                pos[i][dim] = uni(mt);
+                tree2d.CopyPos(pos[i][dim], i, dim);
+            }
+        }
+        tree2d.UpdateTree();
+
+        const double box[DIM2] = {10, 10};
+        std::vector<unsigned int> list;
+        for(int q = 0;q<200;++q) {
+            double point[DIM2] = {uni(mt), uni(mt)};
+            tree2d.FindNeighborParticle(point, 0.2, list);
+            std::sort(list.begin(), list.end());
+            bool ok = list == BruteForceNeighbor<Tree::SearchMode::GATHER, DIM2>(pos, radius, point, 0.2);
+            tree2d.FindNeighborParticle<Tree::SearchMode::SYMMETRY>(point, 0.1, list);
+            std::sort(list.begin(), list.end());
+            ok = ok && list == BruteForceNeighbor<Tree::SearchMode::SYMMETRY, DIM2>(pos, radius, point, 0.1);
+            tree2d.FindNeighborParticleWithPeriodicBoundary<Tree::SearchMode::SYMMETRY>(point, 0.1, box, list);
+            std::sort(list.begin(), list.end());
+            ok = ok && list == BruteForceNeighbor<Tree::SearchMode::SYMMETRY, DIM2>(pos, radius, point, 0.1, box);
+            if(!ok) {
+                std::cout << "TEST5 FAILED. neighbor list differs from brute force at query " << q << "\n";
+                std::exit(EXIT_FAILURE);
+            }
+        }
+    }
+    std::cout << "TEST5 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    std::cout << "\n";
+
+    //////////////////////////////////////////////TEST6///////////////////////////////////////////////////
+    std::cout << "TEST6 (Check for Morton bulk build against insertion build): \n";
+    {
+        constexpr int DIM3 = 3;
+        constexpr int num = 5000;
+        std::mt19937 mt(6);
+        std::uniform_real_distribution<double> uni(-20, 30);
+        std::vector<std::array<double, DIM3>> pos(num);
+        std::vector<double> radius(num);
+        Tree::NeighborParticleSearchTree tree_insertion(DIM3, num), tree_morton(DIM3, num);
+        tree_insertion.Resize(num), tree_morton.Resize(num);
+        for(int i = 0;i<num;++i) {
+            radius[i] = 0.5 + uni(mt)/50;
+            tree_insertion.CopySearchRadius(radius[i], i), tree_morton.CopySearchRadius(radius[i], i);
+            const int j = i - num/2;
+            const int lattice[DIM3] = {j%17 - 8, (j/17)%17 - 8, j/289 - 4};
+            for(int dim = 0;dim<DIM3;++dim) {
+                pos[i][dim] = i < num/2 ? uni(mt) : lattice[dim]; //half of the particles sit on cell boundaries
+                tree_insertion.CopyPos(pos[i][dim], i, dim), tree_morton.CopyPos(pos[i][dim], i, dim);
+            }
+        }
+        tree_insertion.UpdateTree();
+        tree_morton.UpdateTree<Tree::BuildMode::MORTON>();
+
+        std::vector<unsigned int> list_insertion, list_morton;
+        for(int q = 0;q<300;++q) {
+            double point[DIM3] = {uni(mt), uni(mt), uni(mt)};
+            tree_insertion.FindNeighborParticle<Tree::SearchMode::SYMMETRY>(point, 1.5, list_insertion);
+            tree_morton.FindNeighborParticle<Tree::SearchMode::SYMMETRY>(point, 1.5, list_morton);
+            std::sort(list_insertion.begin(), list_insertion.end());
+            std::sort(list_morton.begin(), list_morton.end());
+            if(list_insertion != list_morton || list_morton != BruteForceNeighbor<Tree::SearchMode::SYMMETRY, DIM3>(pos, radius, point, 1.5)) {
+                std::cout << "TEST6 FAILED. Morton build differs from insertion build at query " << q << "\n";
+                std::exit(EXIT_FAILURE);
+            }
+        }
+    }
+    std::cout << "TEST6 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    std::cout << "\n";
+
+    //////////////////////////////////////////////TEST7///////////////////////////////////////////////////
+    std::cout << "TEST7 (Check for leaf buckets and coincident particles): \n";
+    {
+        constexpr int DIM3 = 3;
+        constexpr int num = 3000;
+        std::mt19937 mt(7);
+        std::uniform_real_distribution<double> uni(0, 10);
+        std::vector<std::array<double, DIM3>> pos(num);
+        std::vector<double> radius(num, 0.3);
+        for(int i = 0;i<num;++i)
+            for(int dim = 0;dim<DIM3;++dim)
+                pos[i][dim] = i%3 == 0 || i < 30 ? uni(mt) : pos[i-1][dim]; //most particles have coincident partners, and 30 of them sit on one point
+        for(int i = 1;i<30;++i)
+            pos[i] = pos[0];
+
+        for(unsigned int leaf_capacity : {1u, 4u, 32u}) {
+            Tree::StaticNeighborParticleSearchTree<DIM3> tree_insertion(num, leaf_capacity), tree_morton(num, leaf_capacity);
+            tree_insertion.Resize(num), tree_morton.Resize(num);
+            for(int i = 0;i<num;++i)
+                for(int dim = 0;dim<DIM3;++dim)
+                    tree_insertion.CopyPos(pos[i][dim], i, dim), tree_morton.CopyPos(pos[i][dim], i, dim);
+            tree_insertion.UpdateTree();
+            tree_morton.UpdateTree<Tree::BuildMode::MORTON>();
+
+            std::vector<unsigned int> list;
+            for(int q = 0;q<100;++q) {
+                const double* point = q == 0 ? pos[0].data() : pos[mt()%num].data();
+                auto ans = BruteForceNeighbor<Tree::SearchMode::GATHER, DIM3>(pos, radius, point, 0.5);
+                tree_insertion.FindNeighborParticle(point, 0.5, list);
+                std::sort(list.begin(), list.end());
+                bool ok = list == ans;
+                tree_morton.FindNeighborParticle(point, 0.5, list);
+                std::sort(list.begin(), list.end());
+                if(!ok || list != ans) {
+                    std::cout << "TEST7 FAILED. leaf_capacity: " << leaf_capacity << ", query " << q << "\n";
+                    std::exit(EXIT_FAILURE);
+                }
+            }
+        }
+    }
+    std::cout << "TEST7 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    std::cout << "\n";
+
+    //////////////////////////////////////////////TEST8///////////////////////////////////////////////////
+    std::cout << "TEST8 (Check for vectorized leaf filtering with partial blocks): \n";
+    {
+        constexpr int DIM3 = 3;
+        constexpr int num = 4000;
+        std::mt19937 mt(8);
+        std::uniform_real_distribution<float> uni(0, 16);
+        std::vector<std::array<double, DIM3>> pos(num);
+        std::vector<double> radius(num);
+        Tree::StaticNeighborParticleSearchTree<DIM3, float> tree_float(num, 37); //odd capacity so that leaves end with partial vector blocks
+        Tree::StaticNeighborParticleSearchTree<DIM3> tree_double(num, 37);
+        tree_float.Resize(num), tree_double.Resize(num);
+        for(int i = 0;i<num;++i) {
+            radius[i] = uni(mt)/16;
+            tree_float.CopySearchRadius(radius[i], i), tree_double.CopySearchRadius(radius[i], i);
+            for(int dim = 0;dim<DIM3;++dim) {
+                pos[i][dim] = uni(mt);
+                tree_float.CopyPos(pos[i][dim], i, dim), tree_double.CopyPos(pos[i][dim], i, dim);
+            }
+        }
+        tree_float.UpdateTree();
+        tree_double.UpdateTree();
+
+        const float box_float[DIM3] = {16, 16, 16};
+        const double box[DIM3] = {16, 16, 16};
+        std::vector<unsigned int> list;
+        for(int q = 0;q<200;++q) {
+            const float point_float[DIM3] = {uni(mt), uni(mt), uni(mt)};
+            const double point[DIM3] = {point_float[0], point_float[1], point_float[2]};
+            auto ans = BruteForceNeighbor<Tree::SearchMode::SYMMETRY, DIM3>(pos, radius, point, 0.7, box);
+            tree_float.FindNeighborParticleWithPeriodicBoundary<Tree::SearchMode::SYMMETRY>(point_float, 0.7f, box_float, list);
+            std::sort(list.begin(), list.end());
+            bool ok = list == ans;
+            tree_double.FindNeighborParticleWithPeriodicBoundary<Tree::SearchMode::SYMMETRY>(point, 0.7, box, list);
+            std::sort(list.begin(), list.end());
+            if(!ok || list != ans) {
+                std::cout << "TEST8 FAILED. neighbor list differs from brute force at query " << q << "\n";
+                std::exit(EXIT_FAILURE);
+            }
+        }
+    }
+    std::cout << "TEST8 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    std::cout << "\n";
+
+    //////////////////////////////////////////////TEST9///////////////////////////////////////////////////
+    std::cout << "TEST9 (Check for batched query): \n";
+    {
+        constexpr int DIM2 = 2;
+        constexpr int num = 3000, num_query = 1000;
+        std::mt19937 mt(9);
+        std::uniform_real_distribution<double> uni(0, 10);
+        Tree::NeighborParticleSearchTree tree2d(DIM2, num);
+        tree2d.Resize(num);
+        for(int i = 0;i<num;++i) {
+            tree2d.CopySearchRadius(uni(mt)/20, i);
+            for(int dim = 0;dim<DIM2;++dim)
+                tree2d.CopyPos(uni(mt), i, dim);
+        }
+        tree2d.UpdateTree<Tree::BuildMode::MORTON>();
+
+        std::vector<double> point(DIM2*num_query), radius(num_query);
+        for(int i = 0;i<num_query;++i) {
+            point[DIM2*i] = uni(mt), point[DIM2*i+1] = uni(mt);
+            radius[i] = uni(mt)/30;
+        }
+        const double box[DIM2] = {10, 10};
+        std::vector<std::vector<unsigned int>> batch_list, batch_list_periodic;
+        tree2d.FindNeighborParticle<Tree::SearchMode::SYMMETRY>(point.data(), radius.data(), num_query, batch_list);
+        tree2d.FindNeighborParticleWithPeriodicBoundary(point.data(), radius.data(), num_query, box, batch_list_periodic);
+
+        std::vector<unsigned int> list;
+        for(int i = 0;i<num_query;++i) {
+            tree2d.FindNeighborParticle<Tree::SearchMode::SYMMETRY>(&point[DIM2*i], radius[i], list);
+            bool ok = list == batch_list[i];
+            tree2d.FindNeighborParticleWithPeriodicBoundary(&point[DIM2*i], radius[i], box, list);
+            if(!ok || list != batch_list_periodic[i]) {
+                std::cout << "TEST9 FAILED. batched result differs from single query " << i << "\n";
+                std::exit(EXIT_FAILURE);
+            }
+        }
+    }
+    std::cout << "TEST9 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    std::cout << "\n";
+
+    //////////////////////////////////////////////TEST10//////////////////////////////////////////////////
+    std::cout << "TEST10 (Check for neighbor search of all particles by group walk): \n";
+    {
+        constexpr int DIM3 = 3;
+        constexpr int num = 4000;
+        std::mt19937 mt(10);
+        std::uniform_real_distribution<double> uni(0, 10);
+        std::vector<double> pos(DIM3*num), radius(num);
+        Tree::NeighborParticleSearchTree tree3d(DIM3, num);
+        tree3d.Resize(num);
+        for(int i = 0;i<num;++i) {
+            radius[i] = 0.3 + uni(mt)/20;
+            tree3d.CopySearchRadius(radius[i], i);
+            for(int dim = 0;dim<DIM3;++dim) {
+                pos[DIM3*i + dim] = uni(mt);
+                tree3d.CopyPos(pos[DIM3*i + dim], i, dim);
+            }
+        }
+        tree3d.UpdateTree();
+
+        const double box[DIM3] = {10, 10, 10};
+        std::vector<std::vector<unsigned int>> all_list, batch_list;
+        tree3d.FindAllNeighborParticle(all_list);
+        tree3d.FindNeighborParticle(pos.data(), radius.data(), num, batch_list);
+        bool ok = all_list == batch_list;
+        tree3d.FindAllNeighborParticle<Tree::SearchMode::SYMMETRY>(all_list);
+        tree3d.FindNeighborParticle<Tree::SearchMode::SYMMETRY>(pos.data(), radius.data(), num, batch_list);
+        ok = ok && all_list == batch_list;
+        tree3d.FindAllNeighborParticleWithPeriodicBoundary<Tree::SearchMode::SYMMETRY>(box, all_list);
+        tree3d.FindNeighborParticleWithPeriodicBoundary<Tree::SearchMode::SYMMETRY>(pos.data(), radius.data(), num, box, batch_list);
+        ok = ok && all_list == batch_list;
+        if(!ok) {
+            std::cout << "TEST10 FAILED. group walk differs from per-particle query\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    std::cout << "TEST10 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    std::cout << "\n";
+
+    //////////////////////////////////////////////TEST11//////////////////////////////////////////////////
+    std::cout << "TEST11 (Check for compressed neighbor list and half list): \n";
+    {
+        constexpr int DIM3 = 3;
+        constexpr int num = 3000;
+        std::mt19937 mt(11);
+        std::uniform_real_distribution<double> uni(0, 8);
+        Tree::NeighborParticleSearchTree tree3d(DIM3, num);
+        tree3d.Resize(num);
+        for(int i = 0;i<num;++i) {
+            tree3d.CopySearchRadius(0.3 + uni(mt)/20, i);
+            for(int dim = 0;dim<DIM3;++dim)
+                tree3d.CopyPos(uni(mt), i, dim);
+        }
+        tree3d.UpdateTree();
+
+        const double box[DIM3] = {8, 8, 8};
+        std::vector<std::vector<unsigned int>> all_list;
+        Tree::CompressedNeighborList full_list, half_list;
+        tree3d.FindAllNeighborParticleWithPeriodicBoundary<Tree::SearchMode::SYMMETRY>(box, all_list);
+        for(int step = 0;step<2;++step) { //second step reuses the arrays
+            tree3d.FindAllNeighborParticleWithPeriodicBoundary<Tree::SearchMode::SYMMETRY>(box, full_list);
+            tree3d.FindAllNeighborParticleWithPeriodicBoundary<Tree::SearchMode::SYMMETRY>(box, half_list, true);
+        }
+
+        bool ok = full_list.Size() == num && half_list.Size() == num && full_list.neighbor.size() == 2*half_list.neighbor.size() + num; //every particle is its own neighbor once
+        for(unsigned int i = 0;ok && i<num;++i) {
+            ok = std::vector<unsigned int>(full_list.begin(i), full_list.end(i)) == all_list[i];
+            std::vector<unsigned int> upper;
+            for(unsigned int j : all_list[i])
+                if(j > i)
+                    upper.emplace_back(j);
+            ok = ok && std::vector<unsigned int>(half_list.begin(i), half_list.end(i)) == upper;
+        }
+        if(!ok) {
+            std::cout << "TEST11 FAILED. compressed neighbor list differs from neighbor list\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    std::cout << "TEST11 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    std::cout << "\n";
+
+    //////////////////////////////////////////////TEST12//////////////////////////////////////////////////
+    std::cout << "TEST12 (Check for squared distance and displacement of neighbor particles): \n";
+    {
+        constexpr int DIM3 = 3;
+        constexpr int num = 2000;
+        std::mt19937 mt(12);
+        std::uniform_real_distribution<double> uni(0, 6);
+        std::vector<std::array<double, DIM3>> pos(num);
+        Tree::NeighborParticleSearchTree tree3d(DIM3, num);
+        tree3d.Resize(num);
+        for(int i = 0;i<num;++i) {
+            tree3d.CopySearchRadius(0.4, i);
+            for(int dim = 0;dim<DIM3;++dim) {
+                pos[i][dim] = uni(mt);
+                tree3d.CopyPos(pos[i][dim], i, dim);
+            }
+        }
+        tree3d.UpdateTree();
+
+        const double box[DIM3] = {6, 6, 6};
+        auto check = [&](const double* point, unsigned int j, double r2, const double* dx) {
+            double length = 0;
+            for(int dim = 0;dim<DIM3;++dim) {
+                double d = point[dim] - pos[j][dim];
+                d = d > 3 ? d - 6 : (d < -3 ? d + 6 : d);
+                length += d*d;
+                if(std::abs(d - dx[dim]) > 1e-12)
+                    return false;
+            }
+            return std::abs(length - r2) < 1e-12;
+        };
+
+        bool ok = true;
+        std::vector<Tree::NeighborParticle<3>> neighbor;
+        std::vector<unsigned int> list;
+        for(int q = 0;q<100;++q) {
+            const double point[DIM3] = {uni(mt), uni(mt), uni(mt)};
+            tree3d.FindNeighborParticleWithPeriodicBoundary(point, 0.5, box, neighbor);
+            tree3d.FindNeighborParticleWithPeriodicBoundary(point, 0.5, box, list);
+            ok = ok && neighbor.size() == list.size();
+            for(unsigned int k = 0;ok && k<neighbor.size();++k)
+                ok = neighbor[k].id == list[k] && check(point, neighbor[k].id, neighbor[k].r2, neighbor[k].dx.data());
+        }
+
+        std::vector<std::vector<unsigned int>> all_list;
+        std::vector<unsigned int> count(num, 0), wrong(num, 0); //written only by the thread visiting i
+        tree3d.FindAllNeighborParticleWithPeriodicBoundary(box, all_list);
+        tree3d.ForEachAllNeighborParticleWithPeriodicBoundary(box, [&](unsigned int i, unsigned int j, double r2, const double* dx) {
+            if(!check(pos[i].data(), j, r2, dx) || all_list[i][count[i]++] != j)
+                wrong[i] = 1;
+        });
+        for(int i = 0;i<num;++i)
+            ok = ok && count[i] == all_list[i].size() && !wrong[i];
+        if(!ok) {
+            std::cout << "TEST12 FAILED. squared distance or displacement is wrong\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    std::cout << "TEST12 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    std::cout << "\n";
+
+    //////////////////////////////////////////////TEST13//////////////////////////////////////////////////
+    std::cout << "TEST13 (Check for k-nearest neighbor search and search radius solver): \n";
+    {
+        constexpr int DIM3 = 3;
+        constexpr int num = 3000, num_neighbor = 32, tolerance = 2;
+        std::mt19937 mt(13);
+        std::uniform_real_distribution<double> uni(0, 5);
+        std::vector<std::array<double, DIM3>> pos(num);
+        Tree::NeighborParticleSearchTree tree3d(DIM3, num);
+        tree3d.Resize(num);
+        for(int i = 0;i<num;++i)
+            for(int dim = 0;dim<DIM3;++dim) {
+                pos[i][dim] = i < num/2 ? uni(mt) : uni(mt)/5; //clustered half
+                tree3d.CopyPos(pos[i][dim], i, dim);
+            }
+        tree3d.UpdateTree();
+
+        const double box[DIM3] = {5, 5, 5};
+        bool ok = true;
+        std::vector<Tree::NeighborParticle<3>> nearest;
+        for(int q = 0;ok && q<100;++q) {
+            const double point[DIM3] = {uni(mt), uni(mt), uni(mt)};
+            std::vector<std::pair<double, unsigned int>> ans;
+            for(unsigned int i = 0;i<num;++i) {
+                double length = 0;
+                for(int dim = 0;dim<DIM3;++dim) {
+                    double d = point[dim] - pos[i][dim];
+                    d = d > 2.5 ? d - 5 : (d < -2.5 ? d + 5 : d);
+                    length += d*d;
+                }
+                ans.emplace_back(length, i);
+            }
+            std::sort(ans.begin(), ans.end());
+            tree3d.FindNearestNeighborParticleWithPeriodicBoundary(point, num_neighbor, box, nearest);
+            ok = nearest.size() == num_neighbor;
+            for(int k = 0;ok && k<num_neighbor;++k)
+                ok = nearest[k].id == ans[k].second && nearest[k].r2 == ans[k].first;
+        }
+
+        std::vector<double> radius(num, 0);
+        std::vector<unsigned int> list;
+        for(int iteration = 0;ok && iteration<2;++iteration) { //without guess, then with a perturbed guess
+            tree3d.SolveSearchRadiusWithPeriodicBoundary(num_neighbor, tolerance, box, radius.data());
+            for(int i = 0;ok && i<num;++i) {
+                tree3d.FindNeighborParticleWithPeriodicBoundary(pos[i].data(), radius[i], box, list);
+                ok = num_neighbor - tolerance <= list.size() && list.size() <= num_neighbor + tolerance;
+                radius[i] *= 0.7 + 0.6*uni(mt)/5;
+            }
+        }
+        if(!ok) {
+            std::cout << "TEST13 FAILED. k-nearest neighbor or search radius is wrong\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    std::cout << "TEST13 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    std::cout << "\n";
+
+    //////////////////////////////////////////////TEST14//////////////////////////////////////////////////
+    std::cout << "TEST14 (Check for repeated rebuilds and memory footprint): \n";
+    {
+        constexpr int DIM3 = 3;
+        constexpr int num = 2000;
+        std::mt19937 mt(14);
+        std::uniform_real_distribution<double> uni(0, 4);
+        std::vector<std::array<double, DIM3>> pos(num);
+        Tree::StaticNeighborParticleSearchTree<DIM3> tree(num);
+        tree.Resize(num);
+
+        bool ok = true;
+        std::size_t footprint = 0;
+        std::vector<unsigned int> list;
+        for(int iteration = 0;ok && iteration<4;++iteration) {
+            for(int i = 0;i<num;++i)
+                for(int dim = 0;dim<DIM3;++dim) {
+                    pos[i][dim] = uni(mt);
+                    tree.CopyPos(pos[i][dim], i, dim);
+                }
+            if(iteration % 2 == 0)
+                tree.UpdateTree<Tree::BuildMode::MORTON>();
+            else
+                tree.UpdateTree();
+            ok = tree.NumCell() > 0;
+
+            //the arena keeps its capacity, so rebuilding a similar distribution does not grow the footprint much
+            if(iteration == 1)
+                footprint = tree.MemoryFootprint();
+            else if(iteration > 1)
+                ok = ok && tree.MemoryFootprint() <= 2*footprint;
+
+            auto moved = std::move(tree);
+            for(int q = 0;ok && q<50;++q) {
+                const double radius = 0.4;
+                moved.FindNeighborParticle(pos[q].data(), radius, list);
+                std::sort(list.begin(), list.end());
+                std::vector<unsigned int> ans;
+                for(unsigned int i = 0;i<num;++i) {
+                    double length = 0;
+                    for(int dim = 0;dim<DIM3;++dim)
+                        length += (pos[q][dim] - pos[i][dim])*(pos[q][dim] - pos[i][dim]);
+                    if(length <= radius*radius)
+                        ans.emplace_back(i);
+                }
+                ok = list == ans;
+            }
+            tree = std::move(moved);
+        }
+        if(!ok) {
+            std::cout << "TEST14 FAILED. Rebuilt tree is wrong\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    std::cout << "TEST14 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    std::cout << "\n";
+
+    //////////////////////////////////////////////TEST15//////////////////////////////////////////////////
+    std::cout << "TEST15 (Check for incremental refit): \n";
+    {
+        constexpr int DIM2 = 2;
+        constexpr int num = 3000;
+        std::mt19937 mt(15);
+        std::uniform_real_distribution<double> uni(0, 10);
+        std::uniform_real_distribution<double> kick(-0.02, 0.02);
+        std::vector<std::array<double, DIM2>> pos(num);
+        std::vector<double> radius(num);
+        Tree::StaticNeighborParticleSearchTree<DIM2> tree(num, 4);
+        tree.Resize(num);
+        tree.SetMaxMoverFraction(0.5);
+        for(int i = 0;i<num;++i) {
+            for(int dim = 0;dim<DIM2;++dim)
+                pos[i][dim] = uni(mt);
+            radius[i] = 0.2 + 0.02*uni(mt);
+        }
+
+        bool ok = true;
+        std::vector<std::vector<unsigned int>> list;
+        for(int step = 0;ok && step<6;++step) {
+            const bool jump = step == 4; //most particles leave their leaf, so the tree is rebuilt
+            for(int i = 0;i<num;++i) {
+                for(int dim = 0;dim<DIM2;++dim) {
+                    if(step > 0)
+                        pos[i][dim] = jump ? uni(mt) : std::min(std::max(pos[i][dim] + kick(mt), 0.0), 10.0);
+                    tree.CopyPos(pos[i][dim], i, dim);
+                }
+                if(step > 0)
+                    radius[i] *= 1 + kick(mt);
+                tree.CopySearchRadius(radius[i], i);
+            }
+            tree.UpdateTree<Tree::BuildMode::REFIT>();
+            if(step > 0 && !jump)
+                ok = tree.NumMover() < num/2;
+            else
+                ok = tree.NumMover() == num;
+
+            tree.FindAllNeighborParticle<Tree::SearchMode::SYMMETRY>(list);
+            for(int i = 0;ok && i<num;++i) {
+                std::vector<unsigned int> ans;
+                for(int j = 0;j<num;++j) {
+                    double length = 0;
+                    for(int dim = 0;dim<DIM2;++dim)
+                        length += (pos[i][dim] - pos[j][dim])*(pos[i][dim] - pos[j][dim]);
+                    if(length <= radius[i]*radius[i] || length <= radius[j]*radius[j])
+                        ans.emplace_back(j);
+                }
+                std::sort(list[i].begin(), list[i].end());
+                ok = list[i] == ans;
+            }
+        }
+        if(!ok) {
+            std::cout << "TEST15 FAILED. Refitted tree is wrong\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    std::cout << "TEST15 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    std::cout << "\n";
+
+    //////////////////////////////////////////////TEST16//////////////////////////////////////////////////
+    std::cout << "TEST16 (Check for Verlet neighbor list): \n";
+    {
+        constexpr int DIM3 = 3;
+        constexpr int num = 2000, num_step = 12;
+        std::mt19937 mt(16);
+        std::uniform_real_distribution<double> uni(0, 6);
+        std::uniform_real_distribution<double> kick(-0.01, 0.01);
+        std::vector<std::array<double, DIM3>> pos(num);
+        std::vector<double> radius(num);
+        const double box[DIM3] = {6, 6, 6};
+        Tree::VerletNeighborList verlet(DIM3, num, 0.1);
+        Tree::NeighborParticleSearchTree tree3d(DIM3, num);
+        verlet.Resize(num);
+        tree3d.Resize(num);
+        for(int i = 0;i<num;++i) {
+            for(int dim = 0;dim<DIM3;++dim)
+                pos[i][dim] = uni(mt);
+            radius[i] = 0.4 + 0.02*uni(mt);
+        }
+
+        bool ok = true;
+        Tree::CompressedNeighborList list, ans;
+        for(int step = 0;ok && step<num_step;++step) {
+            for(int i = 0;i<num;++i) {
+                for(int dim = 0;dim<DIM3;++dim) {
+                    if(step > 0)
+                        pos[i][dim] = std::fmod(pos[i][dim] + kick(mt) + 6, 6.0);
+                    verlet.CopyPos(pos[i][dim], i, dim);
+                    tree3d.CopyPos(pos[i][dim], i, dim);
+                }
+                if(step > 0)
+                    radius[i] *= 1 + kick(mt)/10;
+                verlet.CopySearchRadius(radius[i], i);
+                tree3d.CopySearchRadius(radius[i], i);
+            }
+            tree3d.UpdateTree();
+            verlet.FindAllNeighborParticleWithPeriodicBoundary<Tree::SearchMode::SYMMETRY>(box, list, true);
+            tree3d.FindAllNeighborParticleWithPeriodicBoundary<Tree::SearchMode::SYMMETRY>(box, ans, true);
+            ok = list.offset == ans.offset;
+            for(int i = 0;ok && i<num;++i) {
+                std::vector<unsigned int> a(list.begin(i), list.end(i)), b(ans.begin(i), ans.end(i));
+                std::sort(a.begin(), a.end());
+                std::sort(b.begin(), b.end());
+                ok = a == b;
+            }
+        }
+        //the candidates outlive most of the steps
+        ok = ok && 1 < verlet.NumRebuild() && verlet.NumRebuild() < num_step/2;
+        if(!ok) {
+            std::cout << "TEST16 FAILED. Verlet neighbor list is wrong\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    std::cout << "TEST16 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    std::cout << "\n";
+
+    //////////////////////////////////////////////TEST17//////////////////////////////////////////////////
+    std::cout << "TEST17 (Check for bulk copy and caller-owned buffers): \n";
+    {
+        constexpr int DIM3 = 3;
+        constexpr int num = 1500;
+        struct Particle {
+            double pos[DIM3];
+            double search_radius;
+            double mass;
+        };
+        std::mt19937 mt(17);
+        std::uniform_real_distribution<double> uni(0, 3);
+        std::vector<Particle> particle(num);
+        std::vector<double> soa(DIM3*num), aos(DIM3*num);
+
+        Tree::StaticNeighborParticleSearchTree<DIM3> tree_copy(num), tree_buffer(num);
+        Tree::NeighborParticleSearchTree tree_bulk(DIM3, num);
+        tree_copy.Resize(num);
+        tree_buffer.Resize(num);
+        tree_bulk.Resize(num);
+        tree_buffer.UsePosBuffer(soa.data(), 1, num);
+        tree_buffer.UseSearchRadiusBuffer(&particle[0].search_radius, sizeof(Particle)/sizeof(double));
+
+        bool ok = true;
+        std::vector<std::vector<unsigned int>> list_copy, list_buffer, list_bulk;
+        for(int iteration = 0;ok && iteration<3;++iteration) {
+            //the buffers are rewritten in place, the tree sees the new values at UpdateTree
+            for(int i = 0;i<num;++i) {
+                for(int dim = 0;dim<DIM3;++dim) {
+                    particle[i].pos[dim] = uni(mt);
+                    soa[num*dim + i] = aos[DIM3*i + dim] = particle[i].pos[dim];
+                    tree_copy.CopyPos(particle[i].pos[dim], i, dim);
+                }
+                particle[i].search_radius = 0.1 + 0.1*uni(mt);
+                tree_copy.CopySearchRadius(particle[i].search_radius, i);
+            }
+            tree_bulk.CopyAllPos(aos.data());
+            tree_bulk.CopyAllSearchRadius(&particle[0].search_radius, sizeof(Particle)/sizeof(double));
+
+            tree_copy.UpdateTree();
+            tree_buffer.UpdateTree<Tree::BuildMode::MORTON>();
+            tree_bulk.UpdateTree();
+            tree_copy.FindAllNeighborParticle<Tree::SearchMode::SYMMETRY>(list_copy);
+            tree_buffer.FindAllNeighborParticle<Tree::SearchMode::SYMMETRY>(list_buffer);
+            tree_bulk.FindAllNeighborParticle<Tree::SearchMode::SYMMETRY>(list_bulk);
+            for(int i = 0;ok && i<num;++i) {
+                std::sort(list_copy[i].begin(), list_copy[i].end());
+                std::sort(list_buffer[i].begin(), list_buffer[i].end());
+                std::sort(list_bulk[i].begin(), list_bulk[i].end());
+                ok = list_copy[i] == list_buffer[i] && list_copy[i] == list_bulk[i] && tree_buffer.GetPos(i, 2) == particle[i].pos[2];
+            }
+        }
+
+        //a single CopyPos takes a copy of the buffer first
+        tree_buffer.CopyPos(-1, 0, 0);
+        soa[num + 1] = -1;
+        ok = ok && tree_buffer.GetPos(0, 0) == -1 && tree_buffer.GetPos(1, 1) == particle[1].pos[1] && tree_buffer.GetPos(2, 0) == particle[2].pos[0];
+        if(!ok) {
+            std::cout << "TEST17 FAILED. Bulk copy or buffer is wrong\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    std::cout << "TEST17 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    std::cout << "\n";
+
+    //////////////////////////////////////////////TEST18//////////////////////////////////////////////////
+    std::cout << "TEST18 (Check for mixed precision): \n";
+    {
+        constexpr int DIM3 = 3;
+        constexpr int num = 4000, num_lattice = 10;
+        std::mt19937 mt(18);
+        std::uniform_real_distribution<double> uni(0, 10);
+        std::vector<std::array<double, DIM3>> pos(num);
+        std::vector<double> radius(num);
+        const double offset = 1000; //far from the origin
+        const double box[DIM3] = {10, 10, 10};
+        Tree::NeighborParticleSearchTree tree_full(DIM3, num), tree_mixed(DIM3, num, 8, Tree::Precision::MIXED);
+        tree_full.Resize(num);
+        tree_mixed.Resize(num);
+        for(int i = 0;i<num;++i) {
+            for(int dim = 0;dim<DIM3;++dim) {
+                //the lattice part puts many pairs exactly on the search radius
+                pos[i][dim] = offset + (i < num_lattice*num_lattice*num_lattice ? (i / (dim == 0 ? 1 : dim == 1 ? num_lattice : num_lattice*num_lattice)) % num_lattice : uni(mt));
+                tree_full.CopyPos(pos[i][dim], i, dim);
+                tree_mixed.CopyPos(pos[i][dim], i, dim);
+            }
+            radius[i] = i % 2 ? 1 : 0.5 + 0.1*uni(mt);
+            tree_full.CopySearchRadius(radius[i], i);
+            tree_mixed.CopySearchRadius(radius[i], i);
+        }
+        tree_full.UpdateTree();
+        tree_mixed.UpdateTree<Tree::BuildMode::MORTON>();
+
+        bool ok = true;
+        std::vector<Tree::NeighborParticle<3>> list_full, list_mixed;
+        auto same = [](std::vector<Tree::NeighborParticle<3>>& a, std::vector<Tree::NeighborParticle<3>>& b) {
+            auto by_id = [](const auto& l, const auto& r) { return l.id < r.id; };
+            std::sort(a.begin(), a.end(), by_id);
+            std::sort(b.begin(), b.end(), by_id);
+            if(a.size() != b.size())
+                return false;
+            for(std::size_t k = 0;k<a.size();++k)
+                if(a[k].id != b[k].id || a[k].r2 != b[k].r2 || a[k].dx != b[k].dx)
+                    return false;
+            return true;
+        };
+        for(int i = 0;ok && i<num;i += 7) {
+            tree_full.FindNeighborParticle(pos[i].data(), 2.0, list_full);
+            tree_mixed.FindNeighborParticle(pos[i].data(), 2.0, list_mixed);
+            ok = same(list_full, list_mixed);
+            tree_full.FindNeighborParticleWithPeriodicBoundary<Tree::SearchMode::SYMMETRY>(pos[i].data(), radius[i], box, list_full);
+            tree_mixed.FindNeighborParticleWithPeriodicBoundary<Tree::SearchMode::SYMMETRY>(pos[i].data(), radius[i], box, list_mixed);
+            ok = ok && same(list_full, list_mixed);
+            tree_full.FindNearestNeighborParticle(pos[i].data(), 20, list_full);
+            tree_mixed.FindNearestNeighborParticle(pos[i].data(), 20, list_mixed);
+            ok = ok && same(list_full, list_mixed);
+        }
+
+        Tree::CompressedNeighborList all_full, all_mixed;
+        tree_full.FindAllNeighborParticleWithPeriodicBoundary<Tree::SearchMode::SYMMETRY>(box, all_full, true);
+        tree_mixed.FindAllNeighborParticleWithPeriodicBoundary<Tree::SearchMode::SYMMETRY>(box, all_mixed, true);
+        ok = ok && all_full.offset == all_mixed.offset;
+        for(int i = 0;ok && i<num;++i) {
+            std::vector<unsigned int> a(all_full.begin(i), all_full.end(i)), b(all_mixed.begin(i), all_mixed.end(i));
+            std::sort(a.begin(), a.end());
+            std::sort(b.begin(), b.end());
+            ok = a == b;
+        }
+        ok = ok && tree_mixed.MemoryFootprint() > tree_full.MemoryFootprint();
+        if(!ok) {
+            std::cout << "TEST18 FAILED. Mixed precision result differs\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    std::cout << "TEST18 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    std::cout << "\n";
+
+    //////////////////////////////////////////////TEST19//////////////////////////////////////////////////
+    std::cout << "TEST19 (Check for dual tree walk of neighbor pairs): \n";
+    {
+        constexpr int DIM2 = 2;
+        constexpr int num = 3000;
+        std::mt19937 mt(19);
+        std::uniform_real_distribution<double> uni(0, 8);
+        const double box[DIM2] = {8, 8};
+        Tree::StaticNeighborParticleSearchTree<DIM2> tree(num, 6);
+        tree.Resize(num);
+        for(int i = 0;i<num;++i) {
+            for(int dim = 0;dim<DIM2;++dim)
+                tree.CopyPos(i < num/2 ? uni(mt) : 4 + uni(mt)/8, i, dim); //clustered half
+            tree.CopySearchRadius(0.05 + 0.05*uni(mt), i);
+        }
+        tree.UpdateTree<Tree::BuildMode::MORTON>();
+
+        bool ok = true;
+        for(int periodic = 0;ok && periodic<2;++periodic) {
+            //reference: half list of the group walk
+            Tree::CompressedNeighborList half;
+            if(periodic)
+                tree.FindAllNeighborParticleWithPeriodicBoundary<Tree::SearchMode::SYMMETRY>(box, half, true);
+            else
+                tree.FindAllNeighborParticle<Tree::SearchMode::SYMMETRY>(half, true);
+            std::vector<std::pair<unsigned int, unsigned int>> ans, pair_list;
+            for(unsigned int i = 0;i<num;++i)
+                for(const unsigned int* j = half.begin(i);j != half.end(i);++j)
+                    ans.emplace_back(i, *j);
+
+            if(periodic)
+                tree.FindAllNeighborPairWithPeriodicBoundary(box, pair_list);
+            else
+                tree.FindAllNeighborPair(pair_list);
+            std::sort(pair_list.begin(), pair_list.end());
+            std::sort(ans.begin(), ans.end());
+            ok = pair_list == ans;
+
+            //symmetric accumulation: every particle gets each of its pairs once
+            std::vector<int> count(num, 0), wrong(num, 0);
+            auto accumulate = [&](unsigned int i, unsigned int j, double r2, const double* dx) {
+                const int w = std::abs(r2 - (dx[0]*dx[0] + dx[1]*dx[1])) > 1e-12*r2;
+#pragma omp atomic
+                count[i] += 1;
+#pragma omp atomic
+                count[j] += 1;
+#pragma omp atomic
+                wrong[i] += w;
+            };
+            if(periodic)
+                tree.ForEachNeighborPairWithPeriodicBoundary(box, accumulate);
+            else
+                tree.ForEachNeighborPair(accumulate);
+            std::vector<int> degree(num, 0);
+            for(const auto& pair : ans)
+                ++degree[pair.first], ++degree[pair.second];
+            for(int i = 0;ok && i<num;++i)
+                ok = count[i] == degree[i] && wrong[i] == 0;
+        }
+        if(!ok) {
+            std::cout << "TEST19 FAILED. Neighbor pairs are wrong\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    std::cout << "TEST19 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    std::cout << "\n";
+    //////////////////////////////////////////////TEST20//////////////////////////////////////////////////
+    std::cout << "TEST20 (Check for count and weight sum of neighbor particles): \n";
+    {
+        constexpr int DIM3 = 3;
+        constexpr int num = 4000;
+        std::mt19937 mt(20);
+        std::uniform_real_distribution<double> uni(0, 8);
+        const double box[DIM3] = {8, 8, 8};
+        Tree::StaticNeighborParticleSearchTree<DIM3> tree(num, 8);
+        tree.Resize(num);
+        tree.SetNumWeight(2);
+        std::vector<double> mass(num);
+        for(int i = 0;i<num;++i) {
+            for(int dim = 0;dim<DIM3;++dim)
+                tree.CopyPos(i < num/2 ? uni(mt) : 2 + uni(mt)/4, i, dim); //clustered half
+            tree.CopySearchRadius(0.1 + 0.1*uni(mt), i);
+            mass[i] = 1 + uni(mt);
+            tree.CopyWeight(i, i, 1);
+        }
+        tree.CopyAllWeight(mass.data());
+
+        bool ok = true;
+        for(int step = 0;ok && step<2;++step) {
+            tree.UpdateTree();
+            for(int q = 0;ok && q<200;++q) {
+                const double pos[DIM3] = {uni(mt), uni(mt), uni(mt)};
+                const double radius = 0.2 + uni(mt)/4;
+                for(int periodic = 0;ok && periodic<2;++periodic)
+                for(int symmetry = 0;ok && symmetry<2;++symmetry) {
+                    std::vector<unsigned int> list;
+                    double sum[2], ans[2] = {0, 0};
+                    unsigned int count, count_sum;
+                    if(periodic && symmetry) {
+                        tree.FindNeighborParticleWithPeriodicBoundary<Tree::SearchMode::SYMMETRY>(pos, radius, box, list);
+                        count     = tree.CountNeighborParticleWithPeriodicBoundary<Tree::SearchMode::SYMMETRY>(pos, radius, box);
+                        count_sum = tree.SumNeighborWeightWithPeriodicBoundary<Tree::SearchMode::SYMMETRY>(pos, radius, box, sum);
+                    }else if(periodic) {
+                        tree.FindNeighborParticleWithPeriodicBoundary(pos, radius, box, list);
+                        count     = tree.CountNeighborParticleWithPeriodicBoundary(pos, radius, box);
+                        count_sum = tree.SumNeighborWeightWithPeriodicBoundary(pos, radius, box, sum);
+                    }else if(symmetry) {
+                        tree.FindNeighborParticle<Tree::SearchMode::SYMMETRY>(pos, radius, list);
+                        count     = tree.CountNeighborParticle<Tree::SearchMode::SYMMETRY>(pos, radius);
+                        count_sum = tree.SumNeighborWeight<Tree::SearchMode::SYMMETRY>(pos, radius, sum);
+                    }else {
+                        tree.FindNeighborParticle(pos, radius, list);
+                        count     = tree.CountNeighborParticle(pos, radius);
+                        count_sum = tree.SumNeighborWeight(pos, radius, sum);
+                    }
+                    for(unsigned int id : list)
+                        ans[0] += mass[id], ans[1] += id;
+                    ok = count == list.size() && count_sum == list.size() && std::abs(sum[0] - ans[0]) <= 1e-12*ans[0] && sum[1] == ans[1];
+                }
+            }
+            //move the cluster, the sums of the cells must follow
+            for(int i = num/2;i<num;++i)
+                tree.CopyPos(5 + uni(mt)/4, i, 0);
+        }
+        if(!ok) {
+            std::cout << "TEST20 FAILED. Count or weight sum is wrong\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    std::cout << "TEST20 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    std::cout << "\n";
+    //////////////////////////////////////////////TEST21//////////////////////////////////////////////////
+    std::cout << "TEST21 (Check for root fitted to an offset box and tight cell boxes): \n";
+    {
+        constexpr int DIM3 = 3;
+        constexpr int num = 3000;
+        std::mt19937 mt(21);
+        std::uniform_real_distribution<double> uni(0, 1);
+        const double lower[DIM3] = {1000, 1000, 1000}, upper[DIM3] = {1010, 1010, 1010};
+        const double box[DIM3] = {10, 10, 10};
+        std::vector<std::array<double, DIM3>> pos(num);
+        std::vector<double> radius(num);
+        for(int i = 0;i<num;++i) {
+            pos[i] = {1000 + 10*uni(mt), 1000 + 10*uni(mt), 1000 + uni(mt)}; //thin slab
+            radius[i] = 0.3 + 0.3*uni(mt);
+        }
+
+        //the same bodies around the origin build the same number of cells
+        Tree::NeighborParticleSearchTree origin(DIM3, num);
+        origin.Resize(num);
+        for(int i = 0;i<num;++i)
+            for(int dim = 0;dim<DIM3;++dim)
+                origin.CopyPos(pos[i][dim] - 1000, i, dim);
+        origin.UpdateTree();
+
+        bool ok = true;
+        for(int tight = 0;ok && tight<2;++tight)
+        for(int domain = 0;ok && domain<2;++domain) {
+            Tree::NeighborParticleSearchTree tree(DIM3, num);
+            tree.Resize(num);
+            tree.SetTightCellBox(tight);
+            if(domain)
+                tree.SetDomain(lower, upper);
+            for(int i = 0;i<num;++i) {
+                for(int dim = 0;dim<DIM3;++dim)
+                    tree.CopyPos(pos[i][dim], i, dim);
+                tree.CopySearchRadius(radius[i], i);
+            }
+            tree.UpdateTree();
+            if(!domain)
+                ok = tree.NumCell() <= origin.NumCell() + origin.NumCell()/100;
+
+            std::vector<unsigned int> list, ans;
+            for(int q = 0;ok && q<100;++q) {
+                const double point[DIM3] = {1000 + 10*uni(mt), 1000 + 10*uni(mt), 1000 + uni(mt)};
+                const double r = uni(mt);
+                tree.FindNeighborParticle(point, r, list);
+                ans = BruteForceNeighbor<Tree::SearchMode::GATHER, DIM3>(pos, radius, point, r);
+                std::sort(list.begin(), list.end());
+                ok = list == ans;
+                tree.FindNeighborParticleWithPeriodicBoundary<Tree::SearchMode::SYMMETRY>(point, r, box, list);
+                ans = BruteForceNeighbor<Tree::SearchMode::SYMMETRY, DIM3>(pos, radius, point, r, box);
+                std::sort(list.begin(), list.end());
+                ok = ok && list == ans;
+            }
+        }
+        if(!ok) {
+            std::cout << "TEST21 FAILED. Search in an offset box is wrong\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    std::cout << "TEST21 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    std::cout << "\n";
+    //////////////////////////////////////////////TEST22//////////////////////////////////////////////////
+    std::cout << "TEST22 (Check for periodic, shear and open axes set on the tree): \n";
+    {
+        constexpr int DIM3 = 3;
+        constexpr int num = 2500;
+        std::mt19937 mt(22);
+        std::uniform_real_distribution<double> uni(0, 1);
+        const double lower[DIM3] = {0, 0, 0}, upper[DIM3] = {10, 10, 4};
+        const double shear = 3.7; //y images shift along x
+        std::vector<std::array<double, DIM3>> pos(num);
+        std::vector<double> radius(num);
+        Tree::NeighborParticleSearchTree tree(DIM3, num);
+        tree.Resize(num);
+        tree.SetDomain(lower, upper);
+        tree.SetBoundary(0, Tree::Boundary::PERIODIC);
+        tree.SetBoundary(1, Tree::Boundary::SHEAR);
+        tree.SetShear(0, shear);
+        for(int i = 0;i<num;++i) {
+            pos[i] = {10*uni(mt), 10*uni(mt), 4*uni(mt)};
+            radius[i] = 0.3 + 0.5*uni(mt);
+            for(int dim = 0;dim<DIM3;++dim)
+                tree.CopyPos(pos[i][dim], i, dim);
+            tree.CopySearchRadius(radius[i], i);
+        }
+        tree.UpdateTree();
+
+        //squared distance to the nearest image of particle j
+        auto image_r2 = [&](const double* point, int j) {
+            double r2 = std::numeric_limits<double>::infinity();
+            for(int ny = -1;ny<=1;++ny)
+            for(int nx = -2;nx<=2;++nx) {
+                const double dx = point[0] - (pos[j][0] + 10*nx + shear*ny), dy = point[1] - (pos[j][1] + 10*ny), dz = point[2] - pos[j][2];
+                r2 = std::min(r2, dx*dx + dy*dy + dz*dz);
+            }
+            return r2;
+        };
+        auto brute_force = [&](const double* point, double r, bool symmetry) {
+            std::vector<unsigned int> list;
+            for(int j = 0;j<num;++j) {
+                const double r2 = image_r2(point, j);
+                if(r2 <= r*r || (symmetry && r2 <= radius[j]*radius[j]))
+                    list.emplace_back(j);
+            }
+            return list;
+        };
+
+        bool ok = true;
+        std::vector<unsigned int> list, ans;
+        for(int q = 0;ok && q<300;++q) {
+            const double point[DIM3] = {10*uni(mt), 10*uni(mt), 4*uni(mt)};
+            const double r = 0.2 + uni(mt);
+            tree.FindNeighborParticle(point, r, list);
+            ans = brute_force(point, r, false);
+            std::sort(list.begin(), list.end());
+            ok = list == ans && tree.CountNeighborParticle(point, r) == ans.size();
+            tree.FindNeighborParticle<Tree::SearchMode::SYMMETRY>(point, r, list);
+            ans = brute_force(point, r, true);
+            std::sort(list.begin(), list.end());
+            ok = ok && list == ans;
+
+            //k nearest, compared by distance
+            std::vector<Tree::NeighborParticle<3>> nearest;
+            tree.FindNearestNeighborParticle(point, 10, nearest);
+            std::vector<double> r2(num);
+            for(int j = 0;j<num;++j)
+                r2[j] = image_r2(point, j);
+            std::sort(r2.begin(), r2.end());
+            for(int k = 0;ok && k<10;++k)
+                ok = std::abs(nearest[k].r2 - r2[k]) <= 1e-12*r2[k];
+        }
+
+        std::vector<std::vector<unsigned int>> all;
+        tree.FindAllNeighborParticle<Tree::SearchMode::SYMMETRY>(all);
+        std::vector<std::pair<unsigned int, unsigned int>> pair_list, pair_ans;
+        tree.FindAllNeighborPair(pair_list);
+        for(int i = 0;ok && i<num;++i) {
+            ans = brute_force(pos[i].data(), radius[i], true);
+            ans.erase(std::find(ans.begin(), ans.end(), i));
+            std::sort(all[i].begin(), all[i].end());
+            all[i].erase(std::find(all[i].begin(), all[i].end(), i));
+            ok = all[i] == ans;
+            for(unsigned int j : ans)
+                if(j > static_cast<unsigned int>(i))
+                    pair_ans.emplace_back(i, j);
+        }
+        std::sort(pair_list.begin(), pair_list.end());
+        ok = ok && pair_list == pair_ans;
+        if(!ok) {
+            std::cout << "TEST22 FAILED. Search with the boundary of the tree is wrong\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    std::cout << "TEST22 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    std::cout << "\n";
+    //////////////////////////////////////////////TEST23//////////////////////////////////////////////////
+    std::cout << "TEST23 (Check for renumbering particles in tree order): \n";
+    {
+        constexpr int DIM3 = 3;
+        constexpr int num = 3000;
+        std::mt19937 mt(23);
+        std::uniform_real_distribution<double> uni(0, 1);
+        std::vector<double> pos(DIM3*num), radius(num), mass(num);
+        for(int i = 0;i<num;++i) {
+            for(int dim = 0;dim<DIM3;++dim)
+                pos[DIM3*i + dim] = 10*uni(mt);
+            radius[i] = 0.5 + 0.5*uni(mt);
+            mass[i]   = i;
+        }
+        Tree::NeighborParticleSearchTree tree(DIM3, num);
+        tree.Resize(num);
+        tree.SetNumWeight(1);
+        tree.CopyAllPos(pos.data());
+        tree.CopyAllSearchRadius(radius.data());
+        tree.CopyAllWeight(mass.data());
+        tree.UpdateTree();
+        Tree::CompressedNeighborList before, after;
+        tree.FindAllNeighborParticle<Tree::SearchMode::SYMMETRY>(before);
+
+        std::vector<unsigned int> order, rank;
+        tree.TreeOrder(order);
+        tree.TreeRank(rank);
+        bool ok = order.size() == num && rank.size() == num;
+        for(int k = 0;ok && k<num;++k)
+            ok = rank[order[k]] == static_cast<unsigned int>(k);
+
+        Tree::Reorder(order, pos.data(), DIM3);
+        Tree::Reorder(order, radius.data());
+        Tree::Reorder(order, mass.data());
+        tree.RenumberParticle(order);
+        for(int k = 0;ok && k<num;++k)
+            ok = tree.GetPos(k, 0) == pos[DIM3*k] && mass[k] == order[k];
+
+        //same neighbors under the new ids, without rebuilding
+        tree.FindAllNeighborParticle<Tree::SearchMode::SYMMETRY>(after);
+        for(int k = 0;ok && k<num;++k) {
+            std::vector<unsigned int> a(after.begin(k), after.end(k)), b;
+            for(const unsigned int* j = before.begin(order[k]);j != before.end(order[k]);++j)
+                b.emplace_back(rank[*j]);
+            std::sort(a.begin(), a.end());
+            std::sort(b.begin(), b.end());
+            ok = a == b;
+        }
+        std::vector<unsigned int> identity;
+        tree.TreeOrder(identity);
+        for(int k = 0;ok && k<num;++k)
+            ok = identity[k] == static_cast<unsigned int>(k);
+
+        //weights and refit follow the new ids
+        double sum;
+        const double center[DIM3] = {5, 5, 5};
+        std::vector<unsigned int> list;
+        tree.FindNeighborParticle(center, 2, list);
+        double ans = 0;
+        for(unsigned int id : list)
+            ans += mass[id];
+        ok = ok && tree.SumNeighborWeight(center, 2, &sum) == list.size() && sum == ans;
+        for(int k = 0;k<num;k += 100)
+            tree.CopyPos(pos[DIM3*k] + 0.5, k, 0);
+        tree.UpdateTree<Tree::BuildMode::REFIT>();
+        ok = ok && tree.NumMover() <= num/100;
+        tree.FindAllNeighborParticle<Tree::SearchMode::SYMMETRY>(after);
+        for(int k = 0;ok && k<num;k += 7) {
+            double point[DIM3];
+            for(int dim = 0;dim<DIM3;++dim)
+                point[dim] = tree.GetPos(k, dim);
+            tree.FindNeighborParticle<Tree::SearchMode::SYMMETRY>(point, radius[k], list);
+            std::vector<unsigned int> a(after.begin(k), after.end(k));
+            std::sort(a.begin(), a.end());
+            std::sort(list.begin(), list.end());
+            ok = a == list;
+        }
+        if(!ok) {
+            std::cout << "TEST23 FAILED. Renumbering is wrong\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    std::cout << "TEST23 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    std::cout << "\n";
+    //////////////////////////////////////////////TEST24//////////////////////////////////////////////////
+    std::cout << "TEST24 (Check for double-buffered tree rebuilt while querying): \n";
+    {
+        constexpr int DIM3 = 3;
+        constexpr int num = 4000;
+        std::mt19937 mt(24);
+        std::uniform_real_distribution<double> uni(0, 1);
+        std::vector<std::array<double, DIM3>> pos(num), old_pos;
+        std::vector<double> radius(num);
+        for(int i = 0;i<num;++i) {
+            for(int dim = 0;dim<DIM3;++dim)
+                pos[i][dim] = 10*uni(mt);
+            radius[i] = 0.3 + 0.3*uni(mt);
+        }
+        Tree::DoubleBufferedTree<Tree::StaticNeighborParticleSearchTree<DIM3>> tree(num);
+        tree.Resize(num);
+        tree.Configure([](Tree::StaticNeighborParticleSearchTree<DIM3>& t) { t.SetDomain(std::array<double, DIM3>{0, 0, 0}.data(), std::array<double, DIM3>{10, 10, 10}.data()); });
+        std::vector<unsigned int> list;
+        tree.Front()->FindNeighborParticle(pos[0].data(), 20, list);
+        bool ok = list.empty();
+
+        auto check = [&](const Tree::StaticNeighborParticleSearchTree<DIM3>& t, const std::vector<std::array<double, DIM3>>& p, int step) {
+            std::vector<unsigned int> list;
+            for(int k = step;k<num;k += 97) {
+                t.FindNeighborParticle<Tree::SearchMode::SYMMETRY>(p[k].data(), radius[k], list);
+                std::vector<unsigned int> ans = BruteForceNeighbor<Tree::SearchMode::SYMMETRY, DIM3>(p, radius, p[k].data(), radius[k]);
+                std::sort(list.begin(), list.end());
+                if(list != ans)
+                    return false;
+            }
+            return true;
+        };
+
+        for(int step = 0;ok && step<4;++step) {
+            for(int i = 0;i<num;++i)
+                for(int dim = 0;dim<DIM3;++dim)
+                    tree.CopyPos(pos[i][dim], i, dim);
+            tree.CopyAllSearchRadius(radius.data());
+            tree.StartUpdateTree<Tree::BuildMode::MORTON>();
+            //the front tree still holds the previous positions while the back one is built
+            if(step > 0) {
+                auto front = tree.Front();
+                ok = check(*front, old_pos, step);
+            }
+            old_pos = pos;
+            for(int i = 0;i<num;++i)
+                for(int dim = 0;dim<DIM3;++dim)
+                    pos[i][dim] = std::fmod(pos[i][dim] + 0.2*uni(mt), 10.0);
+            tree.SwapTree();
+            ok = ok && tree.isUpdateFinished() && check(*tree.Front(), old_pos, step);
+        }
+
+        //runtime tree, weights and a reader thread running across the swap
+        Tree::DoubleBufferedTree<Tree::NeighborParticleSearchTree> runtime_tree(DIM3, num);
+        runtime_tree.Resize(num);
+        runtime_tree.SetNumWeight(1);
+        for(int step = 0;ok && step<2;++step) {
+            for(int i = 0;i<num;++i) {
+                for(int dim = 0;dim<DIM3;++dim)
+                    runtime_tree.CopyPos(pos[i][dim], i, dim);
+                runtime_tree.CopyWeight(1.0, i);
+            }
+            runtime_tree.StartUpdateTree();
+            std::thread reader([&runtime_tree, step, &ok]() {
+                auto front = runtime_tree.Front();
+                const double center[DIM3] = {5, 5, 5};
+                double sum = 0;
+                if(step > 0 && front->SumNeighborWeight(center, 20, &sum) != num)
+                    ok = false;
+            });
+            runtime_tree.SwapTree();
+            reader.join();
+            double sum = 0;
+            const double center[DIM3] = {5, 5, 5};
+            ok = ok && runtime_tree.Front()->SumNeighborWeight(center, 20, &sum) == num && sum == num;
+        }
+        if(!ok) {
+            std::cout << "TEST24 FAILED. Double-buffered tree is wrong\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    std::cout << "TEST24 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    std::cout << "\n";
+    //////////////////////////////////////////////TEST25//////////////////////////////////////////////////
+    std::cout << "TEST25 (Check for build and traversal statistics): \n";
+    {
+        constexpr int DIM3 = 3;
+        constexpr int num = 3000;
+        std::mt19937 mt(25);
+        std::uniform_real_distribution<double> uni(0, 1);
+        std::vector<double> pos(DIM3*num), radius(num);
+        for(int i = 0;i<num;++i) {
+            for(int dim = 0;dim<DIM3;++dim)
+                pos[DIM3*i + dim] = 10*uni(mt);
+            radius[i] = 0.5 + 0.5*uni(mt);
+        }
+        Tree::NeighborParticleSearchTree tree(DIM3, num);
+        tree.Resize(num);
+        tree.CopyAllPos(pos.data());
+        tree.CopyAllSearchRadius(radius.data());
+        tree.UpdateTree();
+
+        std::size_t found = 0;
+        std::vector<unsigned int> list;
+        for(int k = 0;k<num;k += 10) {
+            tree.FindNeighborParticle<Tree::SearchMode::SYMMETRY>(&pos[DIM3*k], radius[k], list);
+            found += list.size();
+        }
+        const unsigned int count = tree.CountNeighborParticle(&pos[0], 3);
+        Tree::CompressedNeighborList all;
+        tree.FindAllNeighborParticle(all);
+        const Tree::BuildStatistics build = tree.GetBuildStatistics();
+        const Tree::TraversalStatistics traversal = tree.GetTraversalStatistics();
+#ifdef TREE_STATISTICS
+        //every body found is counted once, also from the threads of the batched query
+        bool ok = traversal.num_body_accepted == found + count + all.neighbor.size() && traversal.num_body_tested >= found + all.neighbor.size() && traversal.num_cell_visited > 0;
+        ok = ok && build.num_cell == tree.NumCell() && build.num_insert == num && build.num_new_cell == build.num_cell && build.num_leaf > 0 && build.num_load_step > 0
+                && build.max_depth > 0 && build.mean_depth <= build.max_depth && build.bytes == tree.MemoryFootprint() && build.total_time >= build.insert_time;
+        tree.ResetTraversalStatistics();
+        ok = ok && tree.GetTraversalStatistics().num_cell_visited == 0;
+
+        //REFIT keeps the cells of the last build
+        for(int i = 0;i<num;i += 100)
+            tree.CopyPos(pos[DIM3*i] + 0.3, i, 0);
+        tree.UpdateTree<Tree::BuildMode::REFIT>();
+        ok = ok && tree.GetBuildStatistics().num_insert == tree.NumMover() && tree.GetBuildStatistics().num_new_cell < tree.GetBuildStatistics().num_cell;
+#else
+        //not compiled in
+        bool ok = traversal.num_cell_visited == 0 && traversal.num_body_tested == 0 && traversal.num_body_accepted == 0 && build.num_cell == 0 && build.total_time == 0 && found > 0 && count > 0;
+#endif
+        if(!ok) {
+            std::cout << "TEST25 FAILED. Statistics are wrong\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    std::cout << "TEST25 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    std::cout << "\n";
+    //////////////////////////////////////////////TEST26//////////////////////////////////////////////////
+    std::cout << "TEST26 (Check for uniform grid backend): \n";
+    {
+        constexpr int DIM3 = 3;
+        constexpr int num = 4000;
+        const double L[DIM3] = {10, 10, 10}, lower[DIM3] = {0, 0, 0};
+        std::mt19937 mt(26);
+        std::uniform_real_distribution<double> uni(0, 1);
+        std::vector<std::array<double, DIM3>> pos(num);
+        std::vector<double> radius(num);
+        for(int i = 0;i<num;++i) {
+            for(int dim = 0;dim<DIM3;++dim)
+                pos[i][dim] = 10*uni(mt);
+            radius[i] = 0.8 + 0.2*uni(mt);
+        }
+        auto load = [&](auto& tree) {
+            tree.Resize(num);
+            for(int i = 0;i<num;++i) {
+                for(int dim = 0;dim<DIM3;++dim)
+                    tree.CopyPos(pos[i][dim], i, dim);
+                tree.CopySearchRadius(radius[i], i);
+            }
+        };
+        bool ok = true;
+        auto check = [&](const std::vector<unsigned int>& list, const std::vector<unsigned int>& ans) {
+            std::vector<unsigned int> sorted(list);
+            std::sort(sorted.begin(), sorted.end());
+            ok = ok && sorted == ans;
+        };
+
+        for(Tree::Precision precision : {Tree::Precision::FULL, Tree::Precision::MIXED}) {
+            Tree::StaticNeighborParticleSearchTree<DIM3> tree(num, 8, precision);
+            load(tree);
+            tree.SetBackend(Tree::Backend::AUTO);
+            tree.UpdateTree();
+            ok = ok && tree.ActiveBackend() == Tree::Backend::GRID;
+
+            std::vector<unsigned int> list;
+            for(int k = 0;k<num;k += 37) {
+                tree.FindNeighborParticle(pos[k].data(), radius[k], list);
+                check(list, BruteForceNeighbor<Tree::SearchMode::GATHER, DIM3>(pos, radius, pos[k].data(), radius[k]));
+                tree.FindNeighborParticle<Tree::SearchMode::SYMMETRY>(pos[k].data(), 0.1, list);
+                check(list, BruteForceNeighbor<Tree::SearchMode::SYMMETRY, DIM3>(pos, radius, pos[k].data(), 0.1));
+                tree.FindNeighborParticleWithPeriodicBoundary<Tree::SearchMode::SYMMETRY>(pos[k].data(), radius[k], L, list);
+                check(list, BruteForceNeighbor<Tree::SearchMode::SYMMETRY, DIM3>(pos, radius, pos[k].data(), radius[k], L));
+            }
+            std::vector<std::vector<unsigned int>> all;
+            tree.FindAllNeighborParticleWithPeriodicBoundary<Tree::SearchMode::SYMMETRY>(L, all);
+            for(int k = 0;k<num;k += 11)
+                check(all[k], BruteForceNeighbor<Tree::SearchMode::SYMMETRY, DIM3>(pos, radius, pos[k].data(), radius[k], L));
+
+            //boundary set on the tree, and the same lists as the tree backend
+            tree.SetDomain(lower, L);
+            for(int dim = 0;dim<DIM3;++dim)
+                tree.SetBoundary(dim, Tree::Boundary::PERIODIC);
+            tree.UpdateTree<Tree::BuildMode::REFIT>();
+            Tree::CompressedNeighborList grid_list, tree_list;
+            tree.FindAllNeighborParticle(grid_list);
+            tree.SetBackend(Tree::Backend::TREE);
+            tree.UpdateTree<Tree::BuildMode::REFIT>();
+            ok = ok && tree.ActiveBackend() == Tree::Backend::TREE;
+            tree.FindAllNeighborParticle(tree_list);
+            for(int k = 0;ok && k<num;++k) {
+                std::vector<unsigned int> a(grid_list.begin(k), grid_list.end(k)), b(tree_list.begin(k), tree_list.end(k));
+                std::sort(a.begin(), a.end());
+                std::sort(b.begin(), b.end());
+                ok = a == b;
+            }
+        }
+
+        //clustered bodies and unequal radii are left to the tree
+        Tree::NeighborParticleSearchTree clustered(DIM3, num);
+        load(clustered);
+        for(int i = 0;i<num/2;++i)
+            for(int dim = 0;dim<DIM3;++dim)
+                clustered.CopyPos(5 + 0.01*uni(mt), i, dim);
+        clustered.SetBackend(Tree::Backend::AUTO);
+        clustered.UpdateTree();
+        ok = ok && clustered.ActiveBackend() == Tree::Backend::TREE;
+        load(clustered);
+        clustered.CopySearchRadius(5, 0);
+        clustered.UpdateTree();
+        ok = ok && clustered.ActiveBackend() == Tree::Backend::TREE;
+        clustered.SetBackend(Tree::Backend::GRID);
+        clustered.UpdateTree();
+        std::vector<unsigned int> list;
+        clustered.FindNeighborParticle<Tree::SearchMode::SYMMETRY>(pos[1].data(), radius[1], list);
+        radius[0] = 5;
+        check(list, BruteForceNeighbor<Tree::SearchMode::SYMMETRY, DIM3>(pos, radius, pos[1].data(), radius[1]));
+        ok = ok && clustered.ActiveBackend() == Tree::Backend::GRID;
+        if(!ok) {
+            std::cout << "TEST26 FAILED. Grid backend is wrong\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    std::cout << "TEST26 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    std::cout << "\n";
+    //////////////////////////////////////////////TEST27//////////////////////////////////////////////////
+    std::cout << "TEST27 (Check for domain-decomposed tree with ghost particles): \n";
+    {
+        constexpr int DIM3 = 3;
+        constexpr int num = 6000;
+        const double lower[DIM3] = {0, 0, 0}, upper[DIM3] = {10, 10, 10};
+        std::mt19937 mt(27);
+        std::uniform_real_distribution<double> uni(0, 1);
+        std::vector<std::array<double, DIM3>> pos(num);
+        std::vector<double> radius(num);
+        for(int i = 0;i<num;++i) {
+            for(int dim = 0;dim<DIM3;++dim)
+                pos[i][dim] = 10*uni(mt);
+            radius[i] = 0.4 + 0.4*uni(mt);
+        }
+
+        //single tree of all particles, periodic along x and y
+        Tree::StaticNeighborParticleSearchTree<DIM3> all(num);
+        all.Resize(num);
+        all.CopyAllPos(pos[0].data());
+        all.CopyAllSearchRadius(radius.data());
+        all.SetDomain(lower, upper);
+        all.SetBoundary(0, Tree::Boundary::PERIODIC);
+        all.SetBoundary(1, Tree::Boundary::PERIODIC);
+        all.UpdateTree();
+        std::vector<std::vector<unsigned int>> gather, symmetry;
+        all.FindAllNeighborParticle(gather);
+        all.FindAllNeighborParticle<Tree::SearchMode::SYMMETRY>(symmetry);
+        for(int i = 0;i<num;++i) {
+            std::sort(gather[i].begin(), gather[i].end());
+            std::sort(symmetry[i].begin(), symmetry[i].end());
+        }
+
+        std::atomic<bool> ok{true};
+        for(int num_rank : {1, 4}) {
+            Tree::ThreadTransport::Group group(num_rank);
+            std::vector<std::atomic<int>> owner_count(num);
+            std::vector<unsigned int> num_local(num_rank), num_ghost(num_rank);
+            auto run = [&](int rank) {
+                Tree::DistributedNeighborParticleSearchTree<DIM3> tree(Tree::ThreadTransport(group, rank), 100);
+                tree.SetDomain(lower, upper);
+                tree.SetBoundary(0, Tree::Boundary::PERIODIC);
+                tree.SetBoundary(1, Tree::Boundary::PERIODIC);
+
+                //the last rank starts empty
+                std::vector<unsigned int> id;
+                std::vector<double> x, h;
+                for(int i = rank;i<num;i += std::max(1, num_rank-1))
+                    if(rank < num_rank-1 || num_rank == 1) {
+                        id.push_back(i);
+                        x.insert(x.end(), pos[i].begin(), pos[i].end());
+                        h.push_back(radius[i]);
+                    }
+
+                //second pass starts from the decomposition of the first
+                for(int pass = 0;pass<2;++pass) {
+                    tree.Resize(id.size());
+                    tree.CopyAllPos(x.data());
+                    tree.CopyAllSearchRadius(h.data());
+                    tree.UpdateTree();
+
+                    std::vector<unsigned int> local_id, ghost_id;
+                    tree.Migrate(id.data(), local_id);
+                    tree.ExchangeGhost(local_id.data(), ghost_id);
+                    auto global = [&](unsigned int j) { return j < tree.NumLocal() ? local_id[j] : ghost_id[j - tree.NumLocal()]; };
+
+                    std::vector<std::vector<unsigned int>> list_gather, list_symmetry;
+                    tree.FindAllNeighborParticle(list_gather);
+                    tree.FindAllNeighborParticle<Tree::SearchMode::SYMMETRY>(list_symmetry);
+                    std::atomic<unsigned int> num_pair{0};
+                    tree.ForEachAllNeighborParticle<Tree::SearchMode::SYMMETRY>([&](unsigned int, unsigned int, double, const double*) { ++num_pair; });
+                    unsigned int num_symmetry = 0;
+                    for(unsigned int i = 0;i<tree.NumLocal();++i) {
+                        for(unsigned int& j : list_gather[i])
+                            j = global(j);
+                        for(unsigned int& j : list_symmetry[i])
+                            j = global(j);
+                        std::sort(list_gather[i].begin(), list_gather[i].end());
+                        std::sort(list_symmetry[i].begin(), list_symmetry[i].end());
+                        num_symmetry += list_symmetry[i].size();
+                        if(list_gather[i] != gather[local_id[i]] || list_symmetry[i] != symmetry[local_id[i]] || tree.GetPos(i, 2) != pos[local_id[i]][2])
+                            ok = false;
+                        if(pass == 1)
+                            ++owner_count[local_id[i]];
+                    }
+                    ok = ok && num_pair == num_symmetry && ghost_id.size() == tree.NumGhost();
+
+                    id = local_id;
+                    tree.Migrate(x.data(), x, DIM3);
+                    tree.Migrate(h.data(), h);
+                }
+                num_local[rank] = tree.NumLocal();
+                num_ghost[rank] = tree.NumGhost();
+            };
+            std::vector<std::thread> ranks;
+            for(int rank = 0;rank<num_rank;++rank)
+                ranks.emplace_back(run, rank);
+            for(std::thread& t : ranks)
+                t.join();
+
+            for(int i = 0;i<num;++i)
+                ok = ok && owner_count[i] == 1;
+            const unsigned int share = num/num_rank;
+            for(int rank = 0;rank<num_rank;++rank) {
+                std::cout << "rank " << rank << "/" << num_rank << ": " << num_local[rank] << " local, " << num_ghost[rank] << " ghost particles\n";
+                ok = ok && 4*num_local[rank] > 3*share && 4*num_local[rank] < 5*share && num_ghost[rank] < num;
+            }
+        }
+        if(!ok) {
+            std::cout << "TEST27 FAILED. Distributed tree is wrong\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    std::cout << "TEST27 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    std::cout << "\n";
+    //////////////////////////////////////////////TEST28//////////////////////////////////////////////////
+    std::cout << "TEST28 (Check for writer of double-buffered tree waiting for a long query): \n";
+    {
+        constexpr int DIM3 = 3;
+        constexpr int num = 1000;
+        std::mt19937 mt(28);
+        std::uniform_real_distribution<double> uni(0, 10);
+        std::vector<std::array<double, DIM3>> pos(num);
+        std::vector<double> radius(num, 1.0);
+        for(int i = 0;i<num;++i)
+            for(int dim = 0;dim<DIM3;++dim)
+                pos[i][dim] = uni(mt);
+        auto load = [&](Tree::DoubleBufferedTree<Tree::StaticNeighborParticleSearchTree<DIM3>>& tree, double shift) {
+            for(int i = 0;i<num;++i)
+                for(int dim = 0;dim<DIM3;++dim)
+                    tree.CopyPos(pos[i][dim] + shift, i, dim);
+            tree.CopyAllSearchRadius(radius.data());
+        };
+
+        Tree::DoubleBufferedTree<Tree::StaticNeighborParticleSearchTree<DIM3>> tree(num);
+        tree.Resize(num);
+        load(tree, 0);
+        tree.StartUpdateTree();
+        tree.SwapTree();
+
+        //a query on the front runs longer than a second while the next tree is built, swapped and written
+        std::atomic<bool> holding{false}, released{false};
+        bool ok = true, reader_ok = true;
+        std::thread reader([&]() {
+            auto front = tree.Front();
+            holding = true;
+            std::vector<unsigned int> before, after;
+            front->FindNeighborParticle(pos[0].data(), radius[0], before);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+            front->FindNeighborParticle(pos[0].data(), radius[0], after);
+            std::sort(before.begin(), before.end());
+            std::sort(after.begin(), after.end());
+            if(before != after || before != BruteForceNeighbor<Tree::SearchMode::GATHER, DIM3>(pos, radius, pos[0].data(), radius[0]))
+                reader_ok = false;
+            released = true;
+        });
+        while(!holding)
+            std::this_thread::yield();
+
+        load(tree, 0.5);
+        tree.StartUpdateTree();
+        tree.SwapTree();
+        ok = ok && !tree.isBackFree();
+        const auto start = std::chrono::steady_clock::now();
+        load(tree, 1.0); //writes to the tree held by the reader, so waits for it
+        ok = ok && released && std::chrono::steady_clock::now() - start > std::chrono::milliseconds(500);
+        reader.join();
+        ok = ok && reader_ok;
+
+        tree.StartUpdateTree();
+        tree.SwapTree();
+        std::vector<std::array<double, DIM3>> moved(pos);
+        for(auto& p : moved)
+            for(double& x : p)
+                x += 1.0;
+        std::vector<unsigned int> list;
+        tree.Front()->FindNeighborParticle(moved[0].data(), radius[0], list);
+        std::sort(list.begin(), list.end());
+        ok = ok && tree.isBackFree() && list == BruteForceNeighbor<Tree::SearchMode::GATHER, DIM3>(moved, radius, moved[0].data(), radius[0]);
+        if(!ok) {
+            std::cout << "TEST28 FAILED. Writer of the double-buffered tree did not wait for the query\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    std::cout << "TEST28 PASSED\n";
+    //////////////////////////////////////////////////////////////////////////////////////////////////////
+}